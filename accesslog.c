@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2025 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/tree.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <imsg.h>
+
+#include "config.h"
+#include "log.h"
+#include "proc.h"
+
+#include "galileo.h"
+
+#define ACCESSLOG_FLUSH		(64 * 1024)	/* write out past this */
+#define ACCESSLOG_MAXBUF	(4 * 1024 * 1024) /* drop records past this */
+#define ACCESSLOG_INTERVAL	1		/* seconds */
+
+static int	accesslog_write1(void);
+static void	accesslog_flush(int, short, void *);
+
+static struct {
+	char		 path[PATH_MAX];
+	int		 mode;
+	int		 fd;
+	struct evbuffer	*buf;
+	struct event	 ev;
+	size_t		 dropped;
+} alog = { "", ACCESSLOG_NONE, -1 };
+
+/*
+ * (Re)open the access log.  The file is opened again at every reload
+ * so that it can be rotated; what's pending is written to the old
+ * one first.
+ */
+int
+accesslog_open(struct galileo *env)
+{
+	struct evbuffer	*buf;
+	int		 fd = -1;
+
+	if (env->sc_conf.access_log == ACCESSLOG_FILE &&
+	    (fd = open(env->sc_accesslog,
+	    O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644)) == -1) {
+		log_warn("%s: open %s", __func__, env->sc_accesslog);
+		return (-1);
+	}
+
+	if ((buf = evbuffer_new()) == NULL) {
+		log_warn("%s: evbuffer_new", __func__);
+		if (fd != -1)
+			close(fd);
+		return (-1);
+	}
+
+	accesslog_close();
+
+	(void)strlcpy(alog.path, env->sc_accesslog, sizeof(alog.path));
+	alog.mode = env->sc_conf.access_log;
+	alog.fd = fd;
+	alog.buf = buf;
+	evtimer_set(&alog.ev, accesslog_flush, NULL);
+
+	return (0);
+}
+
+void
+accesslog_close(void)
+{
+	if (alog.buf == NULL)
+		return;
+
+	if (alog.fd != -1) {
+		/* last chance, write out everything */
+		while (EVBUFFER_LENGTH(alog.buf) > 0 &&
+		    accesslog_write1() != -1)
+			;
+		accesslog_flush(-1, 0, NULL);
+		close(alog.fd);
+	}
+	evtimer_del(&alog.ev);
+
+	evbuffer_free(alog.buf);
+	alog.buf = NULL;
+	alog.fd = -1;
+	alog.mode = ACCESSLOG_NONE;
+	*alog.path = '\0';
+}
+
+/*
+ * Append a batch of records sent by a proxy.  Every record is a line
+ * already formatted; with syslog each one is a message on its own.
+ */
+void
+accesslog_write(struct galileo *env, struct imsg *imsg)
+{
+	struct timeval	 tv = { ACCESSLOG_INTERVAL, 0 };
+	char		*data = imsg->data, *nl;
+	size_t		 len = IMSG_DATA_SIZE(imsg);
+
+	if (len == 0 || data[len - 1] != '\n') {
+		log_warnx("%s: bad record from proxy %d", __func__,
+		    imsg->hdr.pid);
+		return;
+	}
+
+	switch (alog.mode) {
+	case ACCESSLOG_SYSLOG:
+		while (len > 0) {
+			nl = memchr(data, '\n', len);
+			syslog(LOG_INFO, "%.*s", (int)(nl - data), data);
+			len -= nl - data + 1;
+			data = nl + 1;
+		}
+		break;
+
+	case ACCESSLOG_FILE:
+		if (EVBUFFER_LENGTH(alog.buf) + len > ACCESSLOG_MAXBUF) {
+			while ((nl = memchr(data, '\n', len)) != NULL) {
+				alog.dropped++;
+				len -= nl - data + 1;
+				data = nl + 1;
+			}
+			break;
+		}
+
+		if (evbuffer_add(alog.buf, data, len) == -1) {
+			log_warn("%s: evbuffer_add", __func__);
+			break;
+		}
+
+		if (EVBUFFER_LENGTH(alog.buf) >= ACCESSLOG_FLUSH)
+			accesslog_flush(-1, 0, NULL);
+		else if (!evtimer_pending(&alog.ev, NULL))
+			evtimer_add(&alog.ev, &tv);
+		break;
+	}
+}
+
+/*
+ * Do one write of what was buffered.  On error the records are
+ * thrown away.
+ */
+static int
+accesslog_write1(void)
+{
+	if (evbuffer_write(alog.buf, alog.fd) > 0 || errno == EINTR)
+		return (0);
+
+	log_warn("%s: write %s", __func__, alog.path);
+	evbuffer_drain(alog.buf, EVBUFFER_LENGTH(alog.buf));
+	return (-1);
+}
+
+/*
+ * Write out what was buffered.  A regular file is always "ready" and
+ * the write blocks the parent until the disk takes it, so do only one
+ * per call: a short write is continued at the next tick while the
+ * records keep piling up in the buffer until ACCESSLOG_MAXBUF.
+ */
+static void
+accesslog_flush(int fd, short event, void *arg)
+{
+	struct timeval	 tv = { ACCESSLOG_INTERVAL, 0 };
+
+	evtimer_del(&alog.ev);
+
+	if (EVBUFFER_LENGTH(alog.buf) > 0 && accesslog_write1() == 0 &&
+	    EVBUFFER_LENGTH(alog.buf) > 0)
+		evtimer_add(&alog.ev, &tv);
+
+	if (alog.dropped != 0) {
+		log_warnx("access log: %zu records dropped", alog.dropped);
+		alog.dropped = 0;
+	}
+}
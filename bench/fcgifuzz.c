@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2025 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Feed a FastCGI session to fcgi_read() through a bufferevent that is
+ * not connected to anything.  The requests are answered right away
+ * with an empty reply instead of going to a Gemini server.
+ *
+ * Built with -DLIBFUZZER this is a libFuzzer target.  Otherwise it
+ * reads the session from the files given or from stdin, as AFL wants,
+ * and with -n replays them and reports the records per second.  -g
+ * writes a session that can be used as a seed.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <event.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "tmpl.h"
+
+#include "galileo.h"
+
+#define FCGI_BEGIN_REQUEST	1
+#define FCGI_PARAMS		4
+#define FCGI_STDIN		5
+#define FCGI_KEEP_CONN		1
+
+/* what proxy.c would provide */
+volatile int	 proxy_clients;
+uint32_t	 proxy_fcg_id;
+
+static struct galileo	 fuzzenv;
+static int		 inited;
+
+int	LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+accept_reserve(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
+    int reserve, volatile int *counter)
+{
+	return (-1);
+}
+
+void
+proxy_stamp(struct client *clt, int ts)
+{
+	return;
+}
+
+int
+proxy_start_request(struct galileo *env, struct client *clt)
+{
+	size_t	 len = 0;
+
+	/* make the sanitizers look at what was parsed */
+	if (clt->clt_server_name != NULL)
+		len += strlen(clt->clt_server_name);
+	if (clt->clt_script_name != NULL)
+		len += strlen(clt->clt_script_name);
+	if (clt->clt_path_info != NULL)
+		len += strlen(clt->clt_path_info);
+	if (clt->clt_query != NULL)
+		len += strlen(clt->clt_query);
+	if (clt->clt_body != NULL)
+		len += strlen(clt->clt_body);
+
+	return (fcgi_end_request(clt, len == 0));
+}
+
+void
+proxy_client_free(struct client *clt)
+{
+	template_free(clt->clt_tp);
+	clt_compress_free(clt);
+
+	free(clt->clt_body);
+	free(clt->clt_mime);
+	free(clt->clt_inm);
+	free(clt->clt_server_name);
+	free(clt->clt_script_name);
+	free(clt->clt_path_info);
+	free(clt->clt_query);
+	free(clt);
+
+	proxy_clients--;
+}
+
+/*
+ * Run one session.  The first byte says in how big chunks to feed
+ * the rest, to go through the paths where a record is incomplete.
+ */
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct fcgi	*fcgi;
+	size_t		 chunk, len;
+
+	if (!inited) {
+		/* log to stderr, but not the debug messages */
+		log_init(1, LOG_DAEMON);
+		log_setverbose(0);
+		log_procinit(getprogname());
+		event_init();
+		SPLAY_INIT(&fuzzenv.sc_fcgi_socks);
+		inited = 1;
+	}
+
+	if (size == 0)
+		return (0);
+	chunk = data[0] != 0 ? data[0] : size;
+	data++;
+	size--;
+
+	if ((fcgi = calloc(1, sizeof(*fcgi))) == NULL)
+		err(1, "calloc");
+	fcgi->fcg_id = ++proxy_fcg_id;
+	fcgi->fcg_s = -1;
+	fcgi->fcg_env = &fuzzenv;
+	fcgi->fcg_want = 0;	/* FCGI_RECORD_HEADER */
+	fcgi->fcg_toread = 8;	/* sizeof(struct fcgi_header) */
+	fcgi->fcg_keep_conn = 1;
+	SPLAY_INIT(&fcgi->fcg_clients);
+	evtimer_set(&fcgi->fcg_evwait, fcgi_deadline, fcgi);
+	if ((fcgi->fcg_bev = bufferevent_new(-1, fcgi_read, fcgi_write,
+	    fcgi_error, fcgi)) == NULL)
+		err(1, "bufferevent_new");
+#if HAVE_LIBEVENT2
+	evbuffer_unfreeze(EVBUFFER_INPUT(fcgi->fcg_bev), 0);
+#endif
+	SPLAY_INSERT(fcgi_tree, &fuzzenv.sc_fcgi_socks, fcgi);
+	fcgi_inflight++;
+
+	while (size > 0) {
+		len = chunk < size ? chunk : size;
+		if (evbuffer_add(EVBUFFER_INPUT(fcgi->fcg_bev), data,
+		    len) == -1)
+			err(1, "evbuffer_add");
+		data += len;
+		size -= len;
+
+		fcgi_read(fcgi->fcg_bev, fcgi);
+
+		/* fcgi_error() was called and fcgi is gone */
+		if (SPLAY_EMPTY(&fuzzenv.sc_fcgi_socks))
+			return (0);
+
+		evbuffer_drain(EVBUFFER_OUTPUT(fcgi->fcg_bev),
+		    EVBUFFER_LENGTH(EVBUFFER_OUTPUT(fcgi->fcg_bev)));
+	}
+
+	fcgi_error(fcgi->fcg_bev, EVBUFFER_EOF, fcgi);
+	return (0);
+}
+
+#ifndef LIBFUZZER
+
+static __dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-g requests | -n iterations] "
+	    "[file ...]\n", getprogname());
+	exit(1);
+}
+
+static void
+record(FILE *fp, int type, int id, const void *data, size_t len)
+{
+	unsigned char	 hdr[8];
+
+	hdr[0] = 1;
+	hdr[1] = type;
+	hdr[2] = id >> 8;
+	hdr[3] = id & 0xFF;
+	hdr[4] = len >> 8;
+	hdr[5] = len & 0xFF;
+	hdr[6] = (8 - len % 8) % 8;	/* padding, as most servers do */
+	hdr[7] = 0;
+
+	fwrite(hdr, 1, sizeof(hdr), fp);
+	fwrite(data, 1, len, fp);
+	fwrite("\0\0\0\0\0\0\0", 1, hdr[6], fp);
+}
+
+static size_t
+param(unsigned char *buf, const char *name, const char *value)
+{
+	size_t		 nlen, vlen, off = 0;
+
+	nlen = strlen(name);
+	vlen = strlen(value);
+	if (nlen > 127) {
+		buf[off++] = 0x80 | (nlen >> 24);
+		buf[off++] = nlen >> 16;
+		buf[off++] = nlen >> 8;
+	}
+	buf[off++] = nlen;
+	if (vlen > 127) {
+		buf[off++] = 0x80 | (vlen >> 24);
+		buf[off++] = vlen >> 16;
+		buf[off++] = vlen >> 8;
+	}
+	buf[off++] = vlen;
+	memcpy(buf + off, name, nlen);
+	memcpy(buf + off + nlen, value, vlen);
+	return (off + nlen + vlen);
+}
+
+/* a keep-alive session like httpd(8) sends, plus some odd params */
+static void
+generate(FILE *fp, int n)
+{
+	unsigned char	 begin[8] = { 0, 1, FCGI_KEEP_CONN };
+	unsigned char	 buf[4096];
+	char		 path[64];
+	size_t		 len;
+	int		 i;
+
+	fputc(0, fp);	/* feed it all at once */
+
+	for (i = 0; i < n; ++i) {
+		snprintf(path, sizeof(path), "/gemlog/%d.gmi", i);
+
+		record(fp, FCGI_BEGIN_REQUEST, 1, begin, sizeof(begin));
+
+		len = 0;
+		len += param(buf + len, "GATEWAY_INTERFACE", "CGI/1.1");
+		len += param(buf + len, "SERVER_PROTOCOL", "HTTP/1.1");
+		len += param(buf + len, "REQUEST_METHOD", "GET");
+		len += param(buf + len, "SERVER_NAME", "www.example.com");
+		len += param(buf + len, "SCRIPT_NAME", "");
+		len += param(buf + len, "PATH_INFO", path);
+		len += param(buf + len, "QUERY_STRING", "");
+		len += param(buf + len, "HTTP_ACCEPT_ENCODING",
+		    "gzip, deflate, br");
+		len += param(buf + len, "HTTP_IF_NONE_MATCH",
+		    "\"0123456789abcdef\"");
+		len += param(buf + len, "HTTP_USER_AGENT", "Mozilla/5.0 "
+		    "(X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+		    "Firefox/128.0");
+		len += param(buf + len, "HTTP_A_VERY_LONG_HEADER_NAME_"
+		    "THAT_GALILEO_IGNORES", "some value");
+		record(fp, FCGI_PARAMS, 1, buf, len);
+		record(fp, FCGI_PARAMS, 1, "", 0);
+		record(fp, FCGI_STDIN, 1, "", 0);
+	}
+
+	if (fflush(fp) == EOF)
+		err(1, "write");
+}
+
+static uint8_t *
+readall(int fd, const char *path, size_t *len)
+{
+	uint8_t		*buf = NULL, *t;
+	size_t		 cap = 0;
+	ssize_t		 r;
+
+	*len = 0;
+	for (;;) {
+		if (*len == cap) {
+			cap = cap == 0 ? BUFSIZ : cap * 2;
+			if ((t = realloc(buf, cap)) == NULL)
+				err(1, "realloc");
+			buf = t;
+		}
+		if ((r = read(fd, buf + *len, cap - *len)) == -1)
+			err(1, "read %s", path);
+		if (r == 0)
+			break;
+		*len += r;
+	}
+	return (buf);
+}
+
+/* the number of complete records in a session */
+static size_t
+records(const uint8_t *data, size_t len)
+{
+	size_t		 n = 0, rlen;
+
+	if (len == 0)
+		return (0);
+	data++;
+	len--;
+
+	while (len >= 8) {
+		rlen = 8 + ((data[4] << 8) | data[5]) + data[6];
+		if (rlen > len)
+			break;
+		data += rlen;
+		len -= rlen;
+		n++;
+	}
+	return (n);
+}
+
+static double
+now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+replay(const char *path, const uint8_t *data, size_t len, int n)
+{
+	double		 start, secs;
+	size_t		 nrec;
+	int		 i;
+
+	nrec = records(data, len);
+
+	start = now();
+	for (i = 0; i < n; ++i)
+		LLVMFuzzerTestOneInput(data, len);
+	secs = now() - start;
+
+	printf("%s: records=%zu bytes=%zu seconds=%.3f records/s=%.0f "
+	    "MBps=%.1f\n", path, nrec * n, len * n, secs, nrec * n / secs,
+	    (double)len * n / secs / 1024 / 1024);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*errstr;
+	uint8_t		*data;
+	size_t		 len;
+	int		 ch, fd, gen = 0, n = 0;
+
+	while ((ch = getopt(argc, argv, "g:n:")) != -1) {
+		switch (ch) {
+		case 'g':
+			gen = strtonum(optarg, 1, 10000, &errstr);
+			if (errstr != NULL)
+				errx(1, "requests are %s: %s", errstr, optarg);
+			break;
+		case 'n':
+			n = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "iterations are %s: %s", errstr,
+				    optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (gen != 0) {
+		if (argc != 0 || n != 0)
+			usage();
+		generate(stdout, gen);
+		return (0);
+	}
+
+	if (argc == 0) {
+		data = readall(STDIN_FILENO, "stdin", &len);
+		if (n == 0)
+			LLVMFuzzerTestOneInput(data, len);
+		else
+			replay("stdin", data, len, n);
+		free(data);
+		return (0);
+	}
+
+	for (; argc > 0; --argc, ++argv) {
+		if ((fd = open(*argv, O_RDONLY)) == -1)
+			err(1, "open %s", *argv);
+		data = readall(fd, *argv, &len);
+		close(fd);
+
+		if (n == 0)
+			LLVMFuzzerTestOneInput(data, len);
+		else
+			replay(*argv, data, len, n);
+		free(data);
+	}
+
+	return (0);
+}
+
+#endif /* LIBFUZZER */
@@ -0,0 +1,482 @@
+/*
+ * Copyright (c) 2025 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A FastCGI load generator: keeps a number of requests in flight on
+ * galileo's socket, like httpd(8) would, and reports the throughput
+ * and the latencies as a line of key=value pairs.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#define FCGI_HEADER_LEN		8
+#define FCGI_VERSION_1		1
+#define FCGI_BEGIN_REQUEST	1
+#define FCGI_END_REQUEST	3
+#define FCGI_PARAMS		4
+#define FCGI_STDIN		5
+#define FCGI_STDOUT		6
+#define FCGI_RESPONDER		1
+#define FCGI_KEEP_CONN		1
+
+struct lclient {
+	int			 fd;
+	struct bufferevent	*bev;
+	struct event		 retry;
+	struct timespec		 start;
+	int			 path;
+	int			 status;
+};
+
+static struct sockaddr_storage	 ss;
+static socklen_t		 sslen;
+static const char		*target;
+static struct evbuffer		**reqs;
+static int			 nreqs;
+static int			 keepconn;
+static struct timespec		 t0;
+
+static long long		 todo = -1;	/* requests to start */
+static long long		 done, errors, bytes;
+static long long		 status[6];
+static int			 active;
+static int			 stopping;
+
+static uint32_t			*lat;		/* usec */
+static size_t			 nlat, latcap;
+
+static void	lclient_start(struct lclient *);
+
+static __dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-kz] [-c clients] [-H host] "
+	    "[-n requests | -t seconds] socket | host:port path ...\n", getprogname());
+	exit(1);
+}
+
+static void
+record(struct evbuffer *buf, int type, const void *data, size_t len)
+{
+	unsigned char	 hdr[FCGI_HEADER_LEN];
+
+	hdr[0] = FCGI_VERSION_1;
+	hdr[1] = type;
+	hdr[2] = 0;		/* request id 1 */
+	hdr[3] = 1;
+	hdr[4] = len >> 8;
+	hdr[5] = len & 0xFF;
+	hdr[6] = 0;		/* padding */
+	hdr[7] = 0;
+
+	if (evbuffer_add(buf, hdr, sizeof(hdr)) == -1 ||
+	    evbuffer_add(buf, data, len) == -1)
+		err(1, "evbuffer_add");
+}
+
+static void
+param_len(struct evbuffer *buf, size_t len)
+{
+	unsigned char	 l[4];
+
+	if (len < 128) {
+		l[0] = len;
+		if (evbuffer_add(buf, l, 1) == -1)
+			err(1, "evbuffer_add");
+		return;
+	}
+
+	l[0] = ((len >> 24) & 0x7F) | 0x80;
+	l[1] = len >> 16;
+	l[2] = len >> 8;
+	l[3] = len;
+	if (evbuffer_add(buf, l, 4) == -1)
+		err(1, "evbuffer_add");
+}
+
+static void
+param(struct evbuffer *buf, const char *name, const char *value)
+{
+	param_len(buf, strlen(name));
+	param_len(buf, strlen(value));
+	if (evbuffer_add(buf, name, strlen(name)) == -1 ||
+	    evbuffer_add(buf, value, strlen(value)) == -1)
+		err(1, "evbuffer_add");
+}
+
+/* the whole request for path, ready to be copied on the socket */
+static struct evbuffer *
+build_request(const char *host, const char *path, int gzip)
+{
+	struct evbuffer	*req, *params;
+	unsigned char	 begin[8];
+
+	if ((req = evbuffer_new()) == NULL ||
+	    (params = evbuffer_new()) == NULL)
+		err(1, "evbuffer_new");
+
+	memset(begin, 0, sizeof(begin));
+	begin[1] = FCGI_RESPONDER;
+	begin[2] = keepconn ? FCGI_KEEP_CONN : 0;
+	record(req, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+
+	param(params, "GATEWAY_INTERFACE", "CGI/1.1");
+	param(params, "SERVER_PROTOCOL", "HTTP/1.1");
+	param(params, "REQUEST_METHOD", "GET");
+	param(params, "SERVER_NAME", host);
+	param(params, "SCRIPT_NAME", "");
+	param(params, "PATH_INFO", path);
+	param(params, "QUERY_STRING", "");
+	if (gzip)
+		param(params, "HTTP_ACCEPT_ENCODING", "gzip");
+	if (EVBUFFER_LENGTH(params) > 65535)
+		errx(1, "request too big: %s", path);
+
+	record(req, FCGI_PARAMS, EVBUFFER_DATA(params),
+	    EVBUFFER_LENGTH(params));
+	record(req, FCGI_PARAMS, NULL, 0);
+	record(req, FCGI_STDIN, NULL, 0);
+
+	evbuffer_free(params);
+	return (req);
+}
+
+static uint64_t
+elapsed(struct timespec *since)
+{
+	struct timespec	 now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - since->tv_sec) * 1000000 +
+	    (now.tv_nsec - since->tv_nsec) / 1000);
+}
+
+static void
+lclient_close(struct lclient *c)
+{
+	if (c->bev != NULL)
+		bufferevent_free(c->bev);
+	if (c->fd != -1)
+		close(c->fd);
+	c->bev = NULL;
+	c->fd = -1;
+}
+
+static void
+lclient_next(struct lclient *c)
+{
+	if (!stopping && todo != 0) {
+		lclient_start(c);
+		return;
+	}
+
+	lclient_close(c);
+	if (--active == 0)
+		event_loopexit(NULL);
+}
+
+static void
+lclient_done(struct lclient *c)
+{
+	uint32_t	*t;
+
+	if (nlat == latcap) {
+		latcap = latcap ? latcap * 2 : 4096;
+		if ((t = reallocarray(lat, latcap, sizeof(*lat))) == NULL)
+			err(1, "reallocarray");
+		lat = t;
+	}
+	lat[nlat++] = elapsed(&c->start);
+
+	done++;
+	if (c->status >= 100 && c->status < 600)
+		status[c->status / 100]++;
+	else
+		status[0]++;
+
+	if (!keepconn)
+		lclient_close(c);
+	lclient_next(c);
+}
+
+static void
+lclient_read(struct bufferevent *bev, void *arg)
+{
+	struct lclient	*c = arg;
+	struct evbuffer	*in = EVBUFFER_INPUT(bev);
+	unsigned char	*hdr;
+	const char	*s;
+	size_t		 len, tot;
+
+	for (;;) {
+		if (EVBUFFER_LENGTH(in) < FCGI_HEADER_LEN)
+			return;
+		hdr = EVBUFFER_DATA(in);
+		len = (hdr[4] << 8) | hdr[5];
+		tot = FCGI_HEADER_LEN + len + hdr[6];
+		if (EVBUFFER_LENGTH(in) < tot)
+			return;
+
+		switch (hdr[1]) {
+		case FCGI_STDOUT:
+			/* the status is on the first line of the reply */
+			if (c->status == 0 && len > 11 &&
+			    !memcmp(hdr + FCGI_HEADER_LEN, "Status: ", 8)) {
+				s = (char *)hdr + FCGI_HEADER_LEN + 8;
+				c->status = (s[0] - '0') * 100 +
+				    (s[1] - '0') * 10 + (s[2] - '0');
+			} else if (c->status == 0)
+				c->status = -1;
+			bytes += len;
+			break;
+		case FCGI_END_REQUEST:
+			evbuffer_drain(in, tot);
+			lclient_done(c);
+			return;
+		}
+
+		evbuffer_drain(in, tot);
+	}
+}
+
+static void
+lclient_error(struct bufferevent *bev, short what, void *arg)
+{
+	struct lclient	*c = arg;
+
+	errors++;
+	lclient_close(c);
+	lclient_next(c);
+}
+
+static void
+lclient_retry(int fd, short event, void *arg)
+{
+	lclient_next(arg);
+}
+
+static void
+lclient_start(struct lclient *c)
+{
+	struct timeval	 tv = { 0, 10000 };
+
+	if (todo > 0)
+		todo--;
+
+	c->status = 0;
+	c->path = (c->path + 1) % nreqs;
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+
+	if (c->fd == -1) {
+		if ((c->fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK,
+		    0)) == -1)
+			err(1, "socket");
+		if (connect(c->fd, (struct sockaddr *)&ss, sslen) == -1 &&
+		    errno != EINPROGRESS) {
+			if (errno != EAGAIN)
+				err(1, "connect: %s", target);
+
+			/* the backlog is full, try again in a bit */
+			if (todo != -1)
+				todo++;
+			errors++;
+			close(c->fd);
+			c->fd = -1;
+			evtimer_set(&c->retry, lclient_retry, c);
+			evtimer_add(&c->retry, &tv);
+			return;
+		}
+		c->bev = bufferevent_new(c->fd, lclient_read, NULL,
+		    lclient_error, c);
+		if (c->bev == NULL)
+			err(1, "bufferevent_new");
+		bufferevent_enable(c->bev, EV_READ|EV_WRITE);
+	}
+
+	if (evbuffer_add(EVBUFFER_OUTPUT(c->bev), EVBUFFER_DATA(reqs[c->path]),
+	    EVBUFFER_LENGTH(reqs[c->path])) == -1)
+		err(1, "evbuffer_add");
+	bufferevent_enable(c->bev, EV_WRITE);
+}
+
+/* a path to a local socket or host:port, [host]:port for IPv6 */
+static void
+resolve(const char *addr)
+{
+	struct addrinfo		 hints, *res;
+	struct sockaddr_un	*sun = (struct sockaddr_un *)&ss;
+	char			 buf[NI_MAXHOST], *port;
+	int			 error;
+
+	if (strchr(addr, '/') != NULL) {
+		sun->sun_family = AF_UNIX;
+		if (strlcpy(sun->sun_path, addr, sizeof(sun->sun_path)) >=
+		    sizeof(sun->sun_path))
+			errx(1, "socket path too long: %s", addr);
+		sslen = sizeof(*sun);
+		return;
+	}
+
+	if (strlcpy(buf, addr, sizeof(buf)) >= sizeof(buf))
+		errx(1, "address too long: %s", addr);
+	if ((port = strrchr(buf, ':')) == NULL)
+		errx(1, "not a socket path or host:port: %s", addr);
+	*port++ = '\0';
+	addr = buf;
+	if (*buf == '[' && port - buf > 2 && port[-2] == ']') {
+		port[-2] = '\0';
+		addr = buf + 1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(addr, port, &hints, &res)) != 0)
+		errx(1, "%s: %s", target, gai_strerror(error));
+	memcpy(&ss, res->ai_addr, res->ai_addrlen);
+	sslen = res->ai_addrlen;
+	freeaddrinfo(res);
+}
+
+static void
+stop(int fd, short event, void *arg)
+{
+	stopping = 1;
+	event_loopexit(NULL);
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	uint32_t	 x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static double
+pct(double p)
+{
+	if (nlat == 0)
+		return (0);
+	return (lat[(size_t)(p * (nlat - 1))] / 1000.0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct lclient	*clients;
+	struct event	 ev;
+	struct timeval	 tv = { 10, 0 };
+	const char	*host = "localhost", *errstr;
+	double		 secs;
+	int		 ch, i, nclients = 16, gzip = 0;
+
+	while ((ch = getopt(argc, argv, "c:H:kn:t:z")) != -1) {
+		switch (ch) {
+		case 'c':
+			nclients = strtonum(optarg, 1, 10000, &errstr);
+			if (errstr != NULL)
+				errx(1, "clients is %s: %s", errstr, optarg);
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'k':
+			keepconn = 1;
+			break;
+		case 'n':
+			todo = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "requests is %s: %s", errstr, optarg);
+			break;
+		case 't':
+			tv.tv_sec = strtonum(optarg, 1, 24 * 60 * 60, &errstr);
+			if (errstr != NULL)
+				errx(1, "seconds is %s: %s", errstr, optarg);
+			break;
+		case 'z':
+			gzip = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2)
+		usage();
+
+	target = argv[0];
+	resolve(target);
+
+	nreqs = argc - 1;
+	if ((reqs = calloc(nreqs, sizeof(*reqs))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nreqs; ++i)
+		reqs[i] = build_request(host, argv[i + 1], gzip);
+
+	if ((clients = calloc(nclients, sizeof(*clients))) == NULL)
+		err(1, "calloc");
+
+	signal(SIGPIPE, SIG_IGN);
+	event_init();
+
+	if (todo == -1) {
+		evtimer_set(&ev, stop, NULL);
+		evtimer_add(&ev, &tv);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nclients && todo != 0; ++i) {
+		clients[i].fd = -1;
+		clients[i].path = i % nreqs;
+		active++;
+		lclient_start(&clients[i]);
+	}
+
+	event_dispatch();
+
+	secs = elapsed(&t0) / 1000000.0;
+	qsort(lat, nlat, sizeof(*lat), cmp);
+
+	printf("clients=%d requests=%lld errors=%lld seconds=%.2f "
+	    "rps=%.1f MBps=%.2f 2xx=%lld 3xx=%lld 4xx=%lld 5xx=%lld "
+	    "p50=%.2f p90=%.2f p99=%.2f max=%.2f\n", nclients, done, errors,
+	    secs, done / secs, bytes / secs / 1024 / 1024, status[2],
+	    status[3], status[4], status[5], pct(.5), pct(.9), pct(.99),
+	    pct(1));
+
+	return (0);
+}
@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2025 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A Gemini server that stands in for the real ones when benchmarking
+ * galileo.  It serves synthetic bodies of the size in the URL:
+ *
+ *	gemini://host/gmi/<bytes>	text/gemini
+ *	gemini://host/bin/<bytes>	application/octet-stream
+ *
+ * optionally after a delay, and with or without TLS.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifndef nitems
+#define nitems(_a)	(sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
+#define MINIMUM(a, b)	((a) < (b) ? (a) : (b))
+
+#define PATTERN_SIZE	(64 * 1024)
+#define REQUEST_MAX	(1024 + 2)	/* URL and CRLF */
+#define BODY_MAX	(1024 * 1024 * 1024)
+#define WRITE_BATCH	(256 * 1024)	/* per callback */
+
+#define WANT		-2
+
+enum {
+	S_READ,
+	S_WAIT,
+	S_WRITE,
+};
+
+struct conn {
+	int		 fd;
+	struct tls	*ctx;
+	struct event	 ev;
+	int		 state;
+	char		 req[REQUEST_MAX + 1];
+	size_t		 reqlen;
+	char		 hdr[64];
+	size_t		 hdrlen;
+	size_t		 hdroff;
+	const char	*body;
+	size_t		 bodylen;
+	size_t		 sent;
+};
+
+static char		 gmi[PATTERN_SIZE];
+static char		 bin[PATTERN_SIZE];
+static struct tls	*tlsctx;
+static struct timeval	 delay;
+
+static __dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-c cert -k key] [-d msec] [-p port]\n",
+	    getprogname());
+	exit(1);
+}
+
+/* gemtext with a bit of everything, and some bytes that look random */
+static void
+fill_patterns(void)
+{
+	static const char	*lines[] = {
+		"# A heading\n",
+		"Some text long enough to wrap in the browser, with "
+		    "<angle brackets> & ampersands to escape.\n",
+		"=> gemini://example.com/a/link/somewhere A link\n",
+		"=> /relative/link.gmi\n",
+		"=> https://example.com/image.png An image\n",
+		"* an item\n",
+		"* another item\n",
+		"> a quote\n",
+		"```\n",
+		"  preformatted <text>\n",
+		"```\n",
+		"\n",
+	};
+	size_t			 i, len, off = 0;
+	uint32_t		 x = 0x12345678;
+
+	for (i = 0;; i = (i + 1) % nitems(lines)) {
+		len = strlen(lines[i]);
+		if (off + len >= sizeof(gmi))
+			break;
+		memcpy(gmi + off, lines[i], len);
+		off += len;
+	}
+	memset(gmi + off, 'x', sizeof(gmi) - off - 1);
+	gmi[sizeof(gmi) - 1] = '\n';
+
+	for (i = 0; i < sizeof(bin); ++i) {
+		x = x * 1103515245 + 12345;
+		bin[i] = x >> 16;
+	}
+}
+
+static ssize_t
+conn_recv(struct conn *c, void *buf, size_t len, short *want)
+{
+	ssize_t	 n;
+
+	if (c->ctx == NULL) {
+		if ((n = read(c->fd, buf, len)) == -1 &&
+		    (errno == EAGAIN || errno == EINTR)) {
+			*want = EV_READ;
+			return (WANT);
+		}
+		return (n);
+	}
+
+	switch (n = tls_read(c->ctx, buf, len)) {
+	case TLS_WANT_POLLIN:
+		*want = EV_READ;
+		return (WANT);
+	case TLS_WANT_POLLOUT:
+		*want = EV_WRITE;
+		return (WANT);
+	}
+	return (n);
+}
+
+static ssize_t
+conn_send(struct conn *c, const void *buf, size_t len, short *want)
+{
+	ssize_t	 n;
+
+	if (c->ctx == NULL) {
+		if ((n = write(c->fd, buf, len)) == -1 &&
+		    (errno == EAGAIN || errno == EINTR)) {
+			*want = EV_WRITE;
+			return (WANT);
+		}
+		return (n);
+	}
+
+	switch (n = tls_write(c->ctx, buf, len)) {
+	case TLS_WANT_POLLIN:
+		*want = EV_READ;
+		return (WANT);
+	case TLS_WANT_POLLOUT:
+		*want = EV_WRITE;
+		return (WANT);
+	}
+	return (n);
+}
+
+static void	conn_io(int, short, void *);
+
+static void
+conn_wait(struct conn *c, short what)
+{
+	event_set(&c->ev, c->fd, what, conn_io, c);
+	event_add(&c->ev, NULL);
+}
+
+static void
+conn_close(struct conn *c)
+{
+	event_del(&c->ev);
+	if (c->ctx != NULL) {
+		(void)tls_close(c->ctx);
+		tls_free(c->ctx);
+	}
+	close(c->fd);
+	free(c);
+}
+
+static void
+conn_route(struct conn *c)
+{
+	const char	*p, *errstr;
+	long long	 size;
+
+	c->hdrlen = strlcpy(c->hdr, "51 Not found\r\n", sizeof(c->hdr));
+	c->bodylen = 0;
+
+	if ((p = strstr(c->req, "://")) == NULL ||
+	    (p = strchr(p + 3, '/')) == NULL)
+		return;
+
+	if (!strncmp(p, "/gmi/", 5))
+		c->body = gmi;
+	else if (!strncmp(p, "/bin/", 5))
+		c->body = bin;
+	else
+		return;
+
+	size = strtonum(p + 5, 0, BODY_MAX, &errstr);
+	if (errstr != NULL)
+		return;
+
+	c->bodylen = size;
+	c->hdrlen = snprintf(c->hdr, sizeof(c->hdr), "20 %s\r\n",
+	    c->body == gmi ? "text/gemini" : "application/octet-stream");
+}
+
+static void
+conn_read(struct conn *c)
+{
+	char		*crlf;
+	ssize_t		 n;
+	short		 want = EV_READ;
+
+	for (;;) {
+		n = conn_recv(c, c->req + c->reqlen,
+		    sizeof(c->req) - 1 - c->reqlen, &want);
+		if (n == WANT) {
+			conn_wait(c, want);
+			return;
+		}
+		if (n <= 0) {
+			conn_close(c);
+			return;
+		}
+
+		c->reqlen += n;
+		c->req[c->reqlen] = '\0';
+		if ((crlf = strstr(c->req, "\r\n")) != NULL)
+			break;
+		if (c->reqlen == sizeof(c->req) - 1) {
+			conn_close(c);
+			return;
+		}
+	}
+
+	*crlf = '\0';
+	conn_route(c);
+
+	if (delay.tv_sec != 0 || delay.tv_usec != 0) {
+		c->state = S_WAIT;
+		evtimer_set(&c->ev, conn_io, c);
+		evtimer_add(&c->ev, &delay);
+		return;
+	}
+
+	c->state = S_WRITE;
+	conn_wait(c, EV_WRITE);
+}
+
+static void
+conn_write(struct conn *c)
+{
+	const char	*buf;
+	size_t		 len, off, done = 0;
+	ssize_t		 n;
+	short		 want = EV_WRITE;
+
+	for (;;) {
+		if (c->hdroff < c->hdrlen) {
+			buf = c->hdr + c->hdroff;
+			len = c->hdrlen - c->hdroff;
+		} else if (c->sent < c->bodylen) {
+			off = c->sent % PATTERN_SIZE;
+			buf = c->body + off;
+			len = MINIMUM(PATTERN_SIZE - off, c->bodylen - c->sent);
+		} else {
+			conn_close(c);
+			return;
+		}
+
+		/* give the other connections a chance too */
+		if (done >= WRITE_BATCH) {
+			conn_wait(c, EV_WRITE);
+			return;
+		}
+
+		n = conn_send(c, buf, len, &want);
+		if (n == WANT) {
+			conn_wait(c, want);
+			return;
+		}
+		if (n <= 0) {
+			conn_close(c);
+			return;
+		}
+
+		if (c->hdroff < c->hdrlen)
+			c->hdroff += n;
+		else
+			c->sent += n;
+		done += n;
+	}
+}
+
+static void
+conn_io(int fd, short event, void *arg)
+{
+	struct conn	*c = arg;
+
+	switch (c->state) {
+	case S_READ:
+		conn_read(c);
+		break;
+	case S_WAIT:
+		c->state = S_WRITE;
+		/* fallthrough */
+	case S_WRITE:
+		conn_write(c);
+		break;
+	}
+}
+
+static void
+do_accept(int fd, short event, void *arg)
+{
+	struct conn	*c;
+	int		 s;
+
+	if ((s = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) == -1) {
+		if (errno != EAGAIN && errno != EINTR &&
+		    errno != ECONNABORTED)
+			warn("accept");
+		return;
+	}
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		warn("calloc");
+		close(s);
+		return;
+	}
+	c->fd = s;
+	c->state = S_READ;
+
+	if (tlsctx != NULL && tls_accept_socket(tlsctx, &c->ctx, s) == -1) {
+		warnx("tls_accept_socket: %s", tls_error(tlsctx));
+		close(s);
+		free(c);
+		return;
+	}
+
+	conn_wait(c, EV_READ);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_in	 sin;
+	struct tls_config	*conf;
+	struct event		 ev;
+	const char		*cert = NULL, *key = NULL, *errstr;
+	int			 ch, fd, port = 1965, ms, on = 1;
+
+	while ((ch = getopt(argc, argv, "c:d:k:p:")) != -1) {
+		switch (ch) {
+		case 'c':
+			cert = optarg;
+			break;
+		case 'd':
+			ms = strtonum(optarg, 0, 60 * 1000, &errstr);
+			if (errstr != NULL)
+				errx(1, "delay is %s: %s", errstr, optarg);
+			delay.tv_sec = ms / 1000;
+			delay.tv_usec = (ms % 1000) * 1000;
+			break;
+		case 'k':
+			key = optarg;
+			break;
+		case 'p':
+			port = strtonum(optarg, 1, UINT16_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "port is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0 || (cert == NULL) != (key == NULL))
+		usage();
+
+	fill_patterns();
+	signal(SIGPIPE, SIG_IGN);
+
+	if (cert != NULL) {
+		if ((conf = tls_config_new()) == NULL)
+			err(1, "tls_config_new");
+		if (tls_config_set_cert_file(conf, cert) == -1 ||
+		    tls_config_set_key_file(conf, key) == -1)
+			errx(1, "%s", tls_config_error(conf));
+		if ((tlsctx = tls_server()) == NULL)
+			err(1, "tls_server");
+		if (tls_configure(tlsctx, conf) == -1)
+			errx(1, "tls_configure: %s", tls_error(tlsctx));
+		tls_config_free(conf);
+	}
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+		err(1, "socket");
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+		err(1, "setsockopt");
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(1, "bind");
+	if (listen(fd, 128) == -1)
+		err(1, "listen");
+
+	event_init();
+	event_set(&ev, fd, EV_READ|EV_PERSIST, do_accept, NULL);
+	event_add(&ev, NULL);
+	event_dispatch();
+
+	return (0);
+}
@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2025 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Run the gemtext translator, and the escaping and URL rewriting it
+ * uses, over a corpus and report how fast it goes and how many
+ * allocations it does.  The HTML goes to a sink that throws it away.
+ * The corpus is built in, or read from the files given.
+ */
+
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/tree.h>
+
+#include <dlfcn.h>
+#include <err.h>
+#include <event.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "tmpl.h"
+
+#include "galileo.h"
+
+#define MINIMUM(a, b)	((a) < (b) ? (a) : (b))
+
+#define CORPUS_SIZE	(256 * 1024)
+
+static char		*corpus;
+static size_t		 corpuslen;
+static size_t		 corpuscap;
+static char		**lines;
+static size_t		 nlines;
+static char		**links;
+static size_t		 nlinks;
+static size_t		 sunk;
+
+/*
+ * Count the allocations by interposing malloc and friends.  dlsym
+ * may allocate itself before the real functions are known, that's
+ * served from a small static arena.
+ */
+static void		*(*real_malloc)(size_t);
+static void		*(*real_calloc)(size_t, size_t);
+static void		*(*real_realloc)(void *, size_t);
+static void		 (*real_free)(void *);
+static int		 counting;
+static size_t		 allocs;
+static char		 arena[4096];
+static size_t		 arenaoff;
+
+static void
+alloc_init(void)
+{
+	static int	 resolving;
+
+	if (resolving)
+		return;
+	resolving = 1;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	if (real_malloc == NULL || real_calloc == NULL ||
+	    real_realloc == NULL || real_free == NULL)
+		abort();
+}
+
+static void *
+arena_alloc(size_t size)
+{
+	void	*p;
+
+	size = (size + 15) & ~(size_t)15;
+	if (size > sizeof(arena) - arenaoff)
+		return (NULL);
+	p = arena + arenaoff;
+	arenaoff += size;
+	return (p);
+}
+
+#define IN_ARENA(p)	\
+	((char *)(p) >= arena && (char *)(p) < arena + sizeof(arena))
+
+void *
+malloc(size_t size)
+{
+	if (real_malloc == NULL)
+		alloc_init();
+	if (real_malloc == NULL)
+		return (arena_alloc(size));
+	if (counting)
+		allocs++;
+	return (real_malloc(size));
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	if (real_calloc == NULL)
+		alloc_init();
+	if (real_calloc == NULL) {
+		if (size != 0 && nmemb > SIZE_MAX / size)
+			return (NULL);
+		return (arena_alloc(nmemb * size));	/* static, zeroed */
+	}
+	if (counting)
+		allocs++;
+	return (real_calloc(nmemb, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	void	*p;
+
+	if (real_realloc == NULL)
+		alloc_init();
+	if (IN_ARENA(ptr)) {
+		if ((p = malloc(size)) == NULL)
+			return (NULL);
+		memcpy(p, ptr, MINIMUM(size,
+		    (size_t)(arena + sizeof(arena) - (char *)ptr)));
+		return (p);
+	}
+	if (real_realloc == NULL)
+		return (NULL);
+	if (counting)
+		allocs++;
+	return (real_realloc(ptr, size));
+}
+
+void
+free(void *ptr)
+{
+	if (ptr == NULL || IN_ARENA(ptr))
+		return;
+	if (real_free == NULL)
+		alloc_init();
+	real_free(ptr);
+}
+
+static __dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [file ...]\n",
+	    getprogname());
+	exit(1);
+}
+
+static int
+sink(void *arg, const void *buf, size_t len)
+{
+	sunk += len;
+	return (0);
+}
+
+static void
+corpus_add(const char *s, size_t len)
+{
+	char	*t;
+
+	while (corpuslen + len + 1 > corpuscap) {
+		if ((t = realloc(corpus, corpuscap + CORPUS_SIZE)) == NULL)
+			err(1, "realloc");
+		corpus = t;
+		corpuscap += CORPUS_SIZE;
+	}
+	memcpy(corpus + corpuslen, s, len);
+	corpuslen += len;
+	corpus[corpuslen] = '\0';
+}
+
+/* something like a capsule index page followed by a gemlog entry */
+static void
+corpus_builtin(void)
+{
+	static const char	*page[] = {
+		"# Example capsule\n",
+		"\n",
+		"```ascii art of a telescope\n",
+		"      ____\n",
+		"     /   /|   <- not to scale\n",
+		"    /___/ |____\n",
+		"    |   | /   /\n",
+		"    |___|/___/  \"galileo\" & co.\n",
+		"```\n",
+		"\n",
+		"Welcome to my corner of Geminispace!  I write about "
+		    "programming, the occasional book & whatever else "
+		    "catches my attention.  Comments are welcome by mail.\n",
+		"\n",
+		"=> /about.gmi About me\n",
+		"=> /gemlog/ Gemlog\n",
+		"=> /gemlog/atom.xml Atom feed\n",
+		"=> gemini://example.com/photos/sunset.jpg A sunset\n",
+		"=> https://example.org/~user/code Code on the web\n",
+		"=> mailto:user@example.com Mail me\n",
+		"\n",
+		"## Gemlog\n",
+		"\n",
+	};
+	static const char	*post[] = {
+		"\n",
+		"### On <pre> blocks & other things\n",
+		"\n",
+		"> The best way to predict the future is to invent it.\n",
+		"> -- someone on the internet\n",
+		"\n",
+		"Some notes in no particular order:\n",
+		"* links are one per line, \"=>\" followed by the URL\n",
+		"* lists can't nest\n",
+		"* headings go up to three levels\n",
+		"\n",
+		"```c\n",
+		"if (len > 0 && buf[len - 1] == '\\n')\n",
+		"\tbuf[--len] = '\\0';\n",
+		"```\n",
+		"\n",
+		"That's all for today.  See you in the next entry, or at "
+		    "gemini://example.com/gemlog/ if you prefer the index.\n",
+		"=> //example.com:1965/gemlog/ Back to the gemlog\n",
+		"=> ../ Up\n",
+	};
+	char			 buf[256];
+	size_t			 i;
+	int			 n, day = 0;
+
+	for (i = 0; i < nitems(page); ++i)
+		corpus_add(page[i], strlen(page[i]));
+
+	while (corpuslen < CORPUS_SIZE / 2) {
+		n = snprintf(buf, sizeof(buf), "=> gemini://example.com/"
+		    "gemlog/2024-%02d-%02d-entry.gmi 2024-%02d-%02d "
+		    "Entry number %d, about things & stuff\n",
+		    day / 28 % 12 + 1, day % 28 + 1,
+		    day / 28 % 12 + 1, day % 28 + 1, day);
+		corpus_add(buf, n);
+		day++;
+	}
+
+	while (corpuslen < CORPUS_SIZE - 2048)
+		for (i = 0; i < nitems(post); ++i)
+			corpus_add(post[i], strlen(post[i]));
+}
+
+static void
+corpus_file(const char *path)
+{
+	char	 buf[BUFSIZ];
+	ssize_t	 n;
+	int	 fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		err(1, "open %s", path);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		corpus_add(buf, n);
+	if (n == -1)
+		err(1, "read %s", path);
+	close(fd);
+	if (corpuslen > 0 && corpus[corpuslen - 1] != '\n')
+		corpus_add("\n", 1);
+}
+
+/* split a copy of the corpus in lines and collect the link targets */
+static void
+corpus_split(void)
+{
+	char	*copy, *line, *url;
+
+	if ((copy = strdup(corpus)) == NULL)
+		err(1, "strdup");
+
+	while ((line = strsep(&copy, "\n")) != NULL) {
+		if (copy == NULL && *line == '\0')
+			break;
+		line[strcspn(line, "\r")] = '\0';
+
+		if ((lines = reallocarray(lines, nlines + 1,
+		    sizeof(*lines))) == NULL)
+			err(1, "reallocarray");
+		lines[nlines++] = line;
+
+		if (strncmp(line, "=>", 2) != 0)
+			continue;
+		url = line + 2;
+		url += strspn(url, " \t");
+		if ((url = strndup(url, strcspn(url, " \t"))) == NULL)
+			err(1, "strndup");
+		if ((links = reallocarray(links, nlinks + 1,
+		    sizeof(*links))) == NULL)
+			err(1, "reallocarray");
+		links[nlinks++] = url;
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+report(const char *name, size_t bytes, double secs)
+{
+	printf("%-12s %10.1f MB/s %10.2f allocs/KB\n", name,
+	    bytes / secs / 1024 / 1024, allocs * 1024.0 / bytes);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct proxy_config	 pc;
+	struct client		 clt;
+	struct template		*tp;
+	struct evbuffer		*in;
+	const char		*errstr;
+	char			 out[8192], url[1025];
+	double			 start;
+	size_t			 bytes, i, j;
+	int			 ch, n = 200;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "iterations are %s: %s", errstr,
+				    optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0)
+		corpus_builtin();
+	for (; argc > 0; --argc, ++argv)
+		corpus_file(*argv);
+	if (corpuslen == 0)
+		errx(1, "empty corpus");
+	corpus_split();
+
+	event_init();
+
+	memset(&pc, 0, sizeof(pc));
+	pc.proxy_port = "1965";
+
+	memset(&clt, 0, sizeof(clt));
+	clt.clt_server_name = "example.com";
+	clt.clt_script_name = "/";
+	clt.clt_path_info = "/";
+	clt.clt_pc = &pc;
+	if ((clt.clt_bev = bufferevent_new(-1, NULL, NULL, NULL,
+	    NULL)) == NULL)
+		err(1, "bufferevent_new");
+	if ((tp = template(&clt, sink, out, sizeof(out))) == NULL)
+		err(1, "template");
+	clt.clt_tp = tp;
+	in = EVBUFFER_INPUT(clt.clt_bev);
+#if HAVE_LIBEVENT2
+	evbuffer_unfreeze(in, 0);	/* as proxy_connect does */
+#endif
+
+	printf("corpus: %zu bytes, %zu lines, %zu links, %d iterations\n",
+	    corpuslen, nlines, nlinks, n);
+
+	/* the whole translation, as done for every reply */
+	allocs = 0;
+	start = now();
+	for (i = 0; i < (size_t)n; ++i) {
+		if (evbuffer_add(in, corpus, corpuslen) == -1)
+			err(1, "evbuffer_add");
+		clt.clt_translate = TR_ENABLED;
+		counting = 1;
+		if (gemtext_translate(&clt) == -1 ||
+		    template_flush(tp) == -1)
+			errx(1, "translation failed");
+		counting = 0;
+	}
+	report("translate", corpuslen * n, now() - start);
+	printf("%-12s %10.2f output bytes per input byte\n", "",
+	    (double)sunk / (corpuslen * n));
+
+	allocs = 0;
+	bytes = 0;
+	start = now();
+	counting = 1;
+	for (i = 0; i < (size_t)n; ++i) {
+		for (j = 0; j < nlines; ++j) {
+			if (tp_htmlescape(tp, lines[j]) == -1)
+				errx(1, "tp_htmlescape failed");
+			bytes += strlen(lines[j]);
+		}
+	}
+	counting = 0;
+	report("htmlescape", bytes, now() - start);
+
+	if (nlinks == 0)
+		return (0);
+
+	allocs = 0;
+	bytes = 0;
+	start = now();
+	counting = 1;
+	for (i = 0; i < (size_t)n; ++i) {
+		for (j = 0; j < nlinks; ++j) {
+			if (tp_urlescape(tp, links[j]) == -1)
+				errx(1, "tp_urlescape failed");
+			bytes += strlen(links[j]);
+		}
+	}
+	counting = 0;
+	report("urlescape", bytes, now() - start);
+
+	allocs = 0;
+	bytes = 0;
+	start = now();
+	counting = 1;
+	for (i = 0; i < (size_t)n; ++i) {
+		for (j = 0; j < nlinks; ++j) {
+			(void)proxy_resurl(&clt, links[j], url, sizeof(url));
+			bytes += strlen(links[j]);
+		}
+	}
+	counting = 0;
+	report("resurl", bytes, now() - start);
+
+	template_free(tp);
+	bufferevent_free(clt.clt_bev);
+	return (0);
+}
@@ -0,0 +1,187 @@
+#!/bin/sh
+#
+# Copyright (c) 2025 Omar Polo <op@omarpolo.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+# Run galileo against bench/gemserv with every prefork setting given
+# and load it with bench/fcgiload.  Needs to run as root, like galileo.
+#
+# With -r galileo listens on TCP instead, once with a socket shared by
+# all the proxy processes and once with `reuseport', and the number of
+# connections accepted by each of them is reported as well.
+
+set -e
+
+usage() {
+	echo "usage: $0 [-krTz] [-c clients] [-d msec] [-p path] [-t seconds]" \
+	    "[prefork ...]" >&2
+	exit 1
+}
+
+bench=$(cd "$(dirname "$0")" && pwd)
+galileo="$bench/../galileo"
+galileoctl="$bench/../galileoctl"
+
+clients=32
+delay=0
+paths=
+reuseport=no
+seconds=10
+tls=no
+loadflags=
+
+while getopts c:d:kp:rTt:z ch; do
+	case $ch in
+	c)	clients=$OPTARG ;;
+	d)	delay=$OPTARG ;;
+	k)	loadflags="$loadflags -k" ;;
+	p)	paths="$paths $OPTARG" ;;
+	r)	reuseport=yes ;;
+	T)	tls=yes ;;
+	t)	seconds=$OPTARG ;;
+	z)	loadflags="$loadflags -z" ;;
+	*)	usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+[ -n "$paths" ] || paths="/gmi/4096 /gmi/65536 /bin/65536"
+[ $# -gt 0 ] || set -- 1 2 4
+
+for p in "$galileo" "$galileoctl" "$bench/gemserv" "$bench/fcgiload"; do
+	if [ ! -x "$p" ]; then
+		echo "$0: $p not found, run \`make bench' first" >&2
+		exit 1
+	fi
+done
+
+tmp=$(mktemp -d /tmp/galileo-bench.XXXXXXXXXX)
+chmod 755 "$tmp"
+port=$((20000 + $$ % 10000))
+lport=$((port + 1))
+gpid=
+spid=
+
+cleanup() {
+	[ -n "$gpid" ] && kill -INT "$gpid" 2>/dev/null && wait "$gpid" || true
+	[ -n "$spid" ] && kill "$spid" 2>/dev/null || true
+	rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+gemflags=
+notls="no tls"
+if [ "$tls" = yes ]; then
+	openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+	    -keyout "$tmp/key.pem" -out "$tmp/cert.pem" 2>/dev/null
+	gemflags="-c $tmp/cert.pem -k $tmp/key.pem"
+	notls=
+fi
+
+"$bench/gemserv" -p "$port" -d "$delay" $gemflags &
+spid=$!
+
+# the RSS in KB of a process and its children
+rss() {
+	ps -A -o pid= -o ppid= -o rss= | \
+	    awk -v p="$1" '$1 == p || $2 == p { s += $3 } END { print s }'
+}
+
+# the connections accepted by every proxy process, as 12/10/11
+accepts() {
+	"$galileoctl" show stats | \
+	    awk '$1 ~ /^[0-9]+$/ { printf("%s%s", s, $4); s = "/" }'
+}
+
+# start galileo with the given prefork and listen directive, load it
+# on the given address and leave the fcgiload report in $out
+run() {
+	cat > "$tmp/galileo.conf" <<EOF
+prefork $1
+$2
+proxy "localhost" {
+	source 127.0.0.1 port $port
+	hostname "localhost"
+	$notls
+}
+EOF
+
+	"$galileo" -d -f "$tmp/galileo.conf" 2>"$tmp/galileo.log" &
+	gpid=$!
+
+	# the proxy processes are up once they answer
+	i=0
+	until "$galileoctl" show stats 2>/dev/null | grep -q '^1 '; do
+		i=$((i + 1))
+		if [ $i -gt 50 ]; then
+			echo "$0: galileo didn't start:" >&2
+			cat "$tmp/galileo.log" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+
+	out=$("$bench/fcgiload" $loadflags -c "$clients" -t "$seconds" \
+	    "$3" $paths)
+	mem=$(rss "$gpid")
+	if [ "$reuseport" = yes ]; then
+		# wait for the proxies to report their counters
+		sleep 2
+		out="$out accepts=$(accepts)"
+	fi
+
+	kill -INT "$gpid"
+	wait "$gpid" || true
+	gpid=
+	rm -f "$tmp/galileo.sock"
+}
+
+if [ "$reuseport" = yes ]; then
+	printf '%-8s %-10s %10s %8s %9s  %s\n' prefork listen req/s errors \
+	    p99/ms accepts
+	for n in "$@"; do
+		for opt in shared reuseport; do
+			l="listen on 127.0.0.1 port $lport"
+			[ "$opt" = shared ] || l="$l reuseport"
+			run "$n" "$l" "127.0.0.1:$lport"
+
+			echo "$out" | awk -v n="$n" -v opt="$opt" '{
+				for (i = 1; i <= NF; ++i) {
+					split($i, kv, "=")
+					v[kv[1]] = kv[2]
+				}
+				printf("%-8s %-10s %10s %8s %9s  %s\n", n, opt,
+				    v["rps"], v["errors"], v["p99"],
+				    v["accepts"])
+			}'
+		done
+	done
+	exit 0
+fi
+
+printf '%-8s %10s %8s %9s %9s %9s %10s\n' prefork req/s errors \
+    p50/ms p99/ms MB/s RSS/KB
+
+for n in "$@"; do
+	run "$n" "listen on socket \"$tmp/galileo.sock\"" "$tmp/galileo.sock"
+
+	echo "$out" | awk -v n="$n" -v mem="$mem" '{
+		for (i = 1; i <= NF; ++i) {
+			split($i, kv, "=")
+			v[kv[1]] = kv[2]
+		}
+		printf("%-8s %10s %8s %9s %9s %9s %10s\n", n, v["rps"],
+		    v["errors"], v["p50"], v["p99"], v["MBps"], mem)
+	}'
+done
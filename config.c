@@ -26,10 +26,13 @@
 #include <sys/stat.h>		/* umask */
 #include <sys/un.h>		/* sockaddr_un */
 
+#include <netinet/in.h>
+
 #include <errno.h>
 #include <event.h>
 #include <limits.h>
 #include <pwd.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -42,17 +45,44 @@
 
 #include "galileo.h"
 
+static void	config_purgesocks(struct galileo *);
+static void	config_swapproxies(struct galileo *);
+
+/*
+ * The strings of the proxies are interned: the hundreds of proxies
+ * of a big configuration usually share the same stylesheet, source
+ * and port, and the generations kept around by a reload share the
+ * rest.
+ */
+struct istr {
+	RB_ENTRY(istr)		 is_entry;
+	int			 is_refs;
+	char			 is_str[];
+};
+RB_HEAD(istr_tree, istr);
+
+static int	istr_cmp(struct istr *, struct istr *);
+RB_PROTOTYPE_STATIC(istr_tree, istr, is_entry, istr_cmp);
+
+static struct istr_tree	istrs = RB_INITIALIZER(&istrs);
+
 int
 config_init(struct galileo *env)
 {
 	/* Global configuration */
-	if (privsep_process == PROC_PARENT)
+	if (privsep_process == PROC_PARENT) {
 		env->sc_prefork = PROXY_NUMPROC;
+		env->sc_conf.drain_timeout = DRAIN_TIMEOUT;
+		env->sc_conf.fcgi_request_timeout = FCGI_TIMEOUT_REQUEST;
+		env->sc_conf.fcgi_idle_timeout = FCGI_TIMEOUT_IDLE;
+	}
 
 	/* Other configuration. */
 	TAILQ_INIT(&env->sc_proxies);
-
-	env->sc_sock_fd = -1;
+	TAILQ_INIT(&env->sc_retired);
+	TAILQ_INIT(&env->sc_newproxies);
+	TAILQ_INIT(&env->sc_listeners);
+	TAILQ_INIT(&env->sc_oldlisteners);
 
 	return (0);
 }
@@ -79,26 +109,117 @@ config_purge(struct galileo *env)
 		fcgi_free(fcgi);
 	}
 
-	if (env->sc_sock_fd != -1) {
-		event_del(&env->sc_evsock);
-		event_del(&env->sc_evpause);
-		close(env->sc_sock_fd);
-		env->sc_sock_fd = -1;
-	}
+	/* the parent keeps the listening sockets open across reloads */
+	if (privsep_process != PROC_PARENT)
+		config_purgesocks(env);
 
+	proxy_index_clear(env);
 	while ((p = TAILQ_FIRST(&env->sc_proxies)) != NULL) {
 		TAILQ_REMOVE(&env->sc_proxies, p, pr_entry);
 		proxy_purge(p);
 	}
+
+	while ((p = TAILQ_FIRST(&env->sc_retired)) != NULL) {
+		TAILQ_REMOVE(&env->sc_retired, p, pr_entry);
+		proxy_purge(p);
+	}
+
+	while ((p = TAILQ_FIRST(&env->sc_newproxies)) != NULL) {
+		TAILQ_REMOVE(&env->sc_newproxies, p, pr_entry);
+		proxy_purge(p);
+	}
+}
+
+static void
+config_purgesocks(struct galileo *env)
+{
+	struct listener	*l;
+
+	while ((l = TAILQ_FIRST(&env->sc_listeners)) != NULL) {
+		TAILQ_REMOVE(&env->sc_listeners, l, l_entry);
+		if (l->l_fd != -1) {
+			event_del(&l->l_ev);
+			event_del(&l->l_evpause);
+			close(l->l_fd);
+		}
+		free(l);
+	}
+}
+
+static int
+istr_cmp(struct istr *a, struct istr *b)
+{
+	return (strcmp(a->is_str, b->is_str));
+}
+
+RB_GENERATE_STATIC(istr_tree, istr, is_entry, istr_cmp);
+
+const char *
+config_intern(const char *s)
+{
+	struct istr	*is, *found;
+	size_t		 len;
+
+	len = strlen(s);
+	is = xcalloc(1, sizeof(*is) + len + 1);
+	memcpy(is->is_str, s, len);
+
+	if ((found = RB_INSERT(istr_tree, &istrs, is)) != NULL) {
+		free(is);
+		is = found;
+	}
+
+	is->is_refs++;
+	return (is->is_str);
+}
+
+void
+config_unintern(const char *s)
+{
+	struct istr	*is;
+
+	is = (struct istr *)(s - offsetof(struct istr, is_str));
+	if (--is->is_refs > 0)
+		return;
+
+	RB_REMOVE(istr_tree, &istrs, is);
+	free(is);
+}
+
+/*
+ * The proxy is sent as the structure followed by its strings, in
+ * the order of proxy_strs, each with its NUL terminator.
+ */
+static void
+proxy_strs(struct proxy_config *pc, const char ***strs)
+{
+	strs[0] = &pc->host;
+	strs[1] = &pc->stylesheet;
+	strs[2] = &pc->proxy_addr;
+	strs[3] = &pc->proxy_name;
+	strs[4] = &pc->proxy_port;
 }
 
 int
-config_setproxy(struct galileo *env, struct proxy *p)
+config_setproxy(struct galileo *env, struct proxy *p, int n)
 {
 	struct privsep		*ps = env->sc_ps;
+	const char		**strs[PROXY_NSTRS];
+	struct iovec		 iov[1 + PROXY_NSTRS];
+	int			 i;
 
-	if (proc_compose(ps, PROC_PROXY, IMSG_CFG_SRV, p, sizeof(*p)) == -1)
-		fatal("proc_compose");
+	proxy_strs(&p->pr_conf, strs);
+
+	iov[0].iov_base = p;
+	iov[0].iov_len = sizeof(*p);
+	for (i = 0; i < PROXY_NSTRS; ++i) {
+		iov[i + 1].iov_base = (void *)*strs[i];
+		iov[i + 1].iov_len = strlen(*strs[i]) + 1;
+	}
+
+	if (proc_composev_imsg(ps, PROC_PROXY, n, IMSG_CFG_SRV, -1, -1,
+	    iov, nitems(iov)) == -1)
+		fatal("proc_composev");
 	return (0);
 }
 
@@ -106,46 +227,65 @@ int
 config_getproxy(struct galileo *env, struct imsg *imsg)
 {
 	struct proxy	*proxy;
+	const char	**strs[PROXY_NSTRS];
+	const char	*data;
+	size_t		 len, n;
+	int		 i;
+
+	data = imsg->data;
+	len = IMSG_DATA_SIZE(imsg);
+	if (len < sizeof(*proxy))
+		fatalx("%s: bad imsg size", __func__);
 
 	proxy = xcalloc(1, sizeof(*proxy));
-	if (IMSG_DATA_SIZE(imsg) != sizeof(*proxy))
+	memcpy(proxy, data, sizeof(*proxy));
+	data += sizeof(*proxy);
+	len -= sizeof(*proxy);
+
+	proxy_strs(&proxy->pr_conf, strs);
+	for (i = 0; i < PROXY_NSTRS; ++i) {
+		if ((n = strnlen(data, len)) == len)
+			fatalx("%s: truncated string", __func__);
+		*strs[i] = config_intern(data);
+		data += n + 1;
+		len -= n + 1;
+	}
+	if (len != 0)
 		fatalx("%s: bad imsg size", __func__);
 
-	memcpy(proxy, imsg->data, sizeof(*proxy));
+	proxy->pr_stats = xcalloc(1, sizeof(*proxy->pr_stats));
+	proxy->pr_gen = env->sc_gen;
+	proxy->pr_refs = 0;
+	proxy->pr_retired = 0;
 
 	log_debug("%s: proxy=%s -> %s:%s (%s)", __func__,
 	    proxy->pr_conf.host, proxy->pr_conf.proxy_addr,
 	    proxy->pr_conf.proxy_port, proxy->pr_conf.proxy_name);
 
-	TAILQ_INSERT_TAIL(&env->sc_proxies, proxy, pr_entry);
+	if (proxy_index(env, proxy) == -1) {
+		proxy_purge(proxy);
+		return (-1);
+	}
+	TAILQ_INSERT_TAIL(&env->sc_newproxies, proxy, pr_entry);
 
 	return (0);
 }
 
-int
-config_setsock(struct galileo *env)
+static int
+config_opensock_unix(struct galileo *env, struct listener *l)
 {
 	struct privsep		*ps = env->sc_ps;
 	struct passwd		*pw = ps->ps_pw;
-	struct sockaddr_un	 sun;
-	const char		*path = GALILEO_SOCK;
-	int			 id, fd, old_umask;
+	struct sockaddr_un	*sun = (struct sockaddr_un *)&l->l_ss;
+	const char		*path = sun->sun_path;
+	int			 fd, old_umask;
 
-	/*
-	 * open listening socket.
-	 *
-	 * XXX: move to server.c as server_privinit like httpd once we
-	 * support more than one listening socket.
-	 */
-	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+	if ((fd = socket(AF_UNIX,
+	    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
 		log_warn("%s: socket", __func__);
 		return (-1);
 	}
 
-	memset(&sun, 0, sizeof(sun));
-	sun.sun_family = AF_UNIX;
-	strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
-
 	if (unlink(path) == -1)
 		if (errno != ENOENT) {
 			log_warn("%s: unlink %s", __func__, path);
@@ -154,7 +294,7 @@ config_setsock(struct galileo *env)
 		}
 
 	old_umask = umask(S_IXUSR|S_IXGRP|S_IWOTH|S_IROTH|S_IXOTH);
-	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+	if (bind(fd, (struct sockaddr *)sun, sizeof(*sun)) == -1) {
 		log_warn("%s: bind: %s (%d)", __func__, path, geteuid());
 		close(fd);
 		umask(old_umask);
@@ -176,54 +316,285 @@ config_setsock(struct galileo *env)
 		return (-1);
 	}
 
-	if (listen(fd, 5) == -1) {
+	if (listen(fd, l->l_backlog) == -1) {
 		log_warn("%s: listen", __func__);
 		close(fd);
 		(void)unlink(path);
 		return (-1);
 	}
 
-	for (id = 0; id < PROC_MAX; ++id) {
-		int n, m;
+	return (fd);
+}
 
-		if (id == privsep_process || id != PROC_PROXY)
-			continue;
+static int
+config_opensock_inet(struct galileo *env, struct listener *l)
+{
+	int			 fd, on = 1;
 
-		n = -1;
-		proc_range(ps, id, &n, &m);
-		for (n = 0; n < m; ++n) {
-			int d;
+	if ((fd = socket(l->l_ss.ss_family,
+	    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		log_warn("%s: socket", __func__);
+		return (-1);
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on,
+	    sizeof(on)) == -1) {
+		log_warn("%s: setsockopt SO_REUSEADDR", __func__);
+		close(fd);
+		return (-1);
+	}
 
+#ifdef SO_REUSEPORT
+	if ((l->l_flags & LISTEN_REUSEPORT) && setsockopt(fd, SOL_SOCKET,
+	    SO_REUSEPORT, &on, sizeof(on)) == -1) {
+		log_warn("%s: setsockopt SO_REUSEPORT", __func__);
+		close(fd);
+		return (-1);
+	}
+#endif
+
+	/* don't clash with a listener on the same IPv4 address */
+	if (l->l_ss.ss_family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6,
+	    IPV6_V6ONLY, &on, sizeof(on)) == -1) {
+		log_warn("%s: setsockopt IPV6_V6ONLY", __func__);
+		close(fd);
+		return (-1);
+	}
+
+	if (bind(fd, (struct sockaddr *)&l->l_ss, l->l_slen) == -1) {
+		log_warn("%s: bind", __func__);
+		close(fd);
+		return (-1);
+	}
+
+	if (listen(fd, l->l_backlog) == -1) {
+		log_warn("%s: listen", __func__);
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static int
+config_opensock(struct galileo *env, struct listener *l)
+{
+	if (l->l_ss.ss_family == AF_UNIX)
+		return (config_opensock_unix(env, l));
+	return (config_opensock_inet(env, l));
+}
+
+static int
+config_samesock(struct listener *a, struct listener *b)
+{
+	return (a->l_slen == b->l_slen &&
+	    (a->l_flags & LISTEN_REUSEPORT) == (b->l_flags & LISTEN_REUSEPORT) &&
+	    memcmp(&a->l_ss, &b->l_ss, a->l_slen) == 0);
+}
+
+static void
+config_closesock(struct listener *l)
+{
+	struct sockaddr_un	*sun = (struct sockaddr_un *)&l->l_ss;
+	int			 i;
+
+	for (i = 0; i < l->l_nfds; ++i)
+		if (l->l_fds[i] != -1)
+			close(l->l_fds[i]);
+	l->l_nfds = 0;
+
+	if (l->l_ss.ss_family == AF_UNIX)
+		(void)unlink(sun->sun_path);
+}
+
+/*
+ * Return the socket of the given listener for the given proxy
+ * instance, opening it if needed.
+ */
+static int
+config_getfd(struct galileo *env, struct listener *l, int n)
+{
+	int			 fd;
+#ifdef SO_INCOMING_CPU
+	int			 cpu;
+#endif
+
+	if (!(l->l_flags & LISTEN_REUSEPORT))
+		n = 0;
+	if (l->l_fds[n] != -1)
+		return (l->l_fds[n]);
+
+	if ((fd = config_opensock(env, l)) == -1)
+		return (-1);
+
+#ifdef SO_INCOMING_CPU
+	/* steer the connections to the pinned proxy */
+	if ((l->l_flags & LISTEN_REUSEPORT) &&
+	    (cpu = proxy_cpu(env, n)) != -1 &&
+	    setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU,
+	    &cpu, sizeof(cpu)) == -1)
+		log_warn("%s: setsockopt SO_INCOMING_CPU", __func__);
+#endif
+
+	return (l->l_fds[n] = fd);
+}
+
+int
+config_setsock(struct galileo *env)
+{
+	struct privsep		*ps = env->sc_ps;
+	struct listener		*l, *o;
+	int			 i, n, m;
+
+	n = -1;
+	proc_range(ps, PROC_PROXY, &n, &m);
+
+	/*
+	 * Reuse the sockets of the previous configuration, so that no
+	 * connection is refused during a reload, and close the others
+	 * before binding the new ones.
+	 */
+	TAILQ_FOREACH(l, &env->sc_listeners, l_entry) {
+		TAILQ_FOREACH(o, &env->sc_oldlisteners, l_entry)
+			if (config_samesock(l, o))
+				break;
+		if (o != NULL) {
+			TAILQ_REMOVE(&env->sc_oldlisteners, o, l_entry);
+			l->l_nfds = o->l_nfds;
+			memcpy(l->l_fds, o->l_fds, sizeof(l->l_fds));
+			free(o);
+
+			/* the backlog may have changed */
+			for (i = 0; i < l->l_nfds; ++i)
+				if (l->l_fds[i] != -1 &&
+				    listen(l->l_fds[i], l->l_backlog) == -1)
+					log_warn("%s: listen", __func__);
+		}
+	}
+
+	while ((o = TAILQ_FIRST(&env->sc_oldlisteners)) != NULL) {
+		TAILQ_REMOVE(&env->sc_oldlisteners, o, l_entry);
+		config_closesock(o);
+		free(o);
+	}
+
+	TAILQ_FOREACH(l, &env->sc_listeners, l_entry) {
+		/*
+		 * XXX: move to server.c as server_privinit like httpd
+		 * does.
+		 *
+		 * With reuseport every proxy gets its own socket and
+		 * the kernel balances the connections between them,
+		 * otherwise they all share the same one.  The sockets
+		 * are opened by config_getfd once a proxy is running
+		 * in the slot.
+		 */
+		if (l->l_nfds == 0) {
+			l->l_nfds = (l->l_flags & LISTEN_REUSEPORT) ? m : 1;
+			for (i = 0; i < l->l_nfds; ++i)
+				l->l_fds[i] = -1;
+		}
+		if (!(l->l_flags & LISTEN_REUSEPORT) &&
+		    config_getfd(env, l, 0) == -1)
+			return (-1);
+	}
+
+	return (config_sendsock(env, -1));
+}
+
+/*
+ * Send a copy of the listening sockets to the given proxy instance,
+ * or to all the running ones if n is -1.
+ */
+int
+config_sendsock(struct galileo *env, int n)
+{
+	struct privsep		*ps = env->sc_ps;
+	struct listener		*l;
+	struct listener_config	 lc;
+	int			 m, d, fd;
+
+	proc_range(ps, PROC_PROXY, &n, &m);
+
+	for (; n < m; ++n) {
+		if (!proc_running(ps, PROC_PROXY, n))
+			continue;
+
+		TAILQ_FOREACH(l, &env->sc_listeners, l_entry) {
+			if ((fd = config_getfd(env, l, n)) == -1)
+				return (-1);
 			if ((d = dup(fd)) == -1) {
 				log_warn("%s: dup", __func__);
-				close(fd);
 				return (-1);
 			}
 
-			if (proc_compose_imsg(ps, id, n, IMSG_CFG_SOCK,
-			    -1, d, NULL, 0) == -1) {
+			memset(&lc, 0, sizeof(lc));
+			memcpy(&lc.ss, &l->l_ss, sizeof(lc.ss));
+			lc.slen = l->l_slen;
+			lc.backlog = l->l_backlog;
+			lc.batch = l->l_batch;
+			lc.flags = l->l_flags;
+
+			if (proc_compose_imsg(ps, PROC_PROXY, n, IMSG_CFG_SOCK,
+			    -1, d, &lc, sizeof(lc)) == -1) {
 				log_warn("%s: failed to compose "
 				    "IMSG_CFG_SOCK", __func__);
-				close(fd);
 				return (-1);
 			}
-			if (proc_flush_imsg(ps, id, n) == -1) {
+			if (proc_flush_imsg(ps, PROC_PROXY, n) == -1) {
 				log_warn("%s: failed to flush", __func__);
-				close(fd);
 				return (-1);
 			}
 		}
 	}
 
-	close(fd);
 	return (0);
 }
 
+/*
+ * Close the sockets reserved to the given proxy instance, once the
+ * retired proxy has stopped accepting from them.
+ */
+void
+config_dropsock(struct galileo *env, int n)
+{
+	struct listener	*l;
+
+	TAILQ_FOREACH(l, &env->sc_listeners, l_entry) {
+		if (!(l->l_flags & LISTEN_REUSEPORT) || l->l_fds[n] == -1)
+			continue;
+		close(l->l_fds[n]);
+		l->l_fds[n] = -1;
+	}
+}
+
 int
 config_getsock(struct galileo *env, struct imsg *imsg)
 {
-	/* XXX: make it more like httpd/gotwebd' one */
-	return (imsg->fd);
+	struct listener		*l;
+	struct listener_config	 lc;
+
+	if (IMSG_DATA_SIZE(imsg) != sizeof(lc))
+		fatalx("%s: bad imsg size", __func__);
+	if (imsg->fd == -1)
+		fatalx("%s: no socket received", __func__);
+	memcpy(&lc, imsg->data, sizeof(lc));
+
+	l = xcalloc(1, sizeof(*l));
+	memcpy(&l->l_ss, &lc.ss, sizeof(l->l_ss));
+	l->l_slen = lc.slen;
+	l->l_backlog = lc.backlog;
+	l->l_batch = lc.batch;
+	l->l_flags = lc.flags;
+	l->l_fd = imsg->fd;
+	l->l_env = env;
+
+	event_set(&l->l_ev, l->l_fd, EV_READ | EV_PERSIST, fcgi_accept, l);
+	evtimer_set(&l->l_evpause, fcgi_accept, l);
+
+	TAILQ_INSERT_TAIL(&env->sc_listeners, l, l_entry);
+
+	return (0);
 }
 
 int
@@ -239,20 +610,59 @@ config_setreset(struct galileo *env)
 	return (0);
 }
 
+/*
+ * Start a new configuration generation.  The proxies that follow are
+ * staged and the old ones keep serving the requests until
+ * IMSG_CFG_DONE.  The listening sockets are closed here, but the
+ * parent keeps them open and sends them again.
+ */
 int
 config_getreset(struct galileo *env, struct imsg *imsg)
 {
-	config_purge(env);
+	config_purgesocks(env);
+
+	env->sc_gen++;
+	log_debug("%s: now at generation %u", __func__, env->sc_gen);
 
 	return (0);
 }
 
+/*
+ * Switch to the staged proxies.  The clients in flight keep using
+ * the old ones, which are freed by proxy_release once the last of
+ * them is done.
+ */
+static void
+config_swapproxies(struct galileo *env)
+{
+	struct proxy	*p;
+
+	while ((p = TAILQ_FIRST(&env->sc_proxies)) != NULL) {
+		TAILQ_REMOVE(&env->sc_proxies, p, pr_entry);
+		if (p->pr_refs == 0) {
+			proxy_purge(p);
+			continue;
+		}
+		p->pr_retired = 1;
+		TAILQ_INSERT_TAIL(&env->sc_retired, p, pr_entry);
+	}
+
+	TAILQ_CONCAT(&env->sc_proxies, &env->sc_newproxies, pr_entry);
+	proxy_index_swap(env);
+}
+
 int
 config_getcfg(struct galileo *env, struct imsg *imsg)
 {
-	if (privsep_process != PROC_PARENT)
+	if (IMSG_DATA_SIZE(imsg) != sizeof(env->sc_conf))
+		fatalx("%s: bad imsg size", __func__);
+	memcpy(&env->sc_conf, imsg->data, sizeof(env->sc_conf));
+
+	if (privsep_process != PROC_PARENT) {
+		config_swapproxies(env);
 		proc_compose(env->sc_ps, PROC_PARENT,
 		    IMSG_CFG_DONE, NULL, 0);
+	}
 
 	return (0);
 }
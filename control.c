@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2025 Omar Polo <op@omarpolo.com>
+ * Copyright (c) 2003, 2004 Henning Brauer <henning@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/tree.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <event.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <imsg.h>
+
+#include "config.h"
+#include "log.h"
+#include "proc.h"
+
+#include "galileo.h"
+
+#define CONTROL_BACKLOG	5
+
+struct ctl_conn {
+	TAILQ_ENTRY(ctl_conn)	 entry;
+	uint32_t		 id;
+	uint32_t		 waiting;	/* proxies yet to answer */
+	struct imsgev		 iev;
+};
+TAILQ_HEAD(ctl_connlist, ctl_conn);
+
+static void		 control_accept(int, short, void *);
+static void		 control_close(int);
+static void		 control_dispatch_imsg(int, short, void *);
+static void		 control_done(struct ctl_conn *, int);
+static struct ctl_conn	*control_connbyfd(int);
+static struct ctl_conn	*control_connbyid(uint32_t);
+
+static struct ctl_connlist ctl_conns = TAILQ_HEAD_INITIALIZER(ctl_conns);
+
+static struct {
+	char		 path[PATH_MAX];
+	int		 fd;
+	struct event	 ev;
+	struct event	 evt;
+} control_state = { "", -1 };
+
+static uint32_t	control_id;
+
+int
+control_init(const char *path)
+{
+	struct sockaddr_un	 sun;
+	int			 fd, old_umask;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		log_warnx("%s: socket path too long: %s", __func__, path);
+		return (-1);
+	}
+
+	if ((fd = socket(AF_UNIX,
+	    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		log_warn("%s: socket", __func__);
+		return (-1);
+	}
+
+	if (unlink(path) == -1)
+		if (errno != ENOENT) {
+			log_warn("%s: unlink %s", __func__, path);
+			close(fd);
+			return (-1);
+		}
+
+	old_umask = umask(S_IXUSR|S_IXGRP|S_IWOTH|S_IROTH|S_IXOTH);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		log_warn("%s: bind: %s", __func__, path);
+		close(fd);
+		umask(old_umask);
+		return (-1);
+	}
+	umask(old_umask);
+
+	if (chmod(path, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) == -1) {
+		log_warn("%s: chmod", __func__);
+		close(fd);
+		(void)unlink(path);
+		return (-1);
+	}
+
+	(void)strlcpy(control_state.path, path, sizeof(control_state.path));
+	control_state.fd = fd;
+
+	return (0);
+}
+
+int
+control_listen(struct galileo *env)
+{
+	if (listen(control_state.fd, CONTROL_BACKLOG) == -1) {
+		log_warn("%s: listen", __func__);
+		return (-1);
+	}
+
+	event_set(&control_state.ev, control_state.fd, EV_READ,
+	    control_accept, env);
+	event_add(&control_state.ev, NULL);
+	evtimer_set(&control_state.evt, control_accept, env);
+
+	return (0);
+}
+
+void
+control_cleanup(void)
+{
+	if (control_state.fd == -1)
+		return;
+
+	event_del(&control_state.ev);
+	event_del(&control_state.evt);
+	close(control_state.fd);
+	(void)unlink(control_state.path);
+	control_state.fd = -1;
+}
+
+static void
+control_accept(int listenfd, short event, void *arg)
+{
+	struct galileo		*env = arg;
+	struct ctl_conn		*c;
+	int			 connfd;
+
+	event_add(&control_state.ev, NULL);
+	if ((event & EV_TIMEOUT))
+		return;
+
+	if ((connfd = accept4(listenfd, NULL, NULL,
+	    SOCK_NONBLOCK|SOCK_CLOEXEC)) == -1) {
+		/*
+		 * Pause accept if we are out of file descriptors, or
+		 * libevent will haunt us here too.
+		 */
+		if (errno == ENFILE || errno == EMFILE) {
+			struct timeval evtpause = { 1, 0 };
+
+			event_del(&control_state.ev);
+			evtimer_add(&control_state.evt, &evtpause);
+		} else if (errno != EWOULDBLOCK && errno != EINTR &&
+		    errno != ECONNABORTED)
+			log_warn("%s: accept", __func__);
+		return;
+	}
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		close(connfd);
+		return;
+	}
+
+	c->id = ++control_id;
+	imsg_init(&c->iev.ibuf, connfd);
+	c->iev.handler = control_dispatch_imsg;
+	c->iev.events = EV_READ;
+	c->iev.data = env;
+	event_set(&c->iev.ev, c->iev.ibuf.fd, c->iev.events,
+	    c->iev.handler, c->iev.data);
+	event_add(&c->iev.ev, NULL);
+
+	TAILQ_INSERT_TAIL(&ctl_conns, c, entry);
+}
+
+static struct ctl_conn *
+control_connbyfd(int fd)
+{
+	struct ctl_conn	*c;
+
+	TAILQ_FOREACH(c, &ctl_conns, entry) {
+		if (c->iev.ibuf.fd == fd)
+			break;
+	}
+
+	return (c);
+}
+
+static struct ctl_conn *
+control_connbyid(uint32_t id)
+{
+	struct ctl_conn	*c;
+
+	TAILQ_FOREACH(c, &ctl_conns, entry) {
+		if (c->id == id)
+			break;
+	}
+
+	return (c);
+}
+
+static void
+control_close(int fd)
+{
+	struct ctl_conn	*c;
+
+	if ((c = control_connbyfd(fd)) == NULL) {
+		log_warnx("%s: fd %d: not found", __func__, fd);
+		return;
+	}
+
+	msgbuf_clear(&c->iev.ibuf.w);
+	TAILQ_REMOVE(&ctl_conns, c, entry);
+
+	event_del(&c->iev.ev);
+	close(c->iev.ibuf.fd);
+
+	/* Some file descriptors are available again. */
+	if (evtimer_pending(&control_state.evt, NULL)) {
+		evtimer_del(&control_state.evt);
+		event_add(&control_state.ev, NULL);
+	}
+
+	free(c);
+}
+
+static void
+control_dispatch_imsg(int fd, short event, void *arg)
+{
+	struct galileo		*env = arg;
+	struct privsep		*ps = env->sc_ps;
+	struct ctl_conn		*c;
+	struct imsg		 imsg;
+	ssize_t			 n;
+	int			 i, nproc, verbose;
+
+	if ((c = control_connbyfd(fd)) == NULL) {
+		log_warnx("%s: fd %d: not found", __func__, fd);
+		return;
+	}
+
+	if (event & EV_READ) {
+		if (((n = imsg_read(&c->iev.ibuf)) == -1 && errno != EAGAIN) ||
+		    n == 0) {
+			control_close(fd);
+			return;
+		}
+	}
+
+	if (event & EV_WRITE) {
+		if (msgbuf_write(&c->iev.ibuf.w) <= 0 && errno != EAGAIN) {
+			control_close(fd);
+			return;
+		}
+	}
+
+	nproc = ps->ps_instances[PROC_PROXY];
+
+	for (;;) {
+		if ((n = imsg_get(&c->iev.ibuf, &imsg)) == -1) {
+			control_close(fd);
+			return;
+		}
+
+		if (n == 0)
+			break;
+
+		switch (imsg.hdr.type) {
+		case IMSG_CTL_SHOW_STATS:
+			for (i = 0; i < nproc; ++i) {
+				env->sc_metrics[i].instance = i;
+				imsg_compose_event(&c->iev, IMSG_CTL_STATS,
+				    0, 0, -1, &env->sc_metrics[i],
+				    sizeof(env->sc_metrics[i]));
+			}
+			imsg_compose_event(&c->iev, IMSG_CTL_END, 0, 0, -1,
+			    NULL, 0);
+			break;
+		case IMSG_CTL_SHOW_CLIENTS:
+			if (c->waiting != 0) {
+				imsg_compose_event(&c->iev, IMSG_CTL_FAIL,
+				    0, 0, -1, NULL, 0);
+				break;
+			}
+			for (i = 0; i < nproc; ++i) {
+				if (proc_compose_imsg(ps, PROC_PROXY, i,
+				    IMSG_CTL_SHOW_CLIENTS, c->id, -1,
+				    NULL, 0) == 0)
+					c->waiting |= 1U << i;
+			}
+			if (c->waiting == 0)
+				imsg_compose_event(&c->iev, IMSG_CTL_END,
+				    0, 0, -1, NULL, 0);
+			break;
+		case IMSG_CTL_DRAIN:
+			log_info("shutdown requested with galileoctl");
+			imsg_compose_event(&c->iev,
+			    parent_drain(env) == -1 ?
+			    IMSG_CTL_FAIL : IMSG_CTL_OK, 0, 0, -1, NULL, 0);
+			break;
+		case IMSG_CTL_RELOAD:
+			log_info("reload requested with galileoctl");
+			imsg_compose_event(&c->iev,
+			    parent_reload(env) == -1 ?
+			    IMSG_CTL_FAIL : IMSG_CTL_OK, 0, 0, -1, NULL, 0);
+			break;
+		case IMSG_CTL_VERBOSE:
+			IMSG_SIZE_CHECK(&imsg, &verbose);
+			memcpy(&verbose, imsg.data, sizeof(verbose));
+			log_setverbose(verbose);
+			proc_compose(ps, PROC_PROXY, IMSG_CTL_VERBOSE,
+			    &verbose, sizeof(verbose));
+			imsg_compose_event(&c->iev, IMSG_CTL_OK, 0, 0, -1,
+			    NULL, 0);
+			break;
+		default:
+			log_debug("%s: error handling imsg %d", __func__,
+			    imsg.hdr.type);
+			break;
+		}
+		imsg_free(&imsg);
+	}
+
+	imsg_event_add(&c->iev);
+}
+
+/*
+ * Relay to galileoctl what the proxy instance n sent back.  The
+ * connection may be gone already.
+ */
+void
+control_forward(struct galileo *env, int n, struct imsg *imsg)
+{
+	struct ctl_conn	*c;
+
+	if ((c = control_connbyid(imsg->hdr.peerid)) == NULL)
+		return;
+
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_CLIENT:
+		imsg_compose_event(&c->iev, IMSG_CTL_CLIENT, 0, 0, -1,
+		    imsg->data, IMSG_DATA_SIZE(imsg));
+		break;
+	case IMSG_CTL_END:
+		control_done(c, n);
+		break;
+	}
+}
+
+/* the proxy instance n is going away, don't wait for it */
+void
+control_gone(int n)
+{
+	struct ctl_conn	*c;
+
+	TAILQ_FOREACH(c, &ctl_conns, entry)
+		control_done(c, n);
+}
+
+static void
+control_done(struct ctl_conn *c, int n)
+{
+	if (n < 0 || n >= PROC_MAX_INSTANCES ||
+	    !(c->waiting & (1U << n)))
+		return;
+
+	c->waiting &= ~(1U << n);
+	if (c->waiting == 0)
+		imsg_compose_event(&c->iev, IMSG_CTL_END, 0, 0, -1, NULL, 0);
+}
@@ -31,6 +31,11 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "config.h"
+
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include "log.h"
 #include "tmpl.h"
 
@@ -40,6 +45,9 @@
 
 #define FCGI_MAX_CONTENT_SIZE	65535
 
+/* size of the regions reserved in the output buffer for templates */
+#define FCGI_RESERVE_SIZE	4096
+
 struct fcgi_header {
 	unsigned char version;
 	unsigned char type;
@@ -135,6 +143,13 @@ enum {
 };
 
 volatile int fcgi_inflight;
+uint64_t fcgi_accepts;
+uint64_t fcgi_request_timeouts;
+uint64_t fcgi_idle_timeouts;
+
+static int	clt_zfinish(struct client *);
+static void	fcgi_timeout(struct fcgi *);
+static void	fcgi_wait(struct fcgi *, int);
 
 static int
 fcgi_send_end_req(struct fcgi *fcgi, int id, int as, int ps)
@@ -168,7 +183,9 @@ end_request(struct client *clt, int status, int proto_status)
 	struct fcgi		*fcgi = clt->clt_fcgi;
 	int			 r;
 
-	if (clt_flush(clt) == -1)
+	proxy_stamp(clt, TS_END);
+
+	if (clt_flush(clt) == -1 || clt_zfinish(clt) == -1)
 		return (-1);
 
 	r = fcgi_send_end_req(fcgi, clt->clt_id, status,
@@ -180,8 +197,11 @@ end_request(struct client *clt, int status, int proto_status)
 
 	SPLAY_REMOVE(client_tree, &fcgi->fcg_clients, clt);
 	proxy_client_free(clt);
+	fcgi_timeout(fcgi);
 
-	if (!fcgi->fcg_keep_conn)
+	/* when draining, close the connection once it's idle */
+	if (!fcgi->fcg_keep_conn || (fcgi->fcg_env->sc_draining &&
+	    SPLAY_EMPTY(&fcgi->fcg_clients)))
 		fcgi->fcg_done = 1;
 
 	return (0);
@@ -203,42 +223,17 @@ static void
 fcgi_inflight_dec(const char *why)
 {
 	fcgi_inflight--;
-	log_debug("%s: fcgi inflight decremented, now %d, %s",
+	DPRINTF("%s: fcgi inflight decremented, now %d, %s",
 	    __func__, fcgi_inflight, why);
 }
 
-void
-fcgi_accept(int fd, short event, void *arg)
+static int
+fcgi_new(struct galileo *env, int s)
 {
-	struct galileo		*env = arg;
-	struct fcgi		*fcgi = NULL;
-	socklen_t		 slen;
-	struct sockaddr_storage	 ss;
-	int			 s = -1;
-
-	event_add(&env->sc_evpause, NULL);
-	if ((event & EV_TIMEOUT))
-		return;
-
-	slen = sizeof(ss);
-	if ((s = accept_reserve(env->sc_sock_fd, (struct sockaddr *)&ss,
-	    &slen, FD_RESERVE, &fcgi_inflight)) == -1) {
-		/*
-		 * Pause accept if we are out of file descriptors, or
-		 * libevent will haunt us here too.
-		 */
-		if (errno == ENFILE || errno == EMFILE) {
-			struct timeval evtpause = { 1, 0 };
-
-			event_del(&env->sc_evsock);
-			evtimer_add(&env->sc_evpause, &evtpause);
-			log_debug("%s: deferring connections", __func__);
-		}
-		return;
-	}
+	struct fcgi		*fcgi;
 
 	if ((fcgi = calloc(1, sizeof(*fcgi))) == NULL)
-		goto err;
+		return (-1);
 
 	fcgi->fcg_id = ++proxy_fcg_id;
 	fcgi->fcg_s = s;
@@ -252,18 +247,69 @@ fcgi_accept(int fd, short event, void *arg)
 
 	fcgi->fcg_bev = bufferevent_new(fcgi->fcg_s, fcgi_read, fcgi_write,
 	    fcgi_error, fcgi);
-	if (fcgi->fcg_bev == NULL)
-		goto err;
+	if (fcgi->fcg_bev == NULL) {
+		free(fcgi);
+		return (-1);
+	}
+
+	/* the front end has to send the request now */
+	evtimer_set(&fcgi->fcg_evwait, fcgi_deadline, fcgi);
+	fcgi_wait(fcgi, FCGI_WAIT_REQUEST);
 
 	SPLAY_INSERT(fcgi_tree, &env->sc_fcgi_socks, fcgi);
 	bufferevent_enable(fcgi->fcg_bev, EV_READ | EV_WRITE);
-	return;
+	return (0);
+}
 
-err:
-	if (s != -1) {
-		close(s);
-		free(fcgi);
-		fcgi_inflight_dec(__func__);
+void
+fcgi_accept(int fd, short event, void *arg)
+{
+	struct listener		*l = arg;
+
+	event_add(&l->l_ev, NULL);
+	if ((event & EV_TIMEOUT))
+		return;
+
+	/* drain the backlog, up to l_batch connections per wakeup */
+	fcgi_accept_queue(l, l->l_batch);
+}
+
+/*
+ * Accept up to max of the connections queued on the listener, or all
+ * of them if max is -1.
+ */
+void
+fcgi_accept_queue(struct listener *l, int max)
+{
+	struct galileo		*env = l->l_env;
+	socklen_t		 slen;
+	struct sockaddr_storage	 ss;
+	int			 i, s;
+
+	for (i = 0; max == -1 || i < max; ++i) {
+		slen = sizeof(ss);
+		if ((s = accept_reserve(l->l_fd, (struct sockaddr *)&ss,
+		    &slen, FD_RESERVE, &fcgi_inflight)) == -1) {
+			/*
+			 * Pause accept if we are out of file descriptors,
+			 * or libevent will haunt us here too.
+			 */
+			if (errno == ENFILE || errno == EMFILE) {
+				struct timeval evtpause = { 1, 0 };
+
+				event_del(&l->l_ev);
+				evtimer_add(&l->l_evpause, &evtpause);
+				log_debugv("%s: deferring connections",
+				    __func__);
+			}
+			return;
+		}
+
+		fcgi_accepts++;
+		if (fcgi_new(env, s) == -1) {
+			close(s);
+			fcgi_inflight_dec(__func__);
+		}
 	}
 }
 
@@ -272,6 +318,9 @@ parse_len(struct fcgi *fcgi, struct evbuffer *src)
 {
 	unsigned char		 c, x[3];
 
+	if (fcgi->fcg_toread < 1)
+		return (-1);
+
 	fcgi->fcg_toread--;
 	evbuffer_remove(src, &c, 1);
 	if (c >> 7 == 0)
@@ -285,6 +334,47 @@ parse_len(struct fcgi *fcgi, struct evbuffer *src)
 	return (((c & 0x7F) << 24) | (x[0] << 16) | (x[1] << 8) | x[2]);
 }
 
+static int
+parse_accept_encoding(char *val)
+{
+	static const struct {
+		const char	*name;
+		int		 enc;
+	} encs[] = {
+		{ "deflate",	ENC_DEFLATE },
+		{ "gzip",	ENC_GZIP },
+		{ "x-gzip",	ENC_GZIP },
+	};
+	char		*t, *q;
+	size_t		 i, len;
+	int		 enc = 0;
+
+	while ((t = strsep(&val, ",")) != NULL) {
+		t += strspn(t, " \t");
+		len = strcspn(t, " \t;");
+
+		for (i = 0; i < nitems(encs); ++i)
+			if (strlen(encs[i].name) == len &&
+			    !strncasecmp(t, encs[i].name, len))
+				break;
+		if (i == nitems(encs))
+			continue;
+
+		/* skip explicitly refused encodings, i.e. q=0 */
+		if ((q = strchr(t, ';')) != NULL) {
+			q++;
+			q += strspn(q, " \t");
+			if (!strncasecmp(q, "q=", 2) && q[2] == '0' &&
+			    strspn(q + 3, ".0") == strcspn(q + 3, " \t;"))
+				continue;
+		}
+
+		enc |= encs[i].enc;
+	}
+
+	return (enc);
+}
+
 static int
 fcgi_parse_params(struct fcgi *fcgi, struct evbuffer *src, struct client *clt)
 {
@@ -293,6 +383,8 @@ fcgi_parse_params(struct fcgi *fcgi, struct evbuffer *src, struct client *clt)
 	char			 path[PATH_MAX];
 	char			 query[GEMINI_MAXLEN];
 	char			 method[8];
+	char			 enc[128];
+	char			 inm[512];
 	int			 nlen, vlen;
 
 	while (fcgi->fcg_toread > 0) {
@@ -300,12 +392,12 @@ fcgi_parse_params(struct fcgi *fcgi, struct evbuffer *src, struct client *clt)
 		    (vlen = parse_len(fcgi, src)) < 0)
 			return (-1);
 
-		if (fcgi->fcg_toread < nlen + vlen)
+		if (nlen > fcgi->fcg_toread || vlen > fcgi->fcg_toread - nlen)
 			return (-1);
 
 		if ((size_t)nlen > sizeof(pname) - 1) {
 			/* ignore this parameter */
-			fcgi->fcg_toread -= nlen - vlen;
+			fcgi->fcg_toread -= nlen + vlen;
 			evbuffer_drain(src, nlen + vlen);
 			continue;
 		}
@@ -402,6 +494,28 @@ fcgi_parse_params(struct fcgi *fcgi, struct evbuffer *src, struct client *clt)
 			continue;
 		}
 
+		if (!strcmp(pname, "HTTP_IF_NONE_MATCH") &&
+		    (size_t)vlen < sizeof(inm)) {
+			fcgi->fcg_toread -= vlen;
+			evbuffer_remove(src, &inm, vlen);
+			inm[vlen] = '\0';
+
+			free(clt->clt_inm);
+			if ((clt->clt_inm = strdup(inm)) == NULL)
+				return (-1);
+			continue;
+		}
+
+		if (!strcmp(pname, "HTTP_ACCEPT_ENCODING") &&
+		    (size_t)vlen < sizeof(enc)) {
+			fcgi->fcg_toread -= vlen;
+			evbuffer_remove(src, &enc, vlen);
+			enc[vlen] = '\0';
+
+			clt->clt_accept_enc = parse_accept_encoding(enc);
+			continue;
+		}
+
 		fcgi->fcg_toread -= vlen;
 		evbuffer_drain(src, vlen);
 	}
@@ -490,8 +604,10 @@ fcgi_read(struct bufferevent *bev, void *d)
 	memset(&q, 0, sizeof(q));
 
 	for (;;) {
-		if (EVBUFFER_LENGTH(src) < (size_t)fcgi->fcg_toread)
+		if (EVBUFFER_LENGTH(src) < (size_t)fcgi->fcg_toread) {
+			fcgi_timeout(fcgi);
 			return;
+		}
 
 		if (fcgi->fcg_want == FCGI_RECORD_HEADER) {
 			fcgi->fcg_want = FCGI_RECORD_BODY;
@@ -578,8 +694,8 @@ fcgi_read(struct bufferevent *bev, void *d)
 				break;
 			}
 
-			clt->clt_tp = template(clt, clt_write, clt->clt_buf,
-			    sizeof(clt->clt_buf));
+			clt->clt_tp = template_reserve(clt, clt_reserve,
+			    clt_commit);
 			if (clt->clt_tp == NULL) {
 				free(clt);
 				log_warn("template");
@@ -590,6 +706,7 @@ fcgi_read(struct bufferevent *bev, void *d)
 			clt->clt_fd = -1;
 			clt->clt_fcgi = fcgi;
 			SPLAY_INSERT(client_tree, &fcgi->fcg_clients, clt);
+			proxy_clients++;
 			break;
 		case FCGI_PARAMS:
 			if (clt == NULL) {
@@ -647,6 +764,66 @@ fcgi_read(struct bufferevent *bev, void *d)
 	}
 }
 
+/*
+ * Give the front end at most fcgi_request_timeout seconds to send a
+ * request, from when the connection was opened or the request
+ * started, and fcgi_idle_timeout seconds of silence before the next
+ * one on a kept-alive connection.  The former is a deadline, not
+ * moved by the reads, or a slow sender could hold the connection
+ * forever.  While the requests are in progress the timeouts to the
+ * Gemini servers apply instead.
+ */
+static void
+fcgi_timeout(struct fcgi *fcgi)
+{
+	struct client		*clt;
+	int			 wait = FCGI_WAIT_IDLE;
+
+	if (fcgi->fcg_want == FCGI_RECORD_BODY ||
+	    EVBUFFER_LENGTH(EVBUFFER_INPUT(fcgi->fcg_bev)) != 0)
+		wait = FCGI_WAIT_REQUEST;
+
+	SPLAY_FOREACH(clt, client_tree, &fcgi->fcg_clients) {
+		if (clt->clt_ts[TS_START] == 0) {
+			wait = FCGI_WAIT_REQUEST;
+			break;
+		}
+		if (wait == FCGI_WAIT_IDLE)
+			wait = FCGI_WAIT_NONE;
+	}
+
+	fcgi_wait(fcgi, wait);
+}
+
+static void
+fcgi_wait(struct fcgi *fcgi, int wait)
+{
+	struct global_config	*conf = &fcgi->fcg_env->sc_conf;
+	struct timeval		 tv;
+
+	if (wait == fcgi->fcg_wait)
+		return;
+	fcgi->fcg_wait = wait;
+
+	evtimer_del(&fcgi->fcg_evwait);
+	if (wait == FCGI_WAIT_REQUEST && conf->fcgi_request_timeout != 0) {
+		timerclear(&tv);
+		tv.tv_sec = conf->fcgi_request_timeout;
+		evtimer_add(&fcgi->fcg_evwait, &tv);
+	}
+
+	bufferevent_settimeout(fcgi->fcg_bev,
+	    wait == FCGI_WAIT_IDLE ? conf->fcgi_idle_timeout : 0, 0);
+}
+
+void
+fcgi_deadline(int fd, short event, void *d)
+{
+	struct fcgi		*fcgi = d;
+
+	fcgi_error(fcgi->fcg_bev, EVBUFFER_READ|EVBUFFER_TIMEOUT, fcgi);
+}
+
 void
 fcgi_write(struct bufferevent *bev, void *d)
 {
@@ -664,7 +841,17 @@ fcgi_error(struct bufferevent *bev, short event, void *d)
 	struct galileo		*env = fcgi->fcg_env;
 	struct client		*clt;
 
-	log_debug("fcgi failure, shutting down connection (ev: %x)",
+	if (event & EVBUFFER_TIMEOUT) {
+		if (fcgi->fcg_wait == FCGI_WAIT_IDLE)
+			fcgi_idle_timeouts++;
+		else {
+			fcgi_request_timeouts++;
+			log_warnx_limit("timeout waiting for the fastcgi "
+			    "request");
+		}
+	}
+
+	log_debugv("fcgi failure, shutting down connection (ev: %x)",
 	    event);
 	fcgi_inflight_dec(__func__);
 
@@ -676,13 +863,15 @@ fcgi_error(struct bufferevent *bev, short event, void *d)
 	SPLAY_REMOVE(fcgi_tree, &env->sc_fcgi_socks, fcgi);
 	fcgi_free(fcgi);
 
-	return;
+	if (env->sc_draining && SPLAY_EMPTY(&env->sc_fcgi_socks))
+		event_loopexit(NULL);
 }
 
 void
 fcgi_free(struct fcgi *fcgi)
 {
 	close(fcgi->fcg_s);
+	evtimer_del(&fcgi->fcg_evwait);
 	bufferevent_free(fcgi->fcg_bev);
 	free(fcgi);
 }
@@ -714,6 +903,7 @@ dowrite(struct client *clt, const void *data, size_t len)
 		return (-1);
 	}
 
+	clt->clt_bytes_out += len;
 	return (0);
 }
 
@@ -735,6 +925,329 @@ clt_write(void *arg, const void *d, size_t len)
 	return (0);
 }
 
+/*
+ * Reserve a region in the output buffer of the FastCGI connection
+ * where to directly write to.  The space for the record header is
+ * left at the start and filled by fcgi_commit().
+ *
+ * The region must be committed before returning to the event loop
+ * or before anything else writes to the same bufferevent: the other
+ * clients multiplexed on it would otherwise invalidate it.
+ */
+static int
+fcgi_reserve(struct client *clt, char **buf, size_t *len)
+{
+	struct fcgi		*fcgi = clt->clt_fcgi;
+	struct bufferevent	*bev = fcgi->fcg_bev;
+	struct evbuffer		*out = EVBUFFER_OUTPUT(bev);
+	size_t			 siz = FCGI_HEADER_LEN + FCGI_RESERVE_SIZE;
+#if HAVE_LIBEVENT2
+	struct evbuffer_iovec	 v;
+
+	if (evbuffer_reserve_space(out, siz, &v, 1) != 1 ||
+	    v.iov_len < siz) {
+		fcgi_error(bev, EV_WRITE, fcgi);
+		return (-1);
+	}
+	clt->clt_rsv = v.iov_base;
+#else
+	if (evbuffer_expand(out, siz) == -1) {
+		fcgi_error(bev, EV_WRITE, fcgi);
+		return (-1);
+	}
+	clt->clt_rsv = (char *)EVBUFFER_DATA(out) + EVBUFFER_LENGTH(out);
+#endif
+
+	*buf = clt->clt_rsv + FCGI_HEADER_LEN;
+	*len = FCGI_RESERVE_SIZE;
+	return (0);
+}
+
+static int
+fcgi_commit(struct client *clt, size_t len)
+{
+	struct fcgi		*fcgi = clt->clt_fcgi;
+	struct bufferevent	*bev = fcgi->fcg_bev;
+	struct evbuffer		*out = EVBUFFER_OUTPUT(bev);
+	struct fcgi_header	 hdr;
+#if HAVE_LIBEVENT2
+	struct evbuffer_iovec	 v;
+#else
+	size_t			 oldoff;
+#endif
+
+	/* an empty FCGI_STDOUT record would end the stream */
+	if (len == 0) {
+		clt->clt_rsv = NULL;
+		return (0);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version = FCGI_VERSION_1;
+	hdr.type = FCGI_STDOUT;
+	hdr.req_id0 = (clt->clt_id & 0xFF);
+	hdr.req_id1 = (clt->clt_id >> 8);
+	hdr.content_len0 = (len & 0xFF);
+	hdr.content_len1 = (len >> 8);
+	memcpy(clt->clt_rsv, &hdr, sizeof(hdr));
+	clt->clt_bytes_out += len;
+
+#if HAVE_LIBEVENT2
+	v.iov_base = clt->clt_rsv;
+	v.iov_len = FCGI_HEADER_LEN + len;
+	clt->clt_rsv = NULL;
+	if (evbuffer_commit_space(out, &v, 1) == -1) {
+		fcgi_error(bev, EV_WRITE, fcgi);
+		return (-1);
+	}
+#else
+	clt->clt_rsv = NULL;
+	oldoff = out->off;
+	out->off += FCGI_HEADER_LEN + len;
+	if (out->cb != NULL)
+		(*out->cb)(out, oldoff, out->off, out->cbarg);
+	if (bufferevent_enable(bev, EV_WRITE) == -1) {
+		fcgi_error(bev, EV_WRITE, fcgi);
+		return (-1);
+	}
+#endif
+
+	return (0);
+}
+
+#if HAVE_ZLIB
+static int
+clt_deflate(struct client *clt, const void *data, size_t len, int flush)
+{
+	struct fcgi		*fcgi = clt->clt_fcgi;
+	z_stream		*zs = clt->clt_zs;
+	char			*buf;
+	size_t			 avail;
+	int			 r;
+
+	zs->next_in = (Bytef *)data;
+	zs->avail_in = len;
+
+	do {
+		if (fcgi_reserve(clt, &buf, &avail) == -1)
+			return (-1);
+
+		zs->next_out = (Bytef *)buf;
+		zs->avail_out = avail;
+		if ((r = deflate(zs, flush)) == Z_STREAM_ERROR) {
+			log_warnx("%s: deflate failed", __func__);
+			fcgi_error(fcgi->fcg_bev, EV_WRITE, fcgi);
+			return (-1);
+		}
+
+		if (fcgi_commit(clt, avail - zs->avail_out) == -1)
+			return (-1);
+	} while (zs->avail_out == 0);
+
+	return (0);
+}
+
+/*
+ * Send the held back data uncompressed, terminating the headers
+ * first.
+ */
+static int
+clt_zskip(struct client *clt)
+{
+	struct evbuffer		*hold = clt->clt_zhold;
+	size_t			 len;
+
+	clt->clt_enc = 0;
+
+	if (clt_write(clt, "\r\n", 2) == -1)
+		return (-1);
+
+	len = EVBUFFER_LENGTH(hold);
+	if (len != 0 && clt_write(clt, EVBUFFER_DATA(hold), len) == -1)
+		return (-1);
+	evbuffer_drain(hold, len);
+	return (0);
+}
+
+static int
+clt_zstart(struct client *clt)
+{
+	struct proxy_config	*pc = clt->clt_pc;
+	struct evbuffer		*hold = clt->clt_zhold;
+	const char		*hdr;
+	size_t			 len;
+	int			 wbits;
+
+	if (clt->clt_enc == ENC_GZIP) {
+		hdr = "Content-Encoding: gzip\r\n\r\n";
+		wbits = 15 + 16;
+	} else {
+		hdr = "Content-Encoding: deflate\r\n\r\n";
+		wbits = 15;
+	}
+
+	if ((clt->clt_zs = calloc(1, sizeof(*clt->clt_zs))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return (clt_zskip(clt));
+	}
+
+	if (deflateInit2(clt->clt_zs, pc->compress_level, Z_DEFLATED,
+	    wbits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		log_warnx("%s: deflateInit2 failed", __func__);
+		free(clt->clt_zs);
+		clt->clt_zs = NULL;
+		return (clt_zskip(clt));
+	}
+
+	if (clt_write(clt, hdr, strlen(hdr)) == -1)
+		return (-1);
+
+	len = EVBUFFER_LENGTH(hold);
+	if (len == 0)
+		return (0);
+	if (clt_deflate(clt, EVBUFFER_DATA(hold), len, Z_NO_FLUSH) == -1)
+		return (-1);
+	evbuffer_drain(hold, len);
+	return (0);
+}
+
+static int
+clt_zwrite(struct client *clt, const void *data, size_t len)
+{
+	struct fcgi		*fcgi = clt->clt_fcgi;
+
+	if (clt->clt_zs != NULL)
+		return (clt_deflate(clt, data, len, Z_NO_FLUSH));
+
+	/* hold back until we know the reply is worth compressing */
+	if (evbuffer_add(clt->clt_zhold, data, len) == -1) {
+		fcgi_error(fcgi->fcg_bev, EV_WRITE, fcgi);
+		return (-1);
+	}
+
+	if (EVBUFFER_LENGTH(clt->clt_zhold) < clt->clt_pc->compress_minsize)
+		return (0);
+	return (clt_zstart(clt));
+}
+
+static int
+clt_zfinish(struct client *clt)
+{
+	int		 r;
+
+	if (clt->clt_enc == 0)
+		return (0);
+
+	if (clt->clt_zs == NULL)
+		return (clt_zskip(clt));
+
+	r = clt_deflate(clt, NULL, 0, Z_FINISH);
+	if (r == 0)
+		clt->clt_enc = 0;
+	return (r);
+}
+
+/*
+ * Compress the rest of the reply.  The headers are expected to be
+ * already flushed but not terminated: they're completed with the
+ * Content-Encoding once enough data is produced to make it worth.
+ */
+int
+clt_compress(struct client *clt)
+{
+	if (clt->clt_accept_enc & ENC_GZIP)
+		clt->clt_enc = ENC_GZIP;
+	else
+		clt->clt_enc = ENC_DEFLATE;
+
+	if (clt->clt_zbuf == NULL &&
+	    (clt->clt_zbuf = malloc(FCGI_RESERVE_SIZE)) == NULL)
+		goto err;
+	if (clt->clt_zhold == NULL &&
+	    (clt->clt_zhold = evbuffer_new()) == NULL)
+		goto err;
+
+	if (clt->clt_pc->compress_minsize == 0)
+		return (clt_zstart(clt));
+	return (0);
+
+ err:
+	log_warn("%s", __func__);
+	clt->clt_enc = 0;
+	return (clt_write(clt, "\r\n", 2));
+}
+
+void
+clt_compress_free(struct client *clt)
+{
+	if (clt->clt_zs != NULL) {
+		deflateEnd(clt->clt_zs);
+		free(clt->clt_zs);
+	}
+	if (clt->clt_zhold != NULL)
+		evbuffer_free(clt->clt_zhold);
+	free(clt->clt_zbuf);
+}
+#else
+/* parse.y rejects `compression', clt_enc is never set. */
+static int
+clt_zwrite(struct client *clt, const void *data, size_t len)
+{
+	return (clt_write(clt, data, len));
+}
+
+static int
+clt_zfinish(struct client *clt)
+{
+	return (0);
+}
+
+int
+clt_compress(struct client *clt)
+{
+	clt->clt_enc = 0;
+	return (clt_write(clt, "\r\n", 2));
+}
+
+void
+clt_compress_free(struct client *clt)
+{
+}
+#endif
+
+int
+clt_reserve(void *arg, char **buf, size_t *len)
+{
+	struct client		*clt = arg;
+
+	if (clt->clt_enc != 0) {
+		*buf = clt->clt_zbuf;
+		*len = FCGI_RESERVE_SIZE;
+		return (0);
+	}
+
+	return (fcgi_reserve(clt, buf, len));
+}
+
+int
+clt_commit(void *arg, const void *d, size_t len)
+{
+	struct client		*clt = arg;
+	struct fcgi		*fcgi = clt->clt_fcgi;
+
+	if (clt->clt_enc != 0)
+		return (clt_zwrite(clt, d, len));
+
+	if (clt->clt_rsv == NULL || d != clt->clt_rsv + FCGI_HEADER_LEN ||
+	    len > FCGI_RESERVE_SIZE) {
+		log_warnx("%s: bogus region", __func__);
+		fcgi_error(fcgi->fcg_bev, EV_WRITE, fcgi);
+		return (-1);
+	}
+
+	return (fcgi_commit(clt, len));
+}
+
 int
 clt_write_bufferevent(struct client *clt, struct bufferevent *bev)
 {
@@ -743,9 +1256,14 @@ clt_write_bufferevent(struct client *clt, struct bufferevent *bev)
 	int			 ret;
 
 	len = EVBUFFER_LENGTH(src);
-	ret = clt_write(clt, EVBUFFER_DATA(src), len);
+	if (clt->clt_enc != 0)
+		ret = clt_zwrite(clt, EVBUFFER_DATA(src), len);
+	else
+		ret = clt_write(clt, EVBUFFER_DATA(src), len);
+	if (ret == -1)
+		return (-1);	/* the client was freed */
 	evbuffer_drain(src, len);
-	return (ret);
+	return (0);
 }
 
 int
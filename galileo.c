@@ -30,6 +30,7 @@
 #include <limits.h>
 #include <locale.h>
 #include <pwd.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -39,6 +40,7 @@
 #include <unistd.h>
 #include <imsg.h>
 
+#include "config.h"
 #include "log.h"
 #include "proc.h"
 #include "xmalloc.h"
@@ -47,11 +49,18 @@
 
 static int		parent_configure(struct galileo *);
 static void		parent_configure_done(struct galileo *);
-static void		parent_reload(struct galileo *);
 static void		parent_sig_handler(int, short, void *);
+static void		parent_copyconf(struct galileo *,
+			    const struct galileo *);
 static int		parent_dispatch_proxy(int, struct privsep_proc *,
 			    struct imsg *);
 static __dead void	parent_shutdown(struct galileo *);
+static void		parent_prefork(struct galileo *);
+static void		parent_load(int, short, void *);
+static void		parent_drained(int, short, void *);
+static void		parent_recycle(struct galileo *, int);
+static int		parent_spawn(struct galileo *, int);
+static void		parent_retire(struct galileo *, int);
 
 static struct privsep_proc procs[] = {
 	{ "proxy",	PROC_PROXY, parent_dispatch_proxy, proxy },
@@ -62,6 +71,7 @@ int pidfd = -1;
 
 const char *conffile = GALILEO_CONF;
 static char *pidfile;
+static char execpath[PATH_MAX];
 
 static __dead void
 usage(void)
@@ -169,6 +179,14 @@ main(int argc, char **argv)
 	if (geteuid())
 		fatalx("need root privileges");
 
+	/* the recycled proxies are started again after daemon(3) */
+	if (proc_id == PROC_PARENT && *argv[0] != '/' &&
+	    strchr(argv[0], '/') != NULL) {
+		if (realpath(argv[0], execpath) == NULL)
+			fatal("realpath %s", argv[0]);
+		argv[0] = execpath;
+	}
+
 	log_setverbose(verbose);
 
 	env = xcalloc(1, sizeof(*env));
@@ -194,6 +212,8 @@ main(int argc, char **argv)
 		fatalx("unknown user %s", GALILEO_USER);
 
 	ps->ps_instances[PROC_PROXY] = env->sc_prefork;
+	/* with `prefork min' the others are started on demand */
+	ps->ps_spawn[PROC_PROXY] = env->sc_prefork_min;
 	ps->ps_instance = proc_instance;
 	if (title != NULL)
 		ps->ps_title[proc_id] = title;
@@ -222,11 +242,21 @@ main(int argc, char **argv)
 
 	log_info("startup");
 
-	if (pledge("stdio rpath wpath cpath chown unix fattr sendfd", NULL)
-	    == -1)
+	env->sc_active = env->sc_prefork_min ? env->sc_prefork_min :
+	    env->sc_prefork;
+
+	/*
+	 * proc exec: the recycled proxies and the ones started on
+	 * demand are forked and re-executed like at startup, so they
+	 * get a fresh address space.  The parent doesn't parse any
+	 * network input.
+	 */
+	if (pledge("stdio rpath wpath cpath chown inet dns unix fattr sendfd "
+	    "proc exec", NULL) == -1)
 		fatal("pledge");
 
 	event_init();
+	log_async();
 
 	signal(SIGPIPE, SIG_IGN);
 
@@ -240,8 +270,13 @@ main(int argc, char **argv)
 	signal_add(&ps->ps_evsigchld, NULL);
 	signal_add(&ps->ps_evsighup, NULL);
 
+	evtimer_set(&env->sc_evload, parent_load, env);
+
 	proc_connect(ps);
 
+	if (control_init(GALILEO_CONTROL) == -1 || control_listen(env) == -1)
+		fatalx("control socket setup failed");
+
 	if (parent_configure(env) == -1)
 		fatalx("configuration failed");
 
@@ -260,27 +295,111 @@ parent_configure(struct galileo *env)
 	int		 id;
 
 	TAILQ_FOREACH(proxy, &env->sc_proxies, pr_entry) {
-		if (config_setproxy(env, proxy) == -1)
+		if (config_setproxy(env, proxy, -1) == -1)
 			fatal("send proxy");
 	}
 
-	/* XXX: eventually they will be more than just one */
 	if (config_setsock(env) == -1)
 		fatal("send socket");
 
-	/* The proxiess need to reload their config. */
-	env->sc_reload = env->sc_prefork;
+	/* The running proxies need to reload their config. */
+	env->sc_reload = env->sc_active;
 
 	for (id = 0; id < PROC_MAX; id++) {
 		if (id == privsep_process)
 			continue;
-		proc_compose(env->sc_ps, id, IMSG_CFG_DONE, env, sizeof(env));
+		proc_compose(env->sc_ps, id, IMSG_CFG_DONE, &env->sc_conf,
+		    sizeof(env->sc_conf));
 	}
 
-	config_purge(env);
+	parent_prefork(env);
+
+	if (metrics_listen(env) == -1)
+		return (-1);
+
+	if (accesslog_open(env) == -1)
+		return (-1);
+
 	return (0);
 }
 
+/*
+ * With `prefork n min m' only m proxy processes are started.  The
+ * others, up to n, are started when the load grows and retired once
+ * it has been low for a while.  The first sc_active slots are the
+ * running ones.
+ */
+static void
+parent_prefork(struct galileo *env)
+{
+	struct privsep	*ps = env->sc_ps;
+	struct timeval	 tv = { PREFORK_INTERVAL, 0 };
+	int		 n, nproc, running;
+
+	nproc = ps->ps_instances[PROC_PROXY];
+	running = env->sc_active;
+
+	if (env->sc_prefork_min == 0)
+		env->sc_active = nproc;
+	if (env->sc_active < env->sc_prefork_min)
+		env->sc_active = env->sc_prefork_min;
+	if (env->sc_active > nproc)
+		env->sc_active = nproc;
+	env->sc_busy = env->sc_idle = 0;
+
+	for (n = running; n < env->sc_active; ++n) {
+		if (parent_spawn(env, n) == -1) {
+			env->sc_active = n;
+			break;
+		}
+	}
+	for (n = running; n > env->sc_active; --n)
+		parent_retire(env, n - 1);
+
+	if (env->sc_active < nproc || env->sc_prefork_min != 0)
+		evtimer_add(&env->sc_evload, &tv);
+	else
+		evtimer_del(&env->sc_evload);
+}
+
+static void
+parent_load(int fd, short event, void *arg)
+{
+	struct galileo	*env = arg;
+	struct privsep	*ps = env->sc_ps;
+	struct timeval	 tv = { PREFORK_INTERVAL, 0 };
+	int		 n, nproc, load = 0;
+
+	nproc = ps->ps_instances[PROC_PROXY];
+	for (n = 0; n < nproc; ++n)
+		load += env->sc_load[n];
+
+	if (load > env->sc_active * PREFORK_BUSY) {
+		env->sc_idle = 0;
+		if (++env->sc_busy >= PREFORK_BUSY_TICKS &&
+		    env->sc_active < nproc) {
+			log_debug("%s: %d clients, starting proxy %d",
+			    __func__, load, env->sc_active + 1);
+			if (parent_spawn(env, env->sc_active) == 0)
+				env->sc_active++;
+			env->sc_busy = 0;
+		}
+	} else if (load < (env->sc_active - 1) * PREFORK_BUSY / 2) {
+		env->sc_busy = 0;
+		if (++env->sc_idle >= PREFORK_IDLE_TICKS &&
+		    env->sc_active > env->sc_prefork_min) {
+			env->sc_active--;
+			log_debug("%s: %d clients, retiring proxy %d",
+			    __func__, load, env->sc_active + 1);
+			parent_retire(env, env->sc_active);
+			env->sc_idle = 0;
+		}
+	} else
+		env->sc_busy = env->sc_idle = 0;
+
+	evtimer_add(&env->sc_evload, &tv);
+}
+
 static void
 parent_configure_done(struct galileo *env)
 {
@@ -302,9 +421,18 @@ parent_configure_done(struct galileo *env)
 	}
 }
 
-static void
+int
 parent_reload(struct galileo *env)
 {
+	struct galileo	*old;
+	struct proxy	*p;
+	struct listener	*l;
+
+	if (env->sc_draining) {
+		log_warnx("%s: shutting down", __func__);
+		return (-1);
+	}
+
 	if (env->sc_reload) {
 		log_debug("%s: already in progress: %d pending",
 		    __func__, env->sc_reload);
@@ -312,15 +440,72 @@ parent_reload(struct galileo *env)
 
 	log_debug("%s: config file %s", __func__, conffile);
 
-	config_purge(env);
-
+	/*
+	 * Keep the current proxies until the new configuration is
+	 * loaded, they're needed to respawn the recycled processes.
+	 * The sockets are kept open, config_setsock will reuse them.
+	 */
+	TAILQ_CONCAT(&env->sc_retired, &env->sc_proxies, pr_entry);
+	TAILQ_CONCAT(&env->sc_oldlisteners, &env->sc_listeners, l_entry);
+
+	/* and the global settings, in case the new ones don't parse */
+	old = xmalloc(sizeof(*old));
+	parent_copyconf(old, env);
+
+	env->sc_prefork_min = 0;
+	env->sc_affinity = 0;
+	env->sc_ncpus = 0;
+	env->sc_conf.drain_timeout = DRAIN_TIMEOUT;
+	env->sc_conf.max_requests = 0;
+	env->sc_conf.slow_threshold = 0;
+	env->sc_conf.access_log = ACCESSLOG_NONE;
+	env->sc_conf.fcgi_request_timeout = FCGI_TIMEOUT_REQUEST;
+	env->sc_conf.fcgi_idle_timeout = FCGI_TIMEOUT_IDLE;
+	*env->sc_metrics_sock = '\0';
+	*env->sc_accesslog = '\0';
 	if (parse_config(conffile, env) == -1) {
 		log_warnx("failed to load config file: %s", conffile);
-		return;
+		while ((p = TAILQ_FIRST(&env->sc_proxies)) != NULL) {
+			TAILQ_REMOVE(&env->sc_proxies, p, pr_entry);
+			proxy_purge(p);
+		}
+		while ((l = TAILQ_FIRST(&env->sc_listeners)) != NULL) {
+			TAILQ_REMOVE(&env->sc_listeners, l, l_entry);
+			free(l);
+		}
+		TAILQ_CONCAT(&env->sc_proxies, &env->sc_retired, pr_entry);
+		TAILQ_CONCAT(&env->sc_listeners, &env->sc_oldlisteners,
+		    l_entry);
+		parent_copyconf(env, old);
+		free(old);
+		return (-1);
+	}
+	free(old);
+
+	while ((p = TAILQ_FIRST(&env->sc_retired)) != NULL) {
+		TAILQ_REMOVE(&env->sc_retired, p, pr_entry);
+		proxy_purge(p);
 	}
 
 	config_setreset(env);
-	parent_configure(env);
+	return (parent_configure(env));
+}
+
+/* copy the global settings set by parse_config */
+static void
+parent_copyconf(struct galileo *dst, const struct galileo *src)
+{
+	memcpy(&dst->sc_conf, &src->sc_conf, sizeof(dst->sc_conf));
+	dst->sc_prefork = src->sc_prefork;
+	dst->sc_prefork_min = src->sc_prefork_min;
+	dst->sc_affinity = src->sc_affinity;
+	memcpy(dst->sc_cpus, src->sc_cpus, sizeof(dst->sc_cpus));
+	dst->sc_ncpus = src->sc_ncpus;
+	memcpy(dst->sc_chroot, src->sc_chroot, sizeof(dst->sc_chroot));
+	memcpy(dst->sc_metrics_sock, src->sc_metrics_sock,
+	    sizeof(dst->sc_metrics_sock));
+	memcpy(dst->sc_accesslog, src->sc_accesslog,
+	    sizeof(dst->sc_accesslog));
 }
 
 static void
@@ -341,9 +526,15 @@ parent_sig_handler(int sig, short ev, void *arg)
 		parent_reload(ps->ps_env);
 		break;
 	case SIGCHLD:
+		if (proc_reap(ps) == 0)
+			break;
 		log_warnx("one child died, quitting.");
-		/* fallthrough */
+		parent_shutdown(ps->ps_env);
+		break;
 	case SIGTERM:
+		log_info("shutdown requested, draining the proxies");
+		parent_drain(ps->ps_env);
+		break;
 	case SIGINT:
 		parent_shutdown(ps->ps_env);
 		break;
@@ -355,13 +546,53 @@ parent_sig_handler(int sig, short ev, void *arg)
 static int
 parent_dispatch_proxy(int fd, struct privsep_proc *p, struct imsg *imsg)
 {
-	struct privsep	*ps = p->p_ps;
-	struct galileo	*env = ps->ps_env;
+	struct privsep		*ps = p->p_ps;
+	struct galileo		*env = ps->ps_env;
+	struct proxy_load	 load;
+	int			 n, current;
+
+	/* retired proxies only get to report what they did */
+	n = imsg->hdr.pid - 1;
+	current = n >= 0 && n < (int)ps->ps_instances[PROC_PROXY] &&
+	    proc_ibuf(ps, PROC_PROXY, n)->fd == fd;
 
 	switch (imsg->hdr.type) {
 	case IMSG_CFG_DONE:
 		parent_configure_done(env);
 		break;
+	case IMSG_CTL_LOAD:
+		if (IMSG_DATA_SIZE(imsg) != sizeof(load))
+			fatalx("%s: bad imsg size", __func__);
+		memcpy(&load, imsg->data, sizeof(load));
+		if (load.instance < 0 || load.instance >= PROC_MAX_INSTANCES) {
+			log_warnx("%s: invalid proxy instance %d", __func__,
+			    load.instance);
+			break;
+		}
+		if (current)
+			env->sc_load[load.instance] = load.clients;
+		break;
+	case IMSG_CTL_METRICS:
+		metrics_update(env, imsg, current);
+		break;
+	case IMSG_CTL_ACCESSLOG:
+		accesslog_write(env, imsg);
+		break;
+	case IMSG_CTL_UNLISTEN:
+		/* nobody accepts from the sockets of an empty slot */
+		if (n >= 0 && n < (int)ps->ps_instances[PROC_PROXY] &&
+		    !proc_running(ps, PROC_PROXY, n))
+			config_dropsock(env, n);
+		break;
+	case IMSG_CTL_RECYCLE:
+		if (current)
+			parent_recycle(env, n);
+		break;
+	case IMSG_CTL_CLIENT:
+	case IMSG_CTL_END:
+		if (current)
+			control_forward(env, n, imsg);
+		break;
 	default:
 		return (-1);
 	}
@@ -369,10 +600,113 @@ parent_dispatch_proxy(int fd, struct privsep_proc *p, struct imsg *imsg)
 	return (0);
 }
 
+/*
+ * Retire all the proxies and wait for them to finish serving their
+ * clients, so that their last counters and access log records are
+ * still written.
+ */
+int
+parent_drain(struct galileo *env)
+{
+	struct timeval	 tv = { 1, 0 };
+	int		 n;
+
+	if (env->sc_draining)
+		return (-1);
+	env->sc_draining = 1;
+
+	evtimer_del(&env->sc_evload);
+
+	for (n = 0; n < env->sc_active; ++n)
+		parent_retire(env, n);
+	env->sc_active = 0;
+
+	evtimer_set(&env->sc_evdrain, parent_drained, env);
+	evtimer_add(&env->sc_evdrain, &tv);
+	return (0);
+}
+
+static void
+parent_drained(int fd, short event, void *arg)
+{
+	struct galileo	*env = arg;
+	struct timeval	 tv = { 1, 0 };
+
+	if (!TAILQ_EMPTY(&env->sc_ps->ps_retired)) {
+		evtimer_add(&env->sc_evdrain, &tv);
+		return;
+	}
+
+	parent_shutdown(env);
+}
+
+/*
+ * A proxy served its quota of requests and is draining: start a
+ * new one in its slot with the current configuration.
+ */
+static void
+parent_recycle(struct galileo *env, int n)
+{
+	log_info("recycling proxy %d", n + 1);
+	control_gone(n);
+
+	if (parent_spawn(env, n) == -1)
+		fatalx("failed to respawn proxy %d", n + 1);
+}
+
+/*
+ * Start a proxy in the given slot and send it the configuration and
+ * the sockets, as parent_configure does at startup.
+ */
+static int
+parent_spawn(struct galileo *env, int n)
+{
+	struct privsep	*ps = env->sc_ps;
+	struct proxy	*proxy;
+
+	if (proc_respawn(ps, PROC_PROXY, n) == -1)
+		return (-1);
+	env->sc_load[n] = 0;
+
+	TAILQ_FOREACH(proxy, &env->sc_proxies, pr_entry) {
+		if (config_setproxy(env, proxy, n) == -1)
+			fatal("send proxy");
+	}
+
+	if (config_sendsock(env, n) == -1)
+		fatal("send socket");
+
+	env->sc_reload++;
+	proc_compose_imsg(ps, PROC_PROXY, n, IMSG_CFG_DONE, -1, -1,
+	    &env->sc_conf, sizeof(env->sc_conf));
+	return (0);
+}
+
+/*
+ * Tell the proxy in the given slot to drain and free the slot.  It
+ * exits on its own once its clients are done.
+ */
+static void
+parent_retire(struct galileo *env, int n)
+{
+	struct privsep		*ps = env->sc_ps;
+	struct proxy_metrics	*m = &env->sc_metrics[n];
+
+	proc_compose_imsg(ps, PROC_PROXY, n, IMSG_CTL_DRAIN, -1, -1, NULL, 0);
+	proc_retire(ps, PROC_PROXY, n);
+	control_gone(n);
+
+	env->sc_load[n] = 0;
+	m->clients = m->fcgi_conns = 0;
+}
+
 static __dead void
 parent_shutdown(struct galileo *env)
 {
 	config_purge(env);
+	metrics_close();
+	accesslog_close();
+	control_cleanup();
 
 	proc_kill(env->sc_ps);
 
@@ -383,6 +717,37 @@ parent_shutdown(struct galileo *env)
 	exit(0);
 }
 
+/*
+ * Return the CPU the given proxy instance should run on, or -1.  With
+ * `cpu affinity auto' the instances are spread over the CPUs we're
+ * allowed to run on, so the parent and the proxies agree on the
+ * mapping.
+ */
+int
+proxy_cpu(struct galileo *env, int instance)
+{
+#if HAVE_SCHED_SETAFFINITY
+	cpu_set_t	 set;
+	int		 cpu, n;
+
+	switch (env->sc_affinity) {
+	case AFFINITY_LIST:
+		return (env->sc_cpus[instance % env->sc_ncpus]);
+	case AFFINITY_AUTO:
+		if (sched_getaffinity(0, sizeof(set), &set) == -1 ||
+		    (n = CPU_COUNT(&set)) == 0)
+			return (-1);
+		n = instance % n;
+		for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			if (CPU_ISSET(cpu, &set) && n-- == 0)
+				return (cpu);
+		return (-1);
+	}
+#endif
+
+	return (-1);
+}
+
 int
 accept_reserve(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
     int reserve, volatile int *counter)
@@ -396,7 +761,7 @@ accept_reserve(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
 
 	if ((ret = accept4(sockfd, addr, addrlen, SOCK_NONBLOCK)) > -1) {
 		(*counter)++;
-		log_debug("%s: inflight incremented, now %d",__func__, *counter);
+		DPRINTF("%s: inflight incremented, now %d", __func__, *counter);
 	}
 	return (ret);
 }
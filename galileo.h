@@ -33,17 +33,43 @@
 #define GALILEO_SOCK		"/var/www/run/galileo.sock"
 #endif
 
+#ifndef GALILEO_CONTROL
+#define GALILEO_CONTROL		"/var/run/galileo.sock"
+#endif
+
 #define FD_RESERVE		5
+#define LISTEN_BACKLOG		128
+#define ACCEPT_BATCH		16
 #define PROC_MAX_INSTANCES	32
+#define PREFORK_INTERVAL	1	/* seconds */
+#define PREFORK_BUSY		8	/* clients per accepting proxy */
+#define PREFORK_BUSY_TICKS	3
+#define PREFORK_IDLE_TICKS	30
+#define DRAIN_TIMEOUT		30	/* seconds */
+#define FCGI_TIMEOUT_REQUEST	30
+#define FCGI_TIMEOUT_IDLE	60
+#define ACCESSLOG_BATCH		8192	/* bytes of records per imsg */
 #define PROXY_NUMPROC		3
 #define PROC_PARENT_SOCK_FILENO	3
 #define GEMINI_MAXLEN		(1024 + 1) /* NULL */
 #define FORM_URLENCODED		"application/x-www-form-urlencoded"
+#define PROXY_MAX_IMGEXTS	16
+#define PROXY_IMGEXT_LEN	8
+#define COMPRESS_LEVEL		6
+#define COMPRESS_MINSIZE	512
+#define ETAG_MAXSIZE		(512 * 1024)
+#define ETAG_HASHLEN		16	/* bytes of the SHA-256 in the ETag */
+#define TIMEOUT_CONNECT		5	/* seconds */
+#define TIMEOUT_FIRSTBYTE	30
+#define TIMEOUT_IDLE		60
+#define PROXY_TABLE_SIZE	64	/* initial, power of two */
+#define PROXY_NSTRS		5	/* strings in struct proxy_config */
+#define LAT_BUCKETS		16	/* powers of two of milliseconds */
 
 #ifdef DEBUG
 #define DPRINTF		log_debug
 #else
-#define DPRINTF(x...)	do {} while (0)
+#define DPRINTF(...)	do {} while (0)
 #endif
 
 enum {
@@ -52,6 +78,33 @@ enum {
 	METHOD_POST,
 };
 
+/* when the phases of a request ended */
+enum {
+	TS_START,		/* proxy_start_request */
+	TS_RESOLVED,		/* proxy_resolved */
+	TS_CONNECTED,		/* proxy_connect */
+	TS_HANDSHAKE,		/* first tls_write, only with TLS */
+	TS_FIRSTBYTE,		/* first proxy_read */
+	TS_HEADERS,		/* proxy_start_reply */
+	TS_END,			/* end_request */
+	TS_DONE,		/* proxy_client_free */
+	TS_MAX,
+};
+
+/* the latencies in the histograms of struct proxy_stats */
+enum {
+	LAT_DNS,
+	LAT_CONNECT,
+	LAT_TLS,
+	LAT_TTFB,
+	LAT_HEADERS,
+	LAT_BODY,
+	LAT_TRANSLATE,
+	LAT_WRITE,
+	LAT_TOTAL,
+	LAT_MAX,
+};
+
 enum {
 	IMSG_NONE,
 	IMSG_CFG_START,
@@ -62,6 +115,23 @@ enum {
 	IMSG_CTL_RESET,
 	IMSG_CTL_RESTART,
 	IMSG_CTL_PROCFD,
+	IMSG_CTL_LOAD,
+	IMSG_CTL_DRAIN,
+	IMSG_CTL_UNLISTEN,
+	IMSG_CTL_RECYCLE,
+	IMSG_CTL_METRICS,
+	IMSG_CTL_ACCESSLOG,
+
+	/* galileoctl */
+	IMSG_CTL_OK,
+	IMSG_CTL_FAIL,
+	IMSG_CTL_END,
+	IMSG_CTL_RELOAD,
+	IMSG_CTL_VERBOSE,
+	IMSG_CTL_SHOW_STATS,
+	IMSG_CTL_STATS,
+	IMSG_CTL_SHOW_CLIENTS,
+	IMSG_CTL_CLIENT,
 };
 
 struct galileo;
@@ -72,6 +142,7 @@ struct privsep;
 struct privsep_proc;
 struct template;
 struct tls;
+struct z_stream_s;
 
 struct client {
 	uint32_t		 clt_id;
@@ -85,6 +156,7 @@ struct client {
 	int			 clt_bodydone;
 	char			*clt_body;
 	int			 clt_bodylen;
+	struct proxy		*clt_pr;
 	struct proxy_config	*clt_pc;
 	struct event_asr	*clt_evasr;
 	struct addrinfo		*clt_addrinfo;
@@ -95,6 +167,22 @@ struct client {
 	struct bufferevent	*clt_bev;
 	int			 clt_headersdone;
 	struct template		*clt_tp;
+	char			*clt_mime;
+	char			 clt_lang[16];
+	char			*clt_inm;
+	char			 clt_etag[64];
+	int			 clt_etagwait;
+#define REVAL_NONE	0
+#define REVAL_HIT	1	/* 304 Not Modified */
+#define REVAL_MISS	2
+#define REVAL_SKIP	3	/* too big to compute the ETag */
+	int			 clt_reval;
+	int			 clt_status;
+	int			 clt_code;		/* upstream status */
+	size_t			 clt_bytes_in;		/* from upstream */
+	size_t			 clt_bytes_out;		/* FastCGI output */
+	uint64_t		 clt_ts[TS_MAX];
+	uint64_t		 clt_translate_us;
 
 #define TR_ENABLED	0x1
 #define TR_PRE		0x2
@@ -102,7 +190,16 @@ struct client {
 #define TR_NAV		0x8
 	int			 clt_translate;
 
-	char			 clt_buf[1024];
+	/* region reserved in the FastCGI output buffer */
+	char			*clt_rsv;
+
+#define ENC_GZIP	0x1
+#define ENC_DEFLATE	0x2
+	int			 clt_accept_enc;
+	int			 clt_enc;
+	char			*clt_zbuf;
+	struct evbuffer		*clt_zhold;
+	struct z_stream_s	*clt_zs;
 
 	SPLAY_ENTRY(client)	 clt_nodes;
 };
@@ -120,6 +217,11 @@ struct fcgi {
 	uint16_t		 fcg_rec_id;
 	int			 fcg_keep_conn;
 	int			 fcg_done;
+#define FCGI_WAIT_NONE		0	/* requests in progress */
+#define FCGI_WAIT_REQUEST	1
+#define FCGI_WAIT_IDLE		2
+	int			 fcg_wait;
+	struct event		 fcg_evwait;	/* request deadline */
 
 	struct galileo		*fcg_env;
 
@@ -127,66 +229,265 @@ struct fcgi {
 };
 SPLAY_HEAD(fcgi_tree, fcgi);
 
+struct cache_policy {
+	int		 cp_maxage;
+	int		 cp_swr;
+#define CACHE_SET	0x1
+#define CACHE_PUBLIC	0x2
+#define CACHE_PRIVATE	0x4
+	int		 cp_flags;
+};
+
+#define CACHE_PAGES	0x1
+#define CACHE_MEDIA	0x2
+
+/*
+ * The strings are interned and never NULL.  They're sent over imsg
+ * after the structure, see config_setproxy.
+ */
 struct proxy_config {
-	char		 host[HOST_NAME_MAX + 1];
-	char		 stylesheet[PATH_MAX];
-	char		 proxy_addr[HOST_NAME_MAX + 1];
-	char		 proxy_name[HOST_NAME_MAX + 1];
-	char		 proxy_port[6];
+	const char	*host;
+	const char	*stylesheet;
+	const char	*proxy_addr;
+	const char	*proxy_name;
+	const char	*proxy_port;
+	char		 imgexts[PROXY_MAX_IMGEXTS][PROXY_IMGEXT_LEN];
+	int		 nimgexts;
+	int		 compress_level;
+	size_t		 compress_minsize;
+	struct cache_policy cache_pages;
+	struct cache_policy cache_media;
+	int		 timeout_connect;	/* seconds, 0 for none */
+	int		 timeout_firstbyte;
+	int		 timeout_idle;
+	int		 timeout_total;
+	size_t		 max_response;		/* bytes, 0 for no limit */
 
 #define PROXY_NO_TLS	0x1
 #define PROXY_NO_NAVBAR	0x2
 #define PROXY_NO_FOOTER	0x4
 #define PROXY_NO_IMGPRV	0x8
+#define PROXY_COMPRESS	0x10
+#define PROXY_ETAG	0x20
 	int		 flags;
 };
 
+/*
+ * Histograms of the request latencies: bucket 0 counts the ones
+ * under a millisecond, bucket n those in [2^(n-1), 2^n) ms.
+ */
+struct proxy_stats {
+	uint64_t		 st_requests;
+	uint64_t		 st_hist[LAT_MAX][LAT_BUCKETS];
+};
+
 struct proxy {
 	TAILQ_ENTRY(proxy)	 pr_entry;
 	struct proxy_config	 pr_conf;
+
+	/* only in the proxy processes */
+	struct proxy_stats	*pr_stats;
+	uint32_t		 pr_gen;
+	int			 pr_refs;
+	int			 pr_retired;
 };
 TAILQ_HEAD(proxylist, proxy);
 
+/*
+ * Open addressing hash table of the proxies, indexed by host name or
+ * by the suffix of a `*.domain' pattern, case-insensitive.
+ */
+struct proxy_slot {
+	uint32_t		 ps_hash;
+	struct proxy		*ps_proxy;
+};
+
+struct proxy_table {
+	struct proxy_slot	*pt_slots;
+	size_t			 pt_size;
+	size_t			 pt_count;
+};
+
+struct listener {
+	TAILQ_ENTRY(listener)	 l_entry;
+	struct sockaddr_storage	 l_ss;
+	socklen_t		 l_slen;
+	int			 l_backlog;
+	int			 l_batch;
+#define LISTEN_REUSEPORT	0x1
+	int			 l_flags;
+
+	/* only in the parent, kept open across reloads */
+	int			 l_nfds;
+	int			 l_fds[PROC_MAX_INSTANCES];
+
+	/* only in the proxy processes */
+	int			 l_fd;
+	struct galileo		*l_env;
+	struct event		 l_ev;
+	struct event		 l_evpause;
+};
+TAILQ_HEAD(listenerlist, listener);
+
+/* a listener as sent to the proxies, along with its socket */
+struct listener_config {
+	struct sockaddr_storage	 ss;
+	socklen_t		 slen;
+	int			 backlog;
+	int			 batch;
+	int			 flags;
+};
+
+struct proxy_load {
+	int			 instance;
+	int			 clients;
+};
+
+/*
+ * Counters of a proxy process, sent to the parent every
+ * PREFORK_INTERVAL.  Apart from the gauges they count what happened
+ * since the previous report and the parent adds them up, so they
+ * survive the proxies being recycled.
+ */
+struct proxy_metrics {
+	int			 instance;
+	int			 clients;		/* gauge */
+	int			 fcgi_conns;		/* gauge */
+	uint64_t		 requests;
+	uint64_t		 accepts;		/* fcgi connections */
+	uint64_t		 bytes_in;
+	uint64_t		 bytes_out;
+	uint64_t		 status[5];		/* 1xx to 5xx */
+	uint64_t		 not_modified;
+	uint64_t		 dns_errors;
+	uint64_t		 connect_errors;
+	uint64_t		 tls_errors;
+	uint64_t		 fcgi_request_timeouts;
+	uint64_t		 fcgi_idle_timeouts;
+	uint64_t		 lat_sum[LAT_MAX];	/* us */
+	uint64_t		 lat[LAT_MAX][LAT_BUCKETS];
+};
+
+/* a client in flight, for `galileoctl show clients' */
+struct ctl_client {
+	int			 instance;
+	uint32_t		 fcgi_id;
+	uint32_t		 id;
+	int			 phase;		/* last TS_* reached or -1 */
+	int			 tls;
+	int			 status;
+	uint64_t		 age;		/* ms */
+	char			 host[256];
+	char			 path[GEMINI_MAXLEN];
+};
+
+/* settings sent to the proxies at every (re)configuration */
+struct global_config {
+	int			 drain_timeout;
+	int			 max_requests;
+	int			 slow_threshold;	/* ms */
+#define ACCESSLOG_NONE		0
+#define ACCESSLOG_FILE		1
+#define ACCESSLOG_SYSLOG	2
+	int			 access_log;
+	int			 fcgi_request_timeout;
+	int			 fcgi_idle_timeout;
+};
+
 struct galileo {
 	char			 sc_conffile[PATH_MAX];
+	struct global_config	 sc_conf;
 	uint16_t		 sc_prefork;
+	uint16_t		 sc_prefork_min;
+#define AFFINITY_AUTO	1
+#define AFFINITY_LIST	2
+	int			 sc_affinity;
+	int			 sc_cpus[PROC_MAX_INSTANCES];
+	int			 sc_ncpus;
 	char			 sc_chroot[PATH_MAX];
+	char			 sc_metrics_sock[PATH_MAX];
+	char			 sc_accesslog[PATH_MAX];
 	struct proxylist	 sc_proxies;
+	struct proxylist	 sc_retired;
+	struct proxylist	 sc_newproxies;	/* until IMSG_CFG_DONE */
+	struct proxy_table	 sc_hosts;
+	struct proxy_table	 sc_wildcards;
+	struct proxy_table	 sc_newhosts;
+	struct proxy_table	 sc_newwildcards;
+	uint32_t		 sc_gen;
+	struct listenerlist	 sc_listeners;
+	struct listenerlist	 sc_oldlisteners;
 	struct fcgi_tree	 sc_fcgi_socks;
 
 	struct privsep		*sc_ps;
 	int			 sc_reload;
 
-	/* XXX: generalize */
-	int		sc_sock_fd;
-	struct event	sc_evsock;
-	struct event	sc_evpause;
+	/* adaptive prefork */
+	struct event		 sc_evload;
+	int			 sc_load[PROC_MAX_INSTANCES];
+	int			 sc_active;
+	int			 sc_busy;
+	int			 sc_idle;
+
+	/* graceful shutdown */
+	struct event		 sc_evdrain;
+	int			 sc_draining;
+
+	/* counters of the proxies, only in the parent */
+	struct proxy_metrics	 sc_metrics[PROC_MAX_INSTANCES];
 };
 
 extern int privsep_process;
 
+/* accesslog.c */
+int	 accesslog_open(struct galileo *);
+void	 accesslog_close(void);
+void	 accesslog_write(struct galileo *, struct imsg *);
+
 /* config.c */
 int	 config_init(struct galileo *);
 void	 config_purge(struct galileo *);
-int	 config_setproxy(struct galileo *, struct proxy *);
+int	 config_setproxy(struct galileo *, struct proxy *, int);
 int	 config_getproxy(struct galileo *, struct imsg *);
 int	 config_setsock(struct galileo *);
+int	 config_sendsock(struct galileo *, int);
+void	 config_dropsock(struct galileo *, int);
 int	 config_getsock(struct galileo *, struct imsg *);
 int	 config_setreset(struct galileo *);
 int	 config_getreset(struct galileo *, struct imsg *);
 int	 config_getcfg(struct galileo *, struct imsg *);
+const char *config_intern(const char *);
+void	 config_unintern(const char *);
+
+/* control.c */
+int	 control_init(const char *);
+int	 control_listen(struct galileo *);
+void	 control_cleanup(void);
+void	 control_forward(struct galileo *, int, struct imsg *);
+void	 control_gone(int);
 
 /* fcgi.c */
+extern volatile int fcgi_inflight;
+extern uint64_t fcgi_accepts;
+extern uint64_t fcgi_request_timeouts;
+extern uint64_t fcgi_idle_timeouts;
+
 int	 fcgi_end_request(struct client *, int);
 int	 fcgi_abort_request(struct client *);
 void	 fcgi_accept(int, short, void *);
+void	 fcgi_accept_queue(struct listener *, int);
 void	 fcgi_read(struct bufferevent *, void *);
 void	 fcgi_write(struct bufferevent *, void *);
 void	 fcgi_error(struct bufferevent *, short error, void *);
+void	 fcgi_deadline(int, short, void *);
 void	 fcgi_free(struct fcgi *);
 int	 clt_write_bufferevent(struct client *, struct bufferevent *);
 int	 clt_flush(struct client *);
 int	 clt_write(void *, const void *, size_t);
+int	 clt_reserve(void *, char **, size_t *);
+int	 clt_commit(void *, const void *, size_t);
+int	 clt_compress(struct client *);
+void	 clt_compress_free(struct client *);
 int	 fcgi_cmp(struct fcgi *, struct fcgi *);
 int	 fcgi_client_cmp(struct client *, struct client *);
 
@@ -200,19 +501,43 @@ int	 tp_error(struct template *, int, const char *);
 int	 tp_inputpage(struct template *, const char *);
 
 /* galileo.c */
+int	 parent_reload(struct galileo *);
+int	 parent_drain(struct galileo *);
+int	 proxy_cpu(struct galileo *, int);
 int	 accept_reserve(int, struct sockaddr *, socklen_t *, int,
 	     volatile int *);
+
+/* gemtext.c */
+int	 proxy_resurl(struct client *, const char *, char *, size_t);
+int	 gemtext_translate(struct client *);
+
+/* metrics.c */
+int	 metrics_listen(struct galileo *);
+void	 metrics_close(void);
+void	 metrics_update(struct galileo *, struct imsg *, int);
+int	 metrics_print(struct galileo *, struct evbuffer *);
+
 /* parse.y */
 int	 parse_config(const char *, struct galileo *);
 int	 cmdline_symset(char *);
 
 /* proxy.c */
+extern volatile int proxy_clients;
 extern volatile int proxy_inflight;
 extern uint32_t proxy_fcg_id;
 
 void			 proxy(struct privsep *, struct privsep_proc *);
+struct proxy		*proxy_new(void);
+void			 proxy_setstr(const char **, const char *);
 void			 proxy_purge(struct proxy *);
-struct proxy_config	*proxy_match(struct galileo *, const char *);
+void			 proxy_release(struct galileo *, struct proxy *);
+void			 proxy_drain(struct galileo *, int);
+int			 proxy_index(struct galileo *, struct proxy *);
+void			 proxy_index_clear(struct galileo *);
+void			 proxy_index_swap(struct galileo *);
+struct proxy		*proxy_match(struct galileo *, const char *);
+uint64_t		 proxy_now(void);
+void			 proxy_stamp(struct client *, int);
 int			 proxy_start_request(struct galileo *, struct client *);
 void			 proxy_client_free(struct client *);
 
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2025 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/tree.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <imsg.h>
+
+#include "config.h"
+#include "proc.h"
+
+#include "galileo.h"
+
+enum {
+	NONE,
+	DRAIN,
+	LOG_BRIEF,
+	LOG_VERBOSE,
+	RELOAD,
+	SHOW_CLIENTS,
+	SHOW_STATS,
+};
+
+static const struct {
+	const char	*words[2];
+	int		 action;
+} cmds[] = {
+	{ { "drain", NULL },		DRAIN },
+	{ { "log", "brief" },		LOG_BRIEF },
+	{ { "log", "verbose" },		LOG_VERBOSE },
+	{ { "reload", NULL },		RELOAD },
+	{ { "show", "clients" },	SHOW_CLIENTS },
+	{ { "show", "stats" },		SHOW_STATS },
+};
+
+static const char *lat_phases[LAT_MAX] = {
+	"dns",
+	"connect",
+	"tls",
+	"ttfb",
+	"headers",
+	"body",
+	"translate",
+	"write",
+	"total",
+};
+
+static int	ret;
+
+static __dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-s socket] command [argument ...]\n",
+	    getprogname());
+	exit(1);
+}
+
+static int
+parse(int argc, char **argv)
+{
+	size_t	 i;
+	int	 j;
+
+	for (i = 0; i < nitems(cmds); ++i) {
+		for (j = 0; j < argc && j < 2; ++j)
+			if (cmds[i].words[j] == NULL ||
+			    strcmp(cmds[i].words[j], argv[j]) != 0)
+				break;
+		if (j == argc && (j == 2 || cmds[i].words[j] == NULL))
+			return (cmds[i].action);
+	}
+
+	return (NONE);
+}
+
+static const char *
+phase(struct ctl_client *cc)
+{
+	switch (cc->phase) {
+	case -1:
+		return ("params");
+	case TS_START:
+		return ("dns");
+	case TS_RESOLVED:
+		return ("connect");
+	case TS_CONNECTED:
+		return (cc->tls ? "tls" : "ttfb");
+	case TS_HANDSHAKE:
+		return ("ttfb");
+	case TS_FIRSTBYTE:
+		return ("headers");
+	case TS_HEADERS:
+		return ("body");
+	default:
+		return ("write");
+	}
+}
+
+/* the upper bound of the bucket where the given quantile falls */
+static const char *
+quantile(uint64_t *hist, uint64_t count, double q)
+{
+	static char	 buf[16];
+	uint64_t	 n = 0;
+	int		 b;
+
+	if (count == 0)
+		return ("-");
+
+	for (b = 0; b < LAT_BUCKETS - 1; ++b) {
+		n += hist[b];
+		if (n >= q * count)
+			break;
+	}
+
+	if (b == LAT_BUCKETS - 1)
+		(void)snprintf(buf, sizeof(buf), ">%.1fs",
+		    (1 << (b - 1)) / 1000.0);
+	else if (b < 10)
+		(void)snprintf(buf, sizeof(buf), "<%dms", 1 << b);
+	else
+		(void)snprintf(buf, sizeof(buf), "<%.1fs", (1 << b) / 1000.0);
+	return (buf);
+}
+
+static int
+show_stats(struct imsg *imsg)
+{
+	static struct proxy_metrics	 t;
+	static int			 header;
+	struct proxy_metrics		 pm;
+	uint64_t			 count;
+	int				 i, b;
+
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_STATS:
+		if (IMSG_DATA_SIZE(imsg) != sizeof(pm))
+			errx(1, "wrong message size");
+		memcpy(&pm, imsg->data, sizeof(pm));
+
+		if (!header) {
+			printf("%-6s %7s %5s %10s %10s %8s %8s %8s %8s"
+			    " %8s\n", "proxy", "clients", "fcgi", "accepts",
+			    "requests", "2xx", "3xx", "4xx", "5xx", "304");
+			header = 1;
+		}
+		printf("%-6d %7d %5d %10"PRIu64" %10"PRIu64" %8"PRIu64
+		    " %8"PRIu64" %8"PRIu64" %8"PRIu64" %8"PRIu64"\n",
+		    pm.instance + 1, pm.clients, pm.fcgi_conns,
+		    pm.accepts, pm.requests, pm.status[1], pm.status[2], pm.status[3],
+		    pm.status[4], pm.not_modified);
+
+		t.clients += pm.clients;
+		t.fcgi_conns += pm.fcgi_conns;
+		t.accepts += pm.accepts;
+		t.requests += pm.requests;
+		t.bytes_in += pm.bytes_in;
+		t.bytes_out += pm.bytes_out;
+		for (i = 0; i < (int)nitems(t.status); ++i)
+			t.status[i] += pm.status[i];
+		t.not_modified += pm.not_modified;
+		t.dns_errors += pm.dns_errors;
+		t.connect_errors += pm.connect_errors;
+		t.tls_errors += pm.tls_errors;
+		t.fcgi_request_timeouts += pm.fcgi_request_timeouts;
+		t.fcgi_idle_timeouts += pm.fcgi_idle_timeouts;
+		for (i = 0; i < LAT_MAX; ++i)
+			for (b = 0; b < LAT_BUCKETS; ++b)
+				t.lat[i][b] += pm.lat[i][b];
+		return (0);
+
+	case IMSG_CTL_END:
+		printf("%-6s %7d %5d %10"PRIu64" %10"PRIu64" %8"PRIu64
+		    " %8"PRIu64" %8"PRIu64" %8"PRIu64" %8"PRIu64"\n",
+		    "total", t.clients, t.fcgi_conns,
+		    t.accepts, t.requests, t.status[1], t.status[2], t.status[3],
+		    t.status[4], t.not_modified);
+
+		printf("\nupstream: %"PRIu64" bytes received, %"PRIu64
+		    " dns errors, %"PRIu64" connect errors, %"PRIu64
+		    " tls errors\n", t.bytes_in, t.dns_errors,
+		    t.connect_errors, t.tls_errors);
+		printf("fastcgi: %"PRIu64" bytes sent, %"PRIu64" request "
+		    "timeouts, %"PRIu64" idle timeouts\n\n", t.bytes_out,
+		    t.fcgi_request_timeouts, t.fcgi_idle_timeouts);
+
+		printf("%-10s %10s %9s %9s %9s\n", "phase", "requests",
+		    "p50", "p90", "p99");
+		for (i = 0; i < LAT_MAX; ++i) {
+			count = 0;
+			for (b = 0; b < LAT_BUCKETS; ++b)
+				count += t.lat[i][b];
+			printf("%-10s %10"PRIu64, lat_phases[i], count);
+			printf(" %9s", quantile(t.lat[i], count, .5));
+			printf(" %9s", quantile(t.lat[i], count, .9));
+			printf(" %9s\n", quantile(t.lat[i], count, .99));
+		}
+		return (1);
+
+	default:
+		errx(1, "unexpected message %d", imsg->hdr.type);
+	}
+}
+
+static int
+show_clients(struct imsg *imsg)
+{
+	static int		 header;
+	struct ctl_client	 cc;
+
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_CLIENT:
+		if (IMSG_DATA_SIZE(imsg) != sizeof(cc))
+			errx(1, "wrong message size");
+		memcpy(&cc, imsg->data, sizeof(cc));
+		cc.host[sizeof(cc.host) - 1] = '\0';
+		cc.path[sizeof(cc.path) - 1] = '\0';
+
+		if (!header) {
+			printf("%-6s %-12s %9s %-8s %6s %s\n", "proxy",
+			    "request", "age", "phase", "status", "url");
+			header = 1;
+		}
+		printf("%-6d %5u:%-6u %7"PRIu64"ms %-8s %6d %s%s\n",
+		    cc.instance + 1, cc.fcgi_id, cc.id, cc.age, phase(&cc),
+		    cc.status, cc.host, cc.path);
+		return (0);
+
+	case IMSG_CTL_FAIL:
+		warnx("a request is already in progress");
+		ret = 1;
+		return (1);
+
+	case IMSG_CTL_END:
+		if (!header)
+			printf("no clients in flight\n");
+		return (1);
+
+	default:
+		errx(1, "unexpected message %d", imsg->hdr.type);
+	}
+}
+
+static int
+show_result(struct imsg *imsg)
+{
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_OK:
+		return (1);
+	case IMSG_CTL_FAIL:
+		warnx("command failed");
+		ret = 1;
+		return (1);
+	default:
+		errx(1, "unexpected message %d", imsg->hdr.type);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_un	 sun;
+	struct imsgbuf		 ibuf;
+	struct imsg		 imsg;
+	const char		*sock = GALILEO_CONTROL;
+	ssize_t			 n;
+	int			 ch, fd, action, verbose, done = 0;
+
+	while ((ch = getopt(argc, argv, "s:")) != -1) {
+		switch (ch) {
+		case 's':
+			sock = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if ((action = parse(argc, argv)) == NONE)
+		usage();
+
+	if (pledge("stdio unix", NULL) == -1)
+		err(1, "pledge");
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		err(1, "socket");
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, sock, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		errx(1, "socket path too long: %s", sock);
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "connect: %s", sock);
+
+	if (pledge("stdio", NULL) == -1)
+		err(1, "pledge");
+
+	imsg_init(&ibuf, fd);
+
+	switch (action) {
+	case DRAIN:
+		imsg_compose(&ibuf, IMSG_CTL_DRAIN, 0, 0, -1, NULL, 0);
+		break;
+	case LOG_BRIEF:
+	case LOG_VERBOSE:
+		verbose = action == LOG_VERBOSE;
+		imsg_compose(&ibuf, IMSG_CTL_VERBOSE, 0, 0, -1, &verbose,
+		    sizeof(verbose));
+		break;
+	case RELOAD:
+		imsg_compose(&ibuf, IMSG_CTL_RELOAD, 0, 0, -1, NULL, 0);
+		break;
+	case SHOW_CLIENTS:
+		imsg_compose(&ibuf, IMSG_CTL_SHOW_CLIENTS, 0, 0, -1, NULL, 0);
+		break;
+	case SHOW_STATS:
+		imsg_compose(&ibuf, IMSG_CTL_SHOW_STATS, 0, 0, -1, NULL, 0);
+		break;
+	}
+
+	while (ibuf.w.queued)
+		if (msgbuf_write(&ibuf.w) <= 0 && errno != EAGAIN)
+			err(1, "write error");
+
+	while (!done) {
+		if ((n = imsg_read(&ibuf)) == -1 && errno != EAGAIN)
+			err(1, "read error");
+		if (n == 0)
+			errx(1, "pipe closed");
+
+		while (!done) {
+			if ((n = imsg_get(&ibuf, &imsg)) == -1)
+				errx(1, "imsg_get error");
+			if (n == 0)
+				break;
+
+			switch (action) {
+			case SHOW_CLIENTS:
+				done = show_clients(&imsg);
+				break;
+			case SHOW_STATS:
+				done = show_stats(&imsg);
+				break;
+			default:
+				done = show_result(&imsg);
+				break;
+			}
+			imsg_free(&imsg);
+		}
+	}
+
+	close(fd);
+	return (ret);
+}
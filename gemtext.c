@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <ctype.h>
+#include <event.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "config.h"
+#include "log.h"
+#include "tmpl.h"
+
+#include "galileo.h"
+
+static int
+portok(const char **url, struct client *clt)
+{
+	const char		*u = *url;
+	const char		*port = clt->clt_pc->proxy_port;
+	size_t			 len;
+
+	len = strlen(port);
+
+	if (*u == '\0' || *u == '/' || *u == '?' || *u == '#')
+		return (1);
+	if (*u != ':')
+		return (0);
+	u++;
+	if (strncmp(u, port, len) != 0)
+		return (0);
+	u += len;
+	if (*u != '\0' && *u != '/' && *u != '?' && *u != '#')
+		return (0);
+	*url = u;
+	return (1);
+}
+
+int
+proxy_resurl(struct client *clt, const char *url, char *buf, size_t len)
+{
+	const char		*tmp;
+	size_t			 l;
+
+	if (clt->clt_server_name == NULL)
+		return (-1);
+
+	l = strlen(clt->clt_server_name);
+
+	if (len == 0) {
+		log_warn("%s: zero-sized buffer!", __func__);
+		return (-1);
+	}
+
+	/* look if it's an absolute URI */
+	if (strncmp(url, "//", 2) == 0) {
+		tmp = url + 2;
+		if (strncmp(tmp, clt->clt_server_name, l) != 0)
+			goto done;
+
+		tmp += l;
+		if (!portok(&tmp, clt))
+			goto done;
+		url = tmp;
+	} else if (strncmp(url, "gemini://", 9) == 0) {
+		tmp = url + 9;
+		if (strncmp(tmp, clt->clt_server_name, l) != 0)
+			goto done;
+
+		tmp += l;
+		if (!portok(&tmp, clt))
+			goto done;
+		url = tmp;
+	} else {
+		tmp = url;
+		while (isalpha((unsigned char)*tmp) || *tmp == '+')
+			tmp++;
+		if (strncmp(tmp, "://", 3) == 0)
+			goto done;
+	}
+
+	/* maybe it's an absolute path? */
+	if (*url == '\0' || *url == '/') {
+		if (strlcpy(buf, clt->clt_script_name, len) >= len)
+			return (-1);
+		if (strlcat(buf, url + 1, len) >= len)
+			return (-1);
+		return (0);
+	}
+
+	/* otherwise, leave it as it is */
+ done:
+	if (strlcpy(buf, url, len) >= len)
+		return (-1);
+	return (0);
+}
+
+static const char *default_imgexts[] = {
+	"gif", "jpeg", "jpg", "png", "svg", "webp",
+};
+
+static inline int
+match_image_heur(struct proxy_config *pc, const char *url)
+{
+	const char	*ext;
+	size_t		 len;
+	int		 i;
+
+	if ((ext = strrchr(url, '.')) == NULL)
+		return (0);
+	ext++;
+
+	len = strlen(ext);
+	if (len == 0 || len >= PROXY_IMGEXT_LEN)
+		return (0);
+
+	if (pc->nimgexts == 0) {
+		for (i = 0; i < (int)nitems(default_imgexts); ++i)
+			if (!strcasecmp(ext, default_imgexts[i]))
+				return (1);
+		return (0);
+	}
+
+	for (i = 0; i < pc->nimgexts; ++i)
+		if (!strcasecmp(ext, pc->imgexts[i]))
+			return (1);
+	return (0);
+}
+
+static int
+gemtext_translate_line(struct client *clt, char *line)
+{
+	struct template	*tp = clt->clt_tp;
+	char		 buf[1025];
+	char		*url;
+
+	/* preformatted line / closing */
+	if (clt->clt_translate & TR_PRE) {
+		if (!strncmp(line, "```", 3)) {
+			clt->clt_translate &= ~TR_PRE;
+			return (tp_pre_close(clt->clt_tp));
+		}
+
+		if (tp_htmlescape(clt->clt_tp, line) == -1)
+			return (-1);
+		return (tp_write(tp, "\n", 1));
+	}
+
+	/* bullet */
+	if (!strncmp(line, "* ", 2)) {
+		if (clt->clt_translate & TR_NAV) {
+			if (tp_writes(tp, "</ul></nav>") == -1)
+				return (-1);
+			clt->clt_translate &= ~TR_NAV;
+		}
+
+		if (!(clt->clt_translate & TR_LIST)) {
+			if (tp_writes(tp, "<ul>") == -1)
+				return (-1);
+			clt->clt_translate |= TR_LIST;
+		}
+
+		if (tp_writes(tp, "<li>") == -1 ||
+		    tp_htmlescape(clt->clt_tp, line + 2) == -1 ||
+		    tp_writes(tp, "</li>") == -1)
+			return (-1);
+		return (0);
+	}
+
+	if (clt->clt_translate & TR_LIST) {
+		if (tp_writes(tp, "</ul>") == -1)
+			return (-1);
+		clt->clt_translate &= ~TR_LIST;
+	}
+
+	/* link */
+	if (!strncmp(line, "=>", 2)) {
+		char *label;
+
+		line += 2;
+		line += strspn(line, " \t");
+
+		label = line + strcspn(line, " \t");
+		if (*label == '\0')
+			label = line;
+		else {
+			*label++ = '\0';
+			label += strspn(label, " \t");
+			if (*label == '\0')
+				label = line;
+		}
+
+		if (proxy_resurl(clt, line, buf, sizeof(buf)) == 0)
+			url = buf;
+		else
+			url = line; /* leave the URL as it is */
+
+		if (!(clt->clt_pc->flags & PROXY_NO_IMGPRV) &&
+		    match_image_heur(clt->clt_pc, url)) {
+			if (clt->clt_translate & TR_NAV) {
+				if (tp_writes(tp, "</ul></nav>") == -1)
+					return (-1);
+				clt->clt_translate &= ~TR_NAV;
+			}
+
+			if (tp_figure(tp, url, label) == -1)
+				return (-1);
+
+			return (0);
+		}
+
+		if (!(clt->clt_translate & TR_NAV)) {
+			if (tp_writes(tp, "<nav><ul>") == -1)
+				return (-1);
+			clt->clt_translate |= TR_NAV;
+		}
+
+		if (tp_writes(tp, "<li><a href='") == -1)
+			return (-1);
+
+		if (tp_urlescape(clt->clt_tp, url) == -1 ||
+		    tp_writes(tp, "'>") == -1 ||
+		    tp_htmlescape(clt->clt_tp, label) == -1 ||
+		    tp_writes(tp, "</a></li>") == -1)
+			return (-1);
+
+		return (0);
+	}
+
+	if (clt->clt_translate & TR_NAV) {
+		if (tp_writes(tp, "</ul></nav>") == -1)
+			return (-1);
+		clt->clt_translate &= ~TR_NAV;
+	}
+
+	/* pre opening */
+	if (!strncmp(line, "```", 3)) {
+		line += 3;
+		line += strspn(line, " \t");
+
+		clt->clt_translate |= TR_PRE;
+		return (tp_pre_open(tp, line));
+	}
+
+	/* citation block */
+	if (*line == '>') {
+		if (tp_writes(tp, "<blockquote>") == -1 ||
+		    tp_htmlescape(clt->clt_tp, line + 1) == -1 ||
+		    tp_writes(tp, "</blockquote>") == -1)
+			return (-1);
+		return (0);
+	}
+
+	/* headings */
+	if (!strncmp(line, "###", 3)) {
+		if (tp_writes(tp, "<h3>") == -1 ||
+		    tp_htmlescape(clt->clt_tp, line + 3) == -1 ||
+		    tp_writes(tp, "</h3>") == -1)
+			return (-1);
+		return (0);
+	}
+	if (!strncmp(line, "##", 2)) {
+		if (tp_writes(tp, "<h2>") == -1 ||
+		    tp_htmlescape(clt->clt_tp, line + 2) == -1 ||
+		    tp_writes(tp, "</h2>") == -1)
+			return (-1);
+		return (0);
+	}
+	if (!strncmp(line, "#", 1)) {
+		if (tp_writes(tp, "<h1>") == -1 ||
+		    tp_htmlescape(clt->clt_tp, line + 1) == -1 ||
+		    tp_writes(tp, "</h1>") == -1)
+			return (-1);
+		return (0);
+	}
+
+	/* Not following strictly the gemini specification... */
+	if (*line == '\0')
+		return (0);
+
+	/* paragraph */
+	if (tp_writes(tp, "<p>") == -1 ||
+	    tp_htmlescape(clt->clt_tp, line) == -1 ||
+	    tp_writes(tp, "</p>") == -1)
+		return (-1);
+
+	return (0);
+}
+
+int
+gemtext_translate(struct client *clt)
+{
+	struct bufferevent	*bev = clt->clt_bev;
+	struct evbuffer		*src = EVBUFFER_INPUT(bev);
+	char			*line;
+	size_t			 len;
+	int			 r;
+
+	for (;;) {
+		line = evbuffer_readln(src, &len, EVBUFFER_EOL_CRLF);
+		if (line == NULL)
+			return (0);
+
+		r = gemtext_translate_line(clt, line);
+		free(line);
+		if (r == -1)
+			return (-1);
+	}
+}
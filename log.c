@@ -16,20 +16,50 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/time.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <syslog.h>
 #include <errno.h>
+#include <event.h>
 #include <time.h>
 
 #include "log.h"
 
+#define LOG_RING_SIZE	128		/* messages */
+#define LOG_MSG_SIZE	1024
+#define LOG_FLUSH_USEC	100000
+#define LOG_RATE_BURST	10		/* messages per interval */
+#define LOG_RATE_INTERVAL 10		/* seconds */
+
 static int		 debug;
 static int		 verbose;
 static const char	*log_procname;
 
+/*
+ * With log_async the messages are queued here and written out by a
+ * timer, so that the callers never wait on syslogd or the terminal.
+ */
+static struct {
+	int		 enabled;
+	struct event	 ev;
+	size_t		 head;
+	size_t		 count;
+	size_t		 dropped;
+	struct {
+		int	 pri;
+		char	 msg[LOG_MSG_SIZE];
+	}		 msgs[LOG_RING_SIZE];
+} ring;
+
+static void	log_write(int, const char *);
+static void	log_flush(void);
+static void	log_flush_cb(int, short, void *);
+
 void
 log_init(int n_debug, int facility)
 {
@@ -62,6 +92,55 @@ log_getverbose(void)
 	return (verbose);
 }
 
+/*
+ * Queue the messages from now on; needs the event loop to be set up.
+ * What is still queued is written out at exit or before a message of
+ * priority LOG_CRIT or higher, like the fatal ones.
+ */
+void
+log_async(void)
+{
+	if (ring.enabled)
+		return;
+
+	evtimer_set(&ring.ev, log_flush_cb, NULL);
+	atexit(log_flush);
+	ring.enabled = 1;
+}
+
+/*
+ * Allow LOG_RATE_BURST messages every LOG_RATE_INTERVAL seconds
+ * through and count the others; how many were suppressed is logged
+ * with the first one of the next interval.  Only the format is used
+ * to tell which message it was.
+ */
+int
+log_ratelimit(struct log_rate *r, const char *fmt)
+{
+	struct timespec	 ts;
+	int		 saved_errno = errno;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		ts.tv_sec = time(NULL);
+
+	if (ts.tv_sec - r->start >= LOG_RATE_INTERVAL) {
+		if (r->suppressed != 0)
+			logit(LOG_WARNING, "%u messages like \"%s\" suppressed",
+			    r->suppressed, fmt);
+		r->start = ts.tv_sec;
+		r->count = 0;
+		r->suppressed = 0;
+	}
+
+	errno = saved_errno;
+	if (r->count < LOG_RATE_BURST) {
+		r->count++;
+		return (1);
+	}
+	r->suppressed++;
+	return (0);
+}
+
 void
 logit(int pri, const char *fmt, ...)
 {
@@ -75,8 +154,31 @@ logit(int pri, const char *fmt, ...)
 void
 vlog(int pri, const char *fmt, va_list ap)
 {
-	char	*nfmt;
-	int	 saved_errno = errno;
+	struct timeval	 tv = { 0, LOG_FLUSH_USEC };
+	char		*nfmt;
+	size_t		 i;
+	int		 saved_errno = errno;
+
+	if (ring.enabled && pri > LOG_CRIT) {
+		if (ring.count == LOG_RING_SIZE) {
+			ring.dropped++;
+			errno = saved_errno;
+			return;
+		}
+
+		i = (ring.head + ring.count++) % LOG_RING_SIZE;
+		ring.msgs[i].pri = pri;
+		(void)vsnprintf(ring.msgs[i].msg, sizeof(ring.msgs[i].msg),
+		    fmt, ap);
+		if (!evtimer_pending(&ring.ev, NULL))
+			evtimer_add(&ring.ev, &tv);
+
+		errno = saved_errno;
+		return;
+	}
+
+	if (ring.enabled)
+		log_flush();
 
 	if (debug) {
 		/* best effort in out of mem situations */
@@ -94,6 +196,44 @@ vlog(int pri, const char *fmt, va_list ap)
 	errno = saved_errno;
 }
 
+static void
+log_write(int pri, const char *msg)
+{
+	if (debug)
+		fprintf(stderr, "%s\n", msg);
+	else
+		syslog(pri, "%s", msg);
+}
+
+static void
+log_flush(void)
+{
+	char	 msg[64];
+	int	 saved_errno = errno;
+
+	for (; ring.count > 0; ring.count--) {
+		log_write(ring.msgs[ring.head].pri, ring.msgs[ring.head].msg);
+		ring.head = (ring.head + 1) % LOG_RING_SIZE;
+	}
+
+	if (ring.dropped != 0) {
+		(void)snprintf(msg, sizeof(msg), "%zu log messages dropped",
+		    ring.dropped);
+		log_write(LOG_WARNING, msg);
+		ring.dropped = 0;
+	}
+
+	if (debug)
+		fflush(stderr);
+	errno = saved_errno;
+}
+
+static void
+log_flush_cb(int fd, short event, void *arg)
+{
+	log_flush();
+}
+
 void
 log_warn(const char *emsg, ...)
 {
@@ -20,11 +20,43 @@
 #define LOG_H
 
 #include <stdarg.h>
+#include <time.h>
+
+/* state of a rate-limited message, see log_ratelimit */
+struct log_rate {
+	time_t		 start;
+	unsigned int	 count;
+	unsigned int	 suppressed;
+};
+
+/* log_debug, without evaluating the arguments unless verbose */
+#define log_debugv(...) do {						\
+	if (log_getverbose())						\
+		log_debug(__VA_ARGS__);					\
+} while (0)
+
+/* log_warn and log_warnx, rate-limited per call site */
+#define log_warn_limit(...) do {					\
+	static struct log_rate	 _lr;					\
+	if (log_ratelimit(&_lr, LOG_FMT(__VA_ARGS__, 0)))		\
+		log_warn(__VA_ARGS__);					\
+} while (0)
+
+#define log_warnx_limit(...) do {					\
+	static struct log_rate	 _lr;					\
+	if (log_ratelimit(&_lr, LOG_FMT(__VA_ARGS__, 0)))		\
+		log_warnx(__VA_ARGS__);					\
+} while (0)
+
+/* the format string of the arguments of a log function */
+#define LOG_FMT(fmt, ...)	(fmt)
 
 void	log_init(int, int);
 void	log_procinit(const char *);
 void	log_setverbose(int);
 int	log_getverbose(void);
+void	log_async(void);
+int	log_ratelimit(struct log_rate *, const char *);
 void	log_warn(const char *, ...)
 	    __attribute__((__format__ (printf, 1, 2)));
 void	log_warnx(const char *, ...)
@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2025 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/tree.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <event.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <imsg.h>
+
+#include "config.h"
+#include "log.h"
+#include "proc.h"
+
+#include "galileo.h"
+
+#define METRICS_TIMEOUT		10	/* seconds */
+
+static void	metrics_accept(int, short, void *);
+static void	metrics_write(struct bufferevent *, void *);
+static void	metrics_error(struct bufferevent *, short, void *);
+
+static struct {
+	char		 path[PATH_MAX];
+	int		 fd;
+	struct event	 ev;
+} metrics_sock = { "", -1 };
+
+static const char *lat_phases[LAT_MAX] = {
+	"dns",
+	"connect",
+	"tls",
+	"ttfb",
+	"headers",
+	"body",
+	"translate",
+	"write",
+	"total",
+};
+
+/*
+ * Open the UNIX socket the counters are served on, or move it if the
+ * path changed with a reload.  Every connection gets the counters in
+ * the Prometheus text format and is closed.
+ */
+int
+metrics_listen(struct galileo *env)
+{
+	struct sockaddr_un	 sun;
+	const char		*path = env->sc_metrics_sock;
+	int			 fd, old_umask;
+
+	if (!strcmp(metrics_sock.path, path))
+		return (0);
+
+	metrics_close();
+	if (*path == '\0')
+		return (0);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		log_warnx("%s: socket path too long: %s", __func__, path);
+		return (-1);
+	}
+
+	if ((fd = socket(AF_UNIX,
+	    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		log_warn("%s: socket", __func__);
+		return (-1);
+	}
+
+	if (unlink(path) == -1)
+		if (errno != ENOENT) {
+			log_warn("%s: unlink %s", __func__, path);
+			close(fd);
+			return (-1);
+		}
+
+	old_umask = umask(S_IXUSR|S_IXGRP|S_IWOTH|S_IROTH|S_IXOTH);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		log_warn("%s: bind: %s", __func__, path);
+		close(fd);
+		umask(old_umask);
+		return (-1);
+	}
+	umask(old_umask);
+
+	if (chmod(path, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) == -1) {
+		log_warn("%s: chmod", __func__);
+		close(fd);
+		(void)unlink(path);
+		return (-1);
+	}
+
+	if (listen(fd, LISTEN_BACKLOG) == -1) {
+		log_warn("%s: listen", __func__);
+		close(fd);
+		(void)unlink(path);
+		return (-1);
+	}
+
+	(void)strlcpy(metrics_sock.path, path, sizeof(metrics_sock.path));
+	metrics_sock.fd = fd;
+	event_set(&metrics_sock.ev, fd, EV_READ|EV_PERSIST, metrics_accept,
+	    env);
+	event_add(&metrics_sock.ev, NULL);
+
+	return (0);
+}
+
+void
+metrics_close(void)
+{
+	if (metrics_sock.fd == -1)
+		return;
+
+	event_del(&metrics_sock.ev);
+	close(metrics_sock.fd);
+	(void)unlink(metrics_sock.path);
+	metrics_sock.fd = -1;
+	*metrics_sock.path = '\0';
+}
+
+static void
+metrics_accept(int fd, short event, void *arg)
+{
+	struct galileo		*env = arg;
+	struct bufferevent	*bev;
+	int			 s;
+
+	if ((s = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) == -1) {
+		if (errno != EINTR && errno != EWOULDBLOCK &&
+		    errno != ECONNABORTED)
+			log_warn("%s: accept", __func__);
+		return;
+	}
+
+	bev = bufferevent_new(s, NULL, metrics_write, metrics_error, NULL);
+	if (bev == NULL) {
+		log_warn("%s: bufferevent_new", __func__);
+		close(s);
+		return;
+	}
+
+	if (metrics_print(env, EVBUFFER_OUTPUT(bev)) == -1) {
+		log_warn("%s: metrics_print", __func__);
+		metrics_error(bev, EVBUFFER_ERROR, NULL);
+		return;
+	}
+
+	bufferevent_settimeout(bev, 0, METRICS_TIMEOUT);
+	bufferevent_enable(bev, EV_WRITE);
+}
+
+/* all written out */
+static void
+metrics_write(struct bufferevent *bev, void *arg)
+{
+	metrics_error(bev, EVBUFFER_EOF, arg);
+}
+
+static void
+metrics_error(struct bufferevent *bev, short error, void *arg)
+{
+	int	 fd = EVENT_FD(&bev->ev_write);
+
+	bufferevent_free(bev);
+	close(fd);
+}
+
+static void
+metrics_add(struct proxy_metrics *dst, const struct proxy_metrics *src)
+{
+	int	 i, b;
+
+	dst->requests += src->requests;
+	dst->accepts += src->accepts;
+	dst->bytes_in += src->bytes_in;
+	dst->bytes_out += src->bytes_out;
+	for (i = 0; i < (int)nitems(dst->status); ++i)
+		dst->status[i] += src->status[i];
+	dst->not_modified += src->not_modified;
+	dst->dns_errors += src->dns_errors;
+	dst->connect_errors += src->connect_errors;
+	dst->tls_errors += src->tls_errors;
+	dst->fcgi_request_timeouts += src->fcgi_request_timeouts;
+	dst->fcgi_idle_timeouts += src->fcgi_idle_timeouts;
+	for (i = 0; i < LAT_MAX; ++i) {
+		dst->lat_sum[i] += src->lat_sum[i];
+		for (b = 0; b < LAT_BUCKETS; ++b)
+			dst->lat[i][b] += src->lat[i][b];
+	}
+}
+
+/*
+ * Add up the counters sent by a proxy.  The gauges are only taken
+ * from the one currently running in the slot, not from a retired one.
+ */
+void
+metrics_update(struct galileo *env, struct imsg *imsg, int current)
+{
+	struct proxy_metrics	 pm, *m;
+
+	if (IMSG_DATA_SIZE(imsg) != sizeof(pm))
+		fatalx("%s: bad imsg size", __func__);
+	memcpy(&pm, imsg->data, sizeof(pm));
+
+	if (pm.instance < 0 || pm.instance >= PROC_MAX_INSTANCES) {
+		log_warnx("%s: invalid proxy instance %d", __func__,
+		    pm.instance);
+		return;
+	}
+
+	m = &env->sc_metrics[pm.instance];
+	m->instance = pm.instance;
+	if (current) {
+		m->clients = pm.clients;
+		m->fcgi_conns = pm.fcgi_conns;
+	}
+	metrics_add(m, &pm);
+}
+
+static int
+metrics_head(struct evbuffer *buf, const char *name, const char *type,
+    const char *help)
+{
+	return (evbuffer_add_printf(buf, "# HELP %s %s\n# TYPE %s %s\n",
+	    name, help, name, type));
+}
+
+/*
+ * Write the counters of all the proxies in the Prometheus text
+ * exposition format.
+ */
+int
+metrics_print(struct galileo *env, struct evbuffer *buf)
+{
+	struct proxy_metrics	 t, *m;
+	uint64_t		 count;
+	int			 n, nproc, i, b;
+
+	memset(&t, 0, sizeof(t));
+	nproc = env->sc_ps->ps_instances[PROC_PROXY];
+	for (n = 0; n < nproc; ++n) {
+		m = &env->sc_metrics[n];
+		t.clients += m->clients;
+		t.fcgi_conns += m->fcgi_conns;
+		metrics_add(&t, m);
+	}
+
+	if (metrics_head(buf, "galileo_requests_total", "counter",
+	    "Requests served.") == -1 ||
+	    evbuffer_add_printf(buf, "galileo_requests_total %"PRIu64"\n",
+	    t.requests) == -1)
+		return (-1);
+
+	if (metrics_head(buf, "galileo_responses_total", "counter",
+	    "Responses by HTTP status class.") == -1)
+		return (-1);
+	for (i = 0; i < (int)nitems(t.status); ++i)
+		if (evbuffer_add_printf(buf,
+		    "galileo_responses_total{code=\"%dxx\"} %"PRIu64"\n",
+		    i + 1, t.status[i]) == -1)
+			return (-1);
+
+	if (metrics_head(buf, "galileo_not_modified_total", "counter",
+	    "Requests answered with 304 Not Modified.") == -1 ||
+	    evbuffer_add_printf(buf, "galileo_not_modified_total %"PRIu64"\n",
+	    t.not_modified) == -1)
+		return (-1);
+
+	if (metrics_head(buf, "galileo_upstream_bytes_total", "counter",
+	    "Bytes received from the Gemini servers.") == -1 ||
+	    evbuffer_add_printf(buf, "galileo_upstream_bytes_total "
+	    "%"PRIu64"\n", t.bytes_in) == -1)
+		return (-1);
+
+	if (metrics_head(buf, "galileo_fastcgi_connections_total", "counter",
+	    "FastCGI connections accepted.") == -1 ||
+	    evbuffer_add_printf(buf, "galileo_fastcgi_connections_total "
+	    "%"PRIu64"\n", t.accepts) == -1)
+		return (-1);
+
+	if (metrics_head(buf, "galileo_fastcgi_bytes_total", "counter",
+	    "Bytes of FastCGI output.") == -1 ||
+	    evbuffer_add_printf(buf, "galileo_fastcgi_bytes_total "
+	    "%"PRIu64"\n", t.bytes_out) == -1)
+		return (-1);
+
+	if (metrics_head(buf, "galileo_upstream_errors_total", "counter",
+	    "Failures reaching the Gemini servers.") == -1 ||
+	    evbuffer_add_printf(buf,
+	    "galileo_upstream_errors_total{error=\"dns\"} %"PRIu64"\n"
+	    "galileo_upstream_errors_total{error=\"connect\"} %"PRIu64"\n"
+	    "galileo_upstream_errors_total{error=\"tls\"} %"PRIu64"\n",
+	    t.dns_errors, t.connect_errors, t.tls_errors) == -1)
+		return (-1);
+
+	if (metrics_head(buf, "galileo_fastcgi_timeouts_total", "counter",
+	    "FastCGI connections closed by a timeout.") == -1 ||
+	    evbuffer_add_printf(buf,
+	    "galileo_fastcgi_timeouts_total{timeout=\"request\"} %"PRIu64"\n"
+	    "galileo_fastcgi_timeouts_total{timeout=\"idle\"} %"PRIu64"\n",
+	    t.fcgi_request_timeouts, t.fcgi_idle_timeouts) == -1)
+		return (-1);
+
+	if (metrics_head(buf, "galileo_clients", "gauge",
+	    "Requests in progress.") == -1 ||
+	    evbuffer_add_printf(buf, "galileo_clients %d\n",
+	    t.clients) == -1)
+		return (-1);
+
+	if (metrics_head(buf, "galileo_fastcgi_connections", "gauge",
+	    "Open FastCGI connections.") == -1 ||
+	    evbuffer_add_printf(buf, "galileo_fastcgi_connections %d\n",
+	    t.fcgi_conns) == -1)
+		return (-1);
+
+	/* the last bucket has no upper bound */
+	if (metrics_head(buf, "galileo_request_phase_seconds", "histogram",
+	    "Time spent in each phase of the requests.") == -1)
+		return (-1);
+	for (i = 0; i < LAT_MAX; ++i) {
+		count = 0;
+		for (b = 0; b < LAT_BUCKETS - 1; ++b) {
+			count += t.lat[i][b];
+			if (evbuffer_add_printf(buf,
+			    "galileo_request_phase_seconds_bucket"
+			    "{phase=\"%s\",le=\"%g\"} %"PRIu64"\n",
+			    lat_phases[i], (1 << b) / 1000.0, count) == -1)
+				return (-1);
+		}
+		count += t.lat[i][b];
+		if (evbuffer_add_printf(buf,
+		    "galileo_request_phase_seconds_bucket"
+		    "{phase=\"%s\",le=\"+Inf\"} %"PRIu64"\n"
+		    "galileo_request_phase_seconds_sum{phase=\"%s\"} %.6f\n"
+		    "galileo_request_phase_seconds_count{phase=\"%s\"} "
+		    "%"PRIu64"\n",
+		    lat_phases[i], count, lat_phases[i],
+		    t.lat_sum[i] / 1000000.0, lat_phases[i], count) == -1)
+			return (-1);
+	}
+
+	return (0);
+}
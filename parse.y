@@ -24,8 +24,10 @@
 %{
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/socket.h>
 #include <sys/tree.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 
 #include <err.h>
 #include <event.h>
@@ -44,6 +46,7 @@
 #include <pwd.h>
 #include <imsg.h>
 
+#include "config.h"
 #include "log.h"
 #include "proc.h"
 
@@ -87,9 +90,13 @@ int		 symset(const char *, const char *, int);
 char		*symget(const char *);
 
 int		 getservice(const char *);
+int		 listen_unix(const char *);
+int		 listen_inet(const char *, int);
 
 static struct galileo	*conf = NULL;
 static struct proxy	*pr = NULL;
+static struct listener	 lopts;
+static int		 cachemask;
 static int		 errors;
 
 typedef struct {
@@ -103,11 +110,15 @@ typedef struct {
 %}
 
 %token	INCLUDE ERROR
-%token	BAR CHROOT FOOTER HOSTNAME IMAGE NAVIGATION NO PORT
-%token	PREFORK PREVIEW PROXY SOURCE STYLESHEET TLS
+%token	ACCEPT ACCESS AFFINITY AGE AUTO BACKLOG BAR BATCH BYTE CACHE CHROOT
+%token	COMPRESSION CONNECT CPU DRAIN ETAG EXTENSIONS FASTCGI FIRST FOOTER
+%token	HOSTNAME IDLE IMAGE LEVEL LISTEN LOG MAX MEDIA METRICS MIN NAVIGATION
+%token	NO ON PAGES PORT PREFORK PREVIEW PRIVATE PROXY PUBLIC REQUEST REQUESTS
+%token	RESPONSE REUSEPORT REVALIDATE SIZE SLOW SOCKET SOURCE STALE
+%token	STYLESHEET SYSLOG TIMEOUT TLS TOTAL WHILE
 %token	<v.number>	NUMBER
 %token	<v.string>	STRING
-%type	<v.number>	port
+%type	<v.number>	cachetarget port
 %type	<v.string>	string
 
 %%
@@ -161,6 +172,84 @@ main		: PREFORK NUMBER {
 				YYERROR;
 			}
 			conf->sc_prefork = $2;
+		} preforkmin
+		| CPU AFFINITY {
+#if !HAVE_SCHED_SETAFFINITY
+			yyerror("cpu affinity is not supported on this system");
+			YYERROR;
+#endif
+		} cpuaffinity
+		| DRAIN TIMEOUT NUMBER {
+			if ($3 < 0 || $3 > INT_MAX) {
+				yyerror("invalid drain timeout: %"PRId64, $3);
+				YYERROR;
+			}
+			conf->sc_conf.drain_timeout = $3;
+		}
+		| FASTCGI TIMEOUT REQUEST NUMBER {
+			if ($4 < 0 || $4 > INT_MAX) {
+				yyerror("invalid fastcgi request timeout: "
+				    "%"PRId64, $4);
+				YYERROR;
+			}
+			conf->sc_conf.fcgi_request_timeout = $4;
+		}
+		| FASTCGI TIMEOUT IDLE NUMBER {
+			if ($4 < 0 || $4 > INT_MAX) {
+				yyerror("invalid fastcgi idle timeout: "
+				    "%"PRId64, $4);
+				YYERROR;
+			}
+			conf->sc_conf.fcgi_idle_timeout = $4;
+		}
+		| LOG ACCESS STRING {
+			size_t n;
+
+			if (*$3 != '/') {
+				yyerror("access log path must be absolute: %s",
+				    $3);
+				free($3);
+				YYERROR;
+			}
+			n = strlcpy(conf->sc_accesslog, $3,
+			    sizeof(conf->sc_accesslog));
+			free($3);
+			if (n >= sizeof(conf->sc_accesslog)) {
+				yyerror("access log path too long");
+				YYERROR;
+			}
+			conf->sc_conf.access_log = ACCESSLOG_FILE;
+		}
+		| LOG ACCESS SYSLOG {
+			*conf->sc_accesslog = '\0';
+			conf->sc_conf.access_log = ACCESSLOG_SYSLOG;
+		}
+		| LOG SLOW REQUESTS NUMBER {
+			if ($4 < 0 || $4 > INT_MAX / 1000) {
+				yyerror("invalid slow request threshold: "
+				    "%"PRId64, $4);
+				YYERROR;
+			}
+			conf->sc_conf.slow_threshold = $4;
+		}
+		| MAX REQUESTS NUMBER {
+			if ($3 < 0 || $3 > INT_MAX) {
+				yyerror("invalid number of requests: %"PRId64,
+				    $3);
+				YYERROR;
+			}
+			conf->sc_conf.max_requests = $3;
+		}
+		| METRICS SOCKET STRING {
+			size_t n;
+
+			n = strlcpy(conf->sc_metrics_sock, $3,
+			    sizeof(conf->sc_metrics_sock));
+			free($3);
+			if (n >= sizeof(conf->sc_metrics_sock)) {
+				yyerror("metrics socket path too long");
+				YYERROR;
+			}
 		}
 		| CHROOT STRING {
 			size_t n;
@@ -171,31 +260,128 @@ main		: PREFORK NUMBER {
 				yyerror("chroot path too long!");
 			free($2);
 		}
+		| LISTEN ON SOCKET STRING {
+			memset(&lopts, 0, sizeof(lopts));
+			lopts.l_backlog = LISTEN_BACKLOG;
+			lopts.l_batch = ACCEPT_BATCH;
+		} listenopts_l {
+			if (lopts.l_flags & LISTEN_REUSEPORT) {
+				yyerror("reuseport is only valid for TCP "
+				    "sockets");
+				free($4);
+				YYERROR;
+			}
+			if (listen_unix($4) == -1) {
+				free($4);
+				YYERROR;
+			}
+			free($4);
+		}
+		| LISTEN ON STRING PORT port {
+			memset(&lopts, 0, sizeof(lopts));
+			lopts.l_backlog = LISTEN_BACKLOG;
+			lopts.l_batch = ACCEPT_BATCH;
+		} listenopts_l {
+			if (listen_inet($3, $5) == -1) {
+				free($3);
+				YYERROR;
+			}
+			free($3);
+		}
+		;
+
+cpuaffinity	: AUTO {
+			conf->sc_affinity = AFFINITY_AUTO;
+		}
+		| '{' optnl {
+			conf->sc_affinity = AFFINITY_LIST;
+			conf->sc_ncpus = 0;
+		} cpus_l '}'
+		;
+
+cpus_l		: cpus_l cpu optnl
+		| cpu optnl
+		;
+
+cpu		: NUMBER {
+			if ($1 < 0 || $1 >= 1024) {
+				yyerror("invalid cpu: %"PRId64, $1);
+				YYERROR;
+			}
+			if (conf->sc_ncpus == PROC_MAX_INSTANCES) {
+				yyerror("too many cpus, at most %d",
+				    PROC_MAX_INSTANCES);
+				YYERROR;
+			}
+			conf->sc_cpus[conf->sc_ncpus++] = $1;
+		}
+		;
+
+preforkmin	: /* empty */
+		| MIN NUMBER {
+			if ($2 <= 0 || $2 > conf->sc_prefork) {
+				yyerror("invalid minimum number of accepting "
+				    "proxies: %"PRId64, $2);
+				YYERROR;
+			}
+			conf->sc_prefork_min = $2;
+		}
+		;
+
+listenopts_l	: listenopts_l listenopts
+		| /* empty */
+		;
+
+listenopts	: ACCEPT BATCH NUMBER {
+			if ($3 <= 0 || $3 > INT_MAX) {
+				yyerror("invalid accept batch: %"PRId64, $3);
+				YYERROR;
+			}
+			lopts.l_batch = $3;
+		}
+		| BACKLOG NUMBER {
+			if ($2 <= 0 || $2 > INT_MAX) {
+				yyerror("invalid backlog: %"PRId64, $2);
+				YYERROR;
+			}
+			lopts.l_backlog = $2;
+		}
+		| REUSEPORT {
+#ifndef SO_REUSEPORT
+			yyerror("reuseport is not supported on this system");
+			YYERROR;
+#endif
+			lopts.l_flags |= LISTEN_REUSEPORT;
+		}
 		;
 
 proxy		: PROXY STRING {
 			struct proxy	*p;
-			size_t		 n;
-
-			if ((p = calloc(1, sizeof(*p))) == NULL)
-				fatal("calloc");
 
-			n = strlcpy(p->pr_conf.host, $2,
-			    sizeof(p->pr_conf.host));
-			if (n >= sizeof(p->pr_conf.host)) {
+			if (strlen($2) > HOST_NAME_MAX) {
 				yyerror("server name too long");
 				free($2);
-				free(p);
 				YYERROR;
 			}
+
+			if ((p = proxy_new()) == NULL)
+				fatal("calloc");
+			proxy_setstr(&p->pr_conf.host, $2);
 			free($2);
 
 			pr = p;
 		} '{' optnl proxyopts_l '}' {
+			struct proxy	*p;
+
 			/* check if duplicate */
-			if (proxy_match(conf, pr->pr_conf.host) != NULL)
-				yyerror("duplicate proxy `%s'",
-				    pr->pr_conf.host);
+			TAILQ_FOREACH(p, &conf->sc_proxies, pr_entry) {
+				if (!strcasecmp(p->pr_conf.host,
+				    pr->pr_conf.host)) {
+					yyerror("duplicate proxy `%s'",
+					    pr->pr_conf.host);
+					break;
+				}
+			}
 
 			TAILQ_INSERT_TAIL(&conf->sc_proxies, pr, pr_entry);
 
@@ -212,40 +398,87 @@ proxyopts_l	: proxyopts_l proxyoptsl nl
 		;
 
 proxyoptsl	: SOURCE STRING proxyport {
-			size_t n;
-
-			n = strlcpy(pr->pr_conf.proxy_addr, $2,
-			    sizeof(pr->pr_conf.proxy_addr));
-			if (n >= sizeof(pr->pr_conf.proxy_addr))
+			if (strlen($2) > HOST_NAME_MAX)
 				yyerror("proxy source too long!");
 
-			if (*pr->pr_conf.proxy_name == '\0') {
-				n = strlcpy(pr->pr_conf.proxy_name, $2,
-				    sizeof(pr->pr_conf.proxy_name));
-				if (n >= sizeof(pr->pr_conf.proxy_name))
-					yyerror("proxy hostname too long!");
-			}
+			proxy_setstr(&pr->pr_conf.proxy_addr, $2);
+			if (*pr->pr_conf.proxy_name == '\0')
+				proxy_setstr(&pr->pr_conf.proxy_name, $2);
 
 			free($2);
 		}
 		| HOSTNAME STRING {
-			size_t n;
-
-			n = strlcpy(pr->pr_conf.proxy_name, $2,
-			    sizeof(pr->pr_conf.proxy_name));
-			if (n >= sizeof(pr->pr_conf.proxy_name))
+			if (strlen($2) > HOST_NAME_MAX)
 				yyerror("proxy hostname too long!");
+			proxy_setstr(&pr->pr_conf.proxy_name, $2);
 			free($2);
 		}
 		| STYLESHEET string {
-			size_t n;
-
-			n = strlcpy(pr->pr_conf.stylesheet, $2,
-			    sizeof(pr->pr_conf.stylesheet));
-			if (n >= sizeof(pr->pr_conf.stylesheet))
+			if (strlen($2) >= PATH_MAX)
 				yyerror("stylesheet path too long!");
+			proxy_setstr(&pr->pr_conf.stylesheet, $2);
 			free($2);
 		}
+		| TIMEOUT CONNECT NUMBER {
+			if ($3 < 0 || $3 > INT_MAX) {
+				yyerror("invalid connect timeout: %"PRId64, $3);
+				YYERROR;
+			}
+			pr->pr_conf.timeout_connect = $3;
+		}
+		| TIMEOUT FIRST BYTE NUMBER {
+			if ($4 < 0 || $4 > INT_MAX) {
+				yyerror("invalid first byte timeout: %"PRId64,
+				    $4);
+				YYERROR;
+			}
+			pr->pr_conf.timeout_firstbyte = $4;
+		}
+		| TIMEOUT IDLE NUMBER {
+			if ($3 < 0 || $3 > INT_MAX) {
+				yyerror("invalid idle timeout: %"PRId64, $3);
+				YYERROR;
+			}
+			pr->pr_conf.timeout_idle = $3;
+		}
+		| TIMEOUT TOTAL NUMBER {
+			if ($3 < 0 || $3 > INT_MAX) {
+				yyerror("invalid total timeout: %"PRId64, $3);
+				YYERROR;
+			}
+			pr->pr_conf.timeout_total = $3;
+		}
+		| CACHE cachetarget {
+			cachemask = $2;
+			if (cachemask & CACHE_PAGES)
+				pr->pr_conf.cache_pages.cp_flags |= CACHE_SET;
+			if (cachemask & CACHE_MEDIA)
+				pr->pr_conf.cache_media.cp_flags |= CACHE_SET;
+		} cacheopts_l
+		| COMPRESSION {
+#if !HAVE_ZLIB
+			yyerror("compression is not supported: built "
+			    "without zlib");
+			YYERROR;
+#endif
+			pr->pr_conf.flags |= PROXY_COMPRESS;
+			pr->pr_conf.compress_level = COMPRESS_LEVEL;
+			pr->pr_conf.compress_minsize = COMPRESS_MINSIZE;
+		} compressopts_l
+		| ETAG {
+			pr->pr_conf.flags |= PROXY_ETAG;
+		}
+		| IMAGE EXTENSIONS '{' optnl {
+			pr->pr_conf.nimgexts = 0;
+		} imgexts_l '}'
+		| RESPONSE MAX SIZE NUMBER {
+			if ($4 < 0 || (uint64_t)$4 > SIZE_MAX) {
+				yyerror("invalid response max size: %"PRId64,
+				    $4);
+				YYERROR;
+			}
+			pr->pr_conf.max_response = $4;
+		}
 		| NO FOOTER {
 			pr->pr_conf.flags |= PROXY_NO_FOOTER;
 		}
@@ -260,19 +493,135 @@ proxyoptsl	: SOURCE STRING proxyport {
 		}
 		;
 
+cachetarget	: PAGES		{ $$ = CACHE_PAGES; }
+		| MEDIA		{ $$ = CACHE_MEDIA; }
+		| /* empty */	{ $$ = CACHE_PAGES|CACHE_MEDIA; }
+		;
+
+cacheopts_l	: cacheopts_l cacheopts
+		| cacheopts
+		;
+
+cacheopts	: MAX AGE NUMBER {
+			if ($3 < 0 || $3 > INT_MAX) {
+				yyerror("invalid cache max age: %"PRId64, $3);
+				YYERROR;
+			}
+			if (cachemask & CACHE_PAGES)
+				pr->pr_conf.cache_pages.cp_maxage = $3;
+			if (cachemask & CACHE_MEDIA)
+				pr->pr_conf.cache_media.cp_maxage = $3;
+		}
+		| STALE WHILE REVALIDATE NUMBER {
+			if ($4 < 0 || $4 > INT_MAX) {
+				yyerror("invalid cache stale while revalidate: "
+				    "%"PRId64, $4);
+				YYERROR;
+			}
+			if (cachemask & CACHE_PAGES)
+				pr->pr_conf.cache_pages.cp_swr = $4;
+			if (cachemask & CACHE_MEDIA)
+				pr->pr_conf.cache_media.cp_swr = $4;
+		}
+		| PUBLIC {
+			if (cachemask & CACHE_PAGES) {
+				pr->pr_conf.cache_pages.cp_flags &=
+				    ~CACHE_PRIVATE;
+				pr->pr_conf.cache_pages.cp_flags |=
+				    CACHE_PUBLIC;
+			}
+			if (cachemask & CACHE_MEDIA) {
+				pr->pr_conf.cache_media.cp_flags &=
+				    ~CACHE_PRIVATE;
+				pr->pr_conf.cache_media.cp_flags |=
+				    CACHE_PUBLIC;
+			}
+		}
+		| PRIVATE {
+			if (cachemask & CACHE_PAGES) {
+				pr->pr_conf.cache_pages.cp_flags &=
+				    ~CACHE_PUBLIC;
+				pr->pr_conf.cache_pages.cp_flags |=
+				    CACHE_PRIVATE;
+			}
+			if (cachemask & CACHE_MEDIA) {
+				pr->pr_conf.cache_media.cp_flags &=
+				    ~CACHE_PUBLIC;
+				pr->pr_conf.cache_media.cp_flags |=
+				    CACHE_PRIVATE;
+			}
+		}
+		;
+
+compressopts_l	: compressopts_l compressopts
+		| /* empty */
+		;
+
+compressopts	: LEVEL NUMBER {
+			if ($2 < 1 || $2 > 9) {
+				yyerror("invalid compression level: %"PRId64,
+				    $2);
+				YYERROR;
+			}
+			pr->pr_conf.compress_level = $2;
+		}
+		| MIN SIZE NUMBER {
+			if ($3 < 0 || $3 > INT_MAX) {
+				yyerror("invalid compression min size: %"PRId64,
+				    $3);
+				YYERROR;
+			}
+			pr->pr_conf.compress_minsize = $3;
+		}
+		;
+
+imgexts_l	: imgexts_l imgext optnl
+		| imgext optnl
+		;
+
+imgext		: STRING {
+			struct proxy_config	*pc = &pr->pr_conf;
+			char			*ext = $1;
+			size_t			 n;
+
+			if (*ext == '.')
+				ext++;
+			if (*ext == '\0' || strchr(ext, '.') != NULL ||
+			    strchr(ext, '/') != NULL) {
+				yyerror("invalid image extension: %s", $1);
+				free($1);
+				YYERROR;
+			}
+
+			if (pc->nimgexts == PROXY_MAX_IMGEXTS) {
+				yyerror("too many image extensions");
+				free($1);
+				YYERROR;
+			}
+
+			n = strlcpy(pc->imgexts[pc->nimgexts], ext,
+			    sizeof(pc->imgexts[pc->nimgexts]));
+			if (n >= sizeof(pc->imgexts[pc->nimgexts])) {
+				yyerror("image extension too long: %s", $1);
+				free($1);
+				YYERROR;
+			}
+			pc->nimgexts++;
+			free($1);
+		}
+		;
+
 proxyport	: /* empty */ {
-			strlcpy(pr->pr_conf.proxy_port, "1965",
-			    sizeof(pr->pr_conf.proxy_port));
+			proxy_setstr(&pr->pr_conf.proxy_port, "1965");
 		}
 		| PORT port {
-			size_t len;
-			int n;
+			char	 buf[6];
+			int	 n;
 
-			len = sizeof(pr->pr_conf.proxy_port);
-			n = snprintf(pr->pr_conf.proxy_port, len,
-			    "%"PRId64, $2);
-			if (n < 0 || (size_t)n >= len)
+			n = snprintf(buf, sizeof(buf), "%"PRId64, $2);
+			if (n < 0 || (size_t)n >= sizeof(buf))
 				fatal("port number too long?");
+			proxy_setstr(&pr->pr_conf.proxy_port, buf);
 		};
 
 port		: NUMBER {
@@ -345,21 +694,63 @@ lookup(char *s)
 {
 	/* this has to be sorted always */
 	static const struct keywords keywords[] = {
+		{ "accept",	ACCEPT },
+		{ "access",	ACCESS },
+		{ "affinity",	AFFINITY },
+		{ "age",	AGE },
+		{ "auto",	AUTO },
+		{ "backlog",	BACKLOG },
 		{ "bar",	BAR },
+		{ "batch",	BATCH },
+		{ "byte",	BYTE },
+		{ "cache",	CACHE },
 		{ "chroot",	CHROOT },
+		{ "compression", COMPRESSION },
+		{ "connect",	CONNECT },
+		{ "cpu",	CPU },
+		{ "drain",	DRAIN },
+		{ "etag",	ETAG },
+		{ "extensions",	EXTENSIONS },
+		{ "fastcgi",	FASTCGI },
+		{ "first",	FIRST },
 		{ "footer",	FOOTER },
 		{ "hostname",	HOSTNAME },
+		{ "idle",	IDLE },
 		{ "image",	IMAGE },
 		{ "include",	INCLUDE },
+		{ "level",	LEVEL },
+		{ "listen",	LISTEN },
+		{ "log",	LOG },
+		{ "max",	MAX },
+		{ "media",	MEDIA },
+		{ "metrics",	METRICS },
+		{ "min",	MIN },
 		{ "navigation",	NAVIGATION },
 		{ "no",		NO },
+		{ "on",		ON },
+		{ "pages",	PAGES },
 		{ "port",	PORT },
 		{ "prefork",	PREFORK },
 		{ "preview",	PREVIEW },
+		{ "private",	PRIVATE },
 		{ "proxy",	PROXY },
+		{ "public",	PUBLIC },
+		{ "request",	REQUEST },
+		{ "requests",	REQUESTS },
+		{ "response",	RESPONSE },
+		{ "reuseport",	REUSEPORT },
+		{ "revalidate",	REVALIDATE },
+		{ "size",	SIZE },
+		{ "slow",	SLOW },
+		{ "socket",	SOCKET },
 		{ "source",	SOURCE },
+		{ "stale",	STALE },
 		{ "stylesheet",	STYLESHEET},
+		{ "syslog",	SYSLOG },
+		{ "timeout",	TIMEOUT },
 		{ "tls",	TLS },
+		{ "total",	TOTAL },
+		{ "while",	WHILE },
 	};
 	const struct keywords	*p;
 
@@ -714,6 +1105,12 @@ parse_config(const char *filename, struct galileo *env)
 	yyparse();
 	if (TAILQ_EMPTY(&conf->sc_proxies))
 		yyerror("no proxies defined");
+	if (TAILQ_EMPTY(&conf->sc_listeners)) {
+		memset(&lopts, 0, sizeof(lopts));
+		lopts.l_backlog = LISTEN_BACKLOG;
+		lopts.l_batch = ACCEPT_BATCH;
+		listen_unix(GALILEO_SOCK);
+	}
 	errors = file->errors;
 	popfile();
 
@@ -828,3 +1225,70 @@ getservice(const char *n)
 
 	return ((unsigned short)llval);
 }
+
+int
+listen_unix(const char *path)
+{
+	struct listener		*l;
+	struct sockaddr_un	*sun;
+
+	if ((l = calloc(1, sizeof(*l))) == NULL)
+		fatal("calloc");
+	memcpy(l, &lopts, sizeof(*l));
+
+	sun = (struct sockaddr_un *)&l->l_ss;
+	sun->sun_family = AF_UNIX;
+	if (strlcpy(sun->sun_path, path, sizeof(sun->sun_path)) >=
+	    sizeof(sun->sun_path)) {
+		yyerror("socket path too long: %s", path);
+		free(l);
+		return (-1);
+	}
+	l->l_slen = sizeof(*sun);
+	l->l_fd = -1;
+
+	TAILQ_INSERT_TAIL(&conf->sc_listeners, l, l_entry);
+	return (0);
+}
+
+int
+listen_inet(const char *host, int port)
+{
+	struct addrinfo		 hints, *res, *res0;
+	struct listener		*l;
+	char			 pstr[6];
+	int			 error;
+
+	if (!strcmp(host, "*"))
+		host = NULL;
+
+	(void)snprintf(pstr, sizeof(pstr), "%d", port);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((error = getaddrinfo(host, pstr, &hints, &res0)) != 0) {
+		yyerror("%s: %s", host != NULL ? host : "*",
+		    gai_strerror(error));
+		return (-1);
+	}
+
+	for (res = res0; res != NULL; res = res->ai_next) {
+		if (res->ai_addrlen > sizeof(l->l_ss))
+			continue;
+
+		if ((l = calloc(1, sizeof(*l))) == NULL)
+			fatal("calloc");
+		memcpy(l, &lopts, sizeof(*l));
+
+		memcpy(&l->l_ss, res->ai_addr, res->ai_addrlen);
+		l->l_slen = res->ai_addrlen;
+		l->l_fd = -1;
+
+		TAILQ_INSERT_TAIL(&conf->sc_listeners, l, l_entry);
+	}
+
+	freeaddrinfo(res0);
+	return (0);
+}
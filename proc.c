@@ -53,6 +53,8 @@ void	 proc_shutdown(struct privsep_proc *);
 void	 proc_sig_handler(int, short, void *);
 void	 proc_range(struct privsep *, enum privsep_procid, int *, int *);
 int	 proc_dispatch_null(int, struct privsep_proc *, struct imsg *);
+static struct imsgev *proc_newiev(struct privsep_proc *);
+static void	 proc_gone(struct privsep *, struct imsgev *);
 
 enum privsep_procid
 proc_getid(struct privsep_proc *procs, unsigned int nproc,
@@ -72,90 +74,178 @@ proc_getid(struct privsep_proc *procs, unsigned int nproc,
 	return (PROC_MAX);
 }
 
-void
-proc_exec(struct privsep *ps, struct privsep_proc *procs, unsigned int nproc,
-    int debug, int argc, char **argv)
+static pid_t
+proc_spawn(struct privsep *ps, struct privsep_proc *p, unsigned int instance,
+    int fd)
 {
-	unsigned int		 proc, nargc, i, proc_i;
+	unsigned int		 nargc, i;
 	char			**nargv;
-	struct privsep_proc	*p;
 	char			 num[32];
-	int			 fd;
+	pid_t			 pid;
+	int			 devnull;
 
 	/* Prepare the new process argv. */
-	nargv = calloc(argc + 5, sizeof(char *));
+	nargv = calloc(ps->ps_argc + 5, sizeof(char *));
 	if (nargv == NULL)
 		fatal("%s: calloc", __func__);
 
+	snprintf(num, sizeof(num), "%u", instance);
+
 	/* Copy call argument first. */
 	nargc = 0;
-	nargv[nargc++] = argv[0];
+	nargv[nargc++] = ps->ps_argv[0];
 
-	/* Set process name argument and save the position. */
+	/* Set process name and instance, then copy the original args. */
 	nargv[nargc++] = "-T";
-	proc_i = nargc;
-	nargc++;
-
-	/* Point process instance arg to stack and copy the original args. */
+	nargv[nargc++] = (char *)(uintptr_t)p->p_title;
 	nargv[nargc++] = "-I";
 	nargv[nargc++] = num;
-	for (i = 1; i < (unsigned int) argc; i++)
-		nargv[nargc++] = argv[i];
+	for (i = 1; i < (unsigned int) ps->ps_argc; i++)
+		nargv[nargc++] = ps->ps_argv[i];
 
 	nargv[nargc] = NULL;
 
+	switch (pid = fork()) {
+	case -1:
+		fatal("%s: fork", __func__);
+		break;
+	case 0:
+		/* First create a new session */
+		if (setsid() == -1)
+			fatal("setsid");
+
+		/* Prepare parent socket. */
+		if (fd != PROC_PARENT_SOCK_FILENO) {
+			if (dup2(fd, PROC_PARENT_SOCK_FILENO) == -1)
+				fatal("dup2");
+		} else if (fcntl(fd, F_SETFD, 0) == -1)
+			fatal("fcntl");
+
+		/* Daemons detach from terminal. */
+		if (!ps->ps_debug && (devnull =
+		    open(_PATH_DEVNULL, O_RDWR, 0)) != -1) {
+			(void)dup2(devnull, STDIN_FILENO);
+			(void)dup2(devnull, STDOUT_FILENO);
+			(void)dup2(devnull, STDERR_FILENO);
+			if (devnull > 2)
+				(void)close(devnull);
+		}
+
+		execvp(ps->ps_argv[0], nargv);
+		fatal("%s: execvp", __func__);
+		break;
+	default:
+		/* Close child end. */
+		close(fd);
+		break;
+	}
+
+	free(nargv);
+	return (pid);
+}
+
+void
+proc_exec(struct privsep *ps, struct privsep_proc *procs, unsigned int nproc,
+    int debug, int argc, char **argv)
+{
+	unsigned int		 proc, i;
+	struct privsep_proc	*p;
+	int			 fd;
+
+	ps->ps_debug = debug;
+	ps->ps_argc = argc;
+	ps->ps_argv = argv;
+
 	for (proc = 0; proc < nproc; proc++) {
 		p = &procs[proc];
 
-		/* Update args with process title. */
-		nargv[proc_i] = (char *)(uintptr_t)p->p_title;
-
 		/* Fire children processes. */
 		for (i = 0; i < ps->ps_instances[p->p_id]; i++) {
-			/* Update the process instance number. */
-			snprintf(num, sizeof(num), "%u", i);
-
 			fd = ps->ps_pipes[p->p_id][i].pp_pipes[PROC_PARENT][0];
 			ps->ps_pipes[p->p_id][i].pp_pipes[PROC_PARENT][0] = -1;
 
-			switch (fork()) {
-			case -1:
-				fatal("%s: fork", __func__);
-				break;
-			case 0:
-				/* First create a new session */
-				if (setsid() == -1)
-					fatal("setsid");
-
-				/* Prepare parent socket. */
-				if (fd != PROC_PARENT_SOCK_FILENO) {
-					if (dup2(fd, PROC_PARENT_SOCK_FILENO)
-					    == -1)
-						fatal("dup2");
-				} else if (fcntl(fd, F_SETFD, 0) == -1)
-					fatal("fcntl");
-
-				/* Daemons detach from terminal. */
-				if (!debug && (fd =
-				    open(_PATH_DEVNULL, O_RDWR, 0)) != -1) {
-					(void)dup2(fd, STDIN_FILENO);
-					(void)dup2(fd, STDOUT_FILENO);
-					(void)dup2(fd, STDERR_FILENO);
-					if (fd > 2)
-						(void)close(fd);
-				}
-
-				execvp(argv[0], nargv);
-				fatal("%s: execvp", __func__);
-				break;
-			default:
-				/* Close child end. */
+			/* the others are started later by proc_respawn */
+			if (ps->ps_spawn[p->p_id] != 0 &&
+			    i >= ps->ps_spawn[p->p_id]) {
 				close(fd);
-				break;
+				close(ps->ps_pp->pp_pipes[p->p_id][i]);
+				ps->ps_pp->pp_pipes[p->p_id][i] = -1;
+				continue;
 			}
+
+			ps->ps_pids[p->p_id][i] = proc_spawn(ps, p, i, fd);
 		}
 	}
-	free(nargv);
+}
+
+/*
+ * Start a process instance in the given slot.  The one running there,
+ * if any, is retired first.
+ */
+int
+proc_respawn(struct privsep *ps, enum privsep_procid id, unsigned int n)
+{
+	struct privsep_pipes	*pp = ps->ps_pp;
+	struct imsgev		*iev;
+	int			 fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    PF_UNSPEC, fds) == -1) {
+		log_warn("%s: socketpair", __func__);
+		return (-1);
+	}
+
+	proc_retire(ps, id, n);
+
+	iev = ps->ps_ievs[id][n];
+	pp->pp_pipes[id][n] = fds[0];
+	ps->ps_pids[id][n] = proc_spawn(ps, iev->proc, n, fds[1]);
+
+	imsg_init(&iev->ibuf, fds[0]);
+	iev->events = EV_READ;
+	event_set(&iev->ev, iev->ibuf.fd, iev->events, iev->handler, iev->data);
+	event_add(&iev->ev, NULL);
+
+	return (0);
+}
+
+/*
+ * Free the slot of a process instance.  The process is expected to
+ * finish its work and exit on its own: until then its messages are
+ * still dispatched and the ones queued for it are sent.
+ */
+void
+proc_retire(struct privsep *ps, enum privsep_procid id, unsigned int n)
+{
+	struct privsep_pipes	*pp = ps->ps_pp;
+	struct imsgev		*iev = ps->ps_ievs[id][n];
+
+	if (pp->pp_pipes[id][n] == -1)
+		return;
+
+	iev->retired = 1;
+	TAILQ_INSERT_TAIL(&ps->ps_retired, iev, entry);
+
+	ps->ps_ievs[id][n] = proc_newiev(iev->proc);
+	pp->pp_pipes[id][n] = -1;
+	ps->ps_pids[id][n] = 0;
+}
+
+int
+proc_running(struct privsep *ps, enum privsep_procid id, unsigned int n)
+{
+	return (ps->ps_pp->pp_pipes[id][n] != -1);
+}
+
+/* a retired process went away */
+static void
+proc_gone(struct privsep *ps, struct imsgev *iev)
+{
+	event_del(&iev->ev);
+	TAILQ_REMOVE(&ps->ps_retired, iev, entry);
+	imsg_clear(&iev->ibuf);
+	close(iev->ibuf.fd);
+	free(iev);
 }
 
 void
@@ -174,7 +264,9 @@ proc_connect(struct privsep *ps)
 			continue;
 
 		for (inst = 0; inst < ps->ps_instances[dst]; inst++) {
-			iev = &ps->ps_ievs[dst][inst];
+			if (ps->ps_pp->pp_pipes[dst][inst] == -1)
+				continue;
+			iev = ps->ps_ievs[dst][inst];
 			imsg_init(&iev->ibuf, ps->ps_pp->pp_pipes[dst][inst]);
 			event_set(&iev->ev, iev->ibuf.fd, iev->events,
 			    iev->handler, iev->data);
@@ -280,7 +372,7 @@ proc_accept(struct privsep *ps, int fd, enum privsep_procid dst,
 	} else
 		pp->pp_pipes[dst][n] = fd;
 
-	iev = &ps->ps_ievs[dst][n];
+	iev = ps->ps_ievs[dst][n];
 	imsg_init(&iev->ibuf, fd);
 	event_set(&iev->ev, iev->ibuf.fd, iev->events, iev->handler, iev->data);
 	event_add(&iev->ev, NULL);
@@ -308,17 +400,17 @@ proc_setup(struct privsep *ps, struct privsep_proc *procs, unsigned int nproc)
 		id = procs[src].p_id;
 		ps->ps_title[id] = procs[src].p_title;
 		if ((ps->ps_ievs[id] = calloc(ps->ps_instances[id],
-		    sizeof(struct imsgev))) == NULL)
+		    sizeof(struct imsgev *))) == NULL)
+			fatal("%s: calloc", __func__);
+		if ((ps->ps_pids[id] = calloc(ps->ps_instances[id],
+		    sizeof(pid_t))) == NULL)
 			fatal("%s: calloc", __func__);
 
 		/* With this set up, we are ready to call imsg_init(). */
-		for (i = 0; i < ps->ps_instances[id]; i++) {
-			ps->ps_ievs[id][i].handler = proc_dispatch;
-			ps->ps_ievs[id][i].events = EV_READ;
-			ps->ps_ievs[id][i].proc = &procs[src];
-			ps->ps_ievs[id][i].data = &ps->ps_ievs[id][i];
-		}
+		for (i = 0; i < ps->ps_instances[id]; i++)
+			ps->ps_ievs[id][i] = proc_newiev(&procs[src]);
 	}
+	TAILQ_INIT(&ps->ps_retired);
 
 	/*
 	 * Allocate pipes for all process instances (incl. parent)
@@ -359,6 +451,21 @@ proc_setup(struct privsep *ps, struct privsep_proc *procs, unsigned int nproc)
 	ps->ps_pp = &ps->ps_pipes[privsep_process][ps->ps_instance];
 }
 
+static struct imsgev *
+proc_newiev(struct privsep_proc *p)
+{
+	struct imsgev	*iev;
+
+	if ((iev = calloc(1, sizeof(*iev))) == NULL)
+		fatal("%s: calloc", __func__);
+	iev->ibuf.fd = -1;
+	iev->handler = proc_dispatch;
+	iev->events = EV_READ;
+	iev->proc = p;
+	iev->data = iev;
+	return (iev);
+}
+
 void
 proc_kill(struct privsep *ps)
 {
@@ -397,6 +504,38 @@ proc_kill(struct privsep *ps)
 	} while (pid != -1 || errno == EINTR);
 }
 
+/*
+ * Collect the processes that exited.  Returns -1 if one of them was
+ * still in use, 0 if they all were retired.
+ */
+int
+proc_reap(struct privsep *ps)
+{
+	pid_t		 pid;
+	unsigned int	 id, n;
+	int		 status, lost, ret = 0;
+
+	while ((pid = waitpid(WAIT_ANY, &status, WNOHANG)) > 0) {
+		lost = 0;
+		for (id = 0; id < PROC_MAX; id++) {
+			if (ps->ps_pids[id] == NULL)
+				continue;
+			for (n = 0; n < ps->ps_instances[id]; n++)
+				if (ps->ps_pids[id][n] == pid)
+					lost = 1;
+		}
+
+		if (lost) {
+			log_warnx("lost child: pid %d", pid);
+			ret = -1;
+		} else
+			log_debug("%s: replaced process %d exited",
+			    __func__, pid);
+	}
+
+	return (ret);
+}
+
 void
 proc_open(struct privsep *ps, int src, int dst)
 {
@@ -454,6 +593,7 @@ proc_close(struct privsep *ps)
 {
 	unsigned int		 dst, n;
 	struct privsep_pipes	*pp;
+	struct imsgev		*iev;
 
 	if (ps == NULL)
 		return;
@@ -465,17 +605,22 @@ proc_close(struct privsep *ps)
 			continue;
 
 		for (n = 0; n < ps->ps_instances[dst]; n++) {
-			if (pp->pp_pipes[dst][n] == -1)
-				continue;
-
-			/* Cancel the fd, close and invalidate the fd */
-			event_del(&(ps->ps_ievs[dst][n].ev));
-			imsg_clear(&(ps->ps_ievs[dst][n].ibuf));
-			close(pp->pp_pipes[dst][n]);
-			pp->pp_pipes[dst][n] = -1;
+			iev = ps->ps_ievs[dst][n];
+			if (pp->pp_pipes[dst][n] != -1) {
+				/* Cancel the fd, close and invalidate the fd */
+				event_del(&iev->ev);
+				imsg_clear(&iev->ibuf);
+				close(pp->pp_pipes[dst][n]);
+				pp->pp_pipes[dst][n] = -1;
+			}
+			free(iev);
 		}
 		free(ps->ps_ievs[dst]);
+		ps->ps_ievs[dst] = NULL;
 	}
+
+	while ((iev = TAILQ_FIRST(&ps->ps_retired)) != NULL)
+		proc_gone(ps, iev);
 }
 
 void
@@ -553,6 +698,7 @@ proc_run(struct privsep *ps, struct privsep_proc *p,
 		fatal("%s: cannot drop privileges", __func__);
 
 	event_init();
+	log_async();
 
 	signal(SIGPIPE, SIG_IGN);
 
@@ -596,7 +742,12 @@ proc_dispatch(int fd, short event, void *arg)
 	ibuf = &iev->ibuf;
 
 	if (event & EV_READ) {
-		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+		n = imsg_read(ibuf);
+		if (iev->retired && (n == 0 || (n == -1 && errno != EAGAIN))) {
+			proc_gone(ps, iev);
+			return;
+		}
+		if (n == -1 && errno != EAGAIN)
 			fatal("%s: imsg_read", __func__);
 		if (n == 0) {
 			/* this pipe is dead, so remove the event handler */
@@ -607,7 +758,12 @@ proc_dispatch(int fd, short event, void *arg)
 	}
 
 	if (event & EV_WRITE) {
-		if ((n = msgbuf_write(&ibuf->w)) == -1 && errno != EAGAIN)
+		n = msgbuf_write(&ibuf->w);
+		if (iev->retired && (n == 0 || (n == -1 && errno != EAGAIN))) {
+			proc_gone(ps, iev);
+			return;
+		}
+		if (n == -1 && errno != EAGAIN)
 			fatal("%s: msgbuf_write", __func__);
 		if (n == 0) {
 			/* this pipe is dead, so remove the event handler */
@@ -730,11 +886,19 @@ int
 proc_compose_imsg(struct privsep *ps, enum privsep_procid id, int n,
     uint16_t type, uint32_t peerid, int fd, void *data, uint16_t datalen)
 {
-	int	 m;
+	struct imsgev	*iev;
+	int		 m, all = n == -1;
 
 	proc_range(ps, id, &n, &m);
 	for (; n < m; n++) {
-		if (imsg_compose_event(&ps->ps_ievs[id][n],
+		iev = ps->ps_ievs[id][n];
+		if (iev->ibuf.fd == -1) {
+			/* not running */
+			if (all)
+				continue;
+			return (-1);
+		}
+		if (imsg_compose_event(iev,
 		    type, peerid, ps->ps_instance + 1, fd, data, datalen) == -1)
 			return (-1);
 	}
@@ -753,13 +917,22 @@ int
 proc_composev_imsg(struct privsep *ps, enum privsep_procid id, int n,
     uint16_t type, uint32_t peerid, int fd, const struct iovec *iov, int iovcnt)
 {
-	int	 m;
+	struct imsgev	*iev;
+	int		 m, all = n == -1;
 
 	proc_range(ps, id, &n, &m);
-	for (; n < m; n++)
-		if (imsg_composev_event(&ps->ps_ievs[id][n],
+	for (; n < m; n++) {
+		iev = ps->ps_ievs[id][n];
+		if (iev->ibuf.fd == -1) {
+			/* not running */
+			if (all)
+				continue;
+			return (-1);
+		}
+		if (imsg_composev_event(iev,
 		    type, peerid, ps->ps_instance + 1, fd, iov, iovcnt) == -1)
 			return (-1);
+	}
 
 	return (0);
 }
@@ -785,7 +958,7 @@ proc_ibuf(struct privsep *ps, enum privsep_procid id, int n)
 	int	 m;
 
 	proc_range(ps, id, &n, &m);
-	return (&ps->ps_ievs[id][n].ibuf);
+	return (&ps->ps_ievs[id][n]->ibuf);
 }
 
 struct imsgev *
@@ -794,7 +967,7 @@ proc_iev(struct privsep *ps, enum privsep_procid id, int n)
 	int	 m;
 
 	proc_range(ps, id, &n, &m);
-	return (&ps->ps_ievs[id][n]);
+	return (ps->ps_ievs[id][n]);
 }
 
 /* This function should only be called with care as it breaks async I/O */
@@ -802,18 +975,24 @@ int
 proc_flush_imsg(struct privsep *ps, enum privsep_procid id, int n)
 {
 	struct imsgbuf	*ibuf;
-	int		 m, ret = 0;
+	int		 m, ret = 0, all = n == -1;
 
 	proc_range(ps, id, &n, &m);
 	for (; n < m; n++) {
 		if ((ibuf = proc_ibuf(ps, id, n)) == NULL)
 			return (-1);
+		if (ibuf->fd == -1) {
+			/* not running */
+			if (all)
+				continue;
+			return (-1);
+		}
 		do {
 			ret = imsg_flush(ibuf);
 		} while (ret == -1 && errno == EAGAIN);
 		if (ret == -1)
 			break;
-		imsg_event_add(&ps->ps_ievs[id][n]);
+		imsg_event_add(ps->ps_ievs[id][n]);
 	}
 
 	return (ret);
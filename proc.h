@@ -22,7 +22,10 @@ struct imsgev {
 	struct privsep_proc	*proc;
 	void			*data;
 	short			 events;
+	int			 retired;
+	TAILQ_ENTRY(imsgev)	 entry;
 };
+TAILQ_HEAD(imsgevlist, imsgev);
 
 #define IMSG_SIZE_CHECK(imsg, p) do {					\
 	if (IMSG_DATA_SIZE(imsg) < sizeof(*p))				\
@@ -49,7 +52,7 @@ struct privsep {
 	struct privsep_pipes		*ps_pipes[PROC_MAX];
 	struct privsep_pipes		*ps_pp;
 
-	struct imsgev			*ps_ievs[PROC_MAX];
+	struct imsgev			**ps_ievs[PROC_MAX];
 	const char			*ps_title[PROC_MAX];
 	uint8_t				 ps_what[PROC_MAX];
 
@@ -59,6 +62,14 @@ struct privsep {
 	unsigned int			 ps_instances[PROC_MAX];
 	unsigned int			 ps_instance;
 
+	/* only in the parent, to spawn the processes again */
+	pid_t				*ps_pids[PROC_MAX];
+	unsigned int			 ps_spawn[PROC_MAX];	/* 0: all */
+	struct imsgevlist		 ps_retired;
+	int				 ps_debug;
+	int				 ps_argc;
+	char				**ps_argv;
+
 	/* Event and signal handlers */
 	struct event			 ps_evsigint;
 	struct event			 ps_evsigterm;
@@ -90,6 +101,10 @@ struct privsep_fd {
 void	 proc_init(struct privsep *, struct privsep_proc *, unsigned int,
 	    int, int, char **, enum privsep_procid);
 void	 proc_kill(struct privsep *);
+int	 proc_reap(struct privsep *);
+int	 proc_respawn(struct privsep *, enum privsep_procid, unsigned int);
+void	 proc_retire(struct privsep *, enum privsep_procid, unsigned int);
+int	 proc_running(struct privsep *, enum privsep_procid, unsigned int);
 void	 proc_connect(struct privsep *ps);
 void	 proc_dispatch(int, short event, void *);
 void	 proc_range(struct privsep *, enum privsep_procid, int *, int *);
@@ -25,17 +25,21 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 
+#include <openssl/evp.h>
+
 #include <asr.h>
 #include <ctype.h>
 #include <errno.h>
 #include <event.h>
-#include <fnmatch.h>
 #include <limits.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <imsg.h>
+#include <time.h>
 #include <tls.h>
 #include <unistd.h>
 
@@ -59,20 +63,30 @@ extern void	 bufferevent_read_pressure_cb(struct evbuffer *, size_t,
 		    size_t, void *);
 
 void	proxy_init(struct privsep *, struct privsep_proc *, void *);
+void	proxy_shutdown(void);
 int	proxy_launch(struct galileo *);
+void	proxy_load(int, short, void *);
+void	proxy_report(struct galileo *);
+void	proxy_accesslog_flush(struct galileo *);
+void	proxy_show_clients(struct galileo *, uint32_t);
+void	proxy_sig_handler(int, short, void *);
+void	proxy_drain_timeout(int, short, void *);
 void	proxy_inflight_dec(const char *);
 int	proxy_dispatch_parent(int, struct privsep_proc *, struct imsg *);
-int	proxy_resurl(struct client *, const char *, char *, size_t);
-void	proxy_translate_gemtext(struct client *);
+int	proxy_translate_gemtext(struct client *);
 void	proxy_resolved(struct asr_result *, void *);
 void	proxy_connect(int, short, void *);
 int	proxy_start_reply(struct client *, int, const char *);
+int	proxy_start_body(struct client *);
+int	proxy_timeout(struct client *, int);
+int	proxy_limits(struct client *);
+void	proxy_fail(struct client *, int, const char *);
 void	proxy_read(struct bufferevent *, void *);
 void	proxy_write(struct bufferevent *, void *);
 void	proxy_error(struct bufferevent *, short, void *);
 int	proxy_bufferevent_add(struct event *, int);
 void	proxy_tls_writecb(int, short, void *);
-void	proxy_tls_readcb(int, short, void *);
+void	proxy_readcb(int, short, void *);
 
 static struct privsep_proc procs[] = {
 	{ "parent",	PROC_PARENT, proxy_dispatch_parent },
@@ -80,6 +94,10 @@ static struct privsep_proc procs[] = {
 
 volatile int proxy_clients;
 volatile int proxy_inflight;
+static int proxy_requests;
+static struct proxy_metrics proxy_metrics;
+static struct evbuffer *proxy_accesslog;
+static struct galileo *proxy_env;
 uint32_t proxy_fcg_id;
 
 void
@@ -91,34 +109,278 @@ proxy(struct privsep *ps, struct privsep_proc *p)
 void
 proxy_init(struct privsep *ps, struct privsep_proc *p, void *arg)
 {
-	if (config_init(ps->ps_env) == -1)
+	struct galileo	*env = ps->ps_env;
+#if HAVE_SCHED_SETAFFINITY
+	cpu_set_t	 set;
+	int		 cpu;
+
+	if ((cpu = proxy_cpu(env, ps->ps_instance)) != -1) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) == -1)
+			log_warn("sched_setaffinity %d", cpu);
+		else
+			log_debug("%s: pinned to cpu %d", __func__, cpu);
+	}
+#endif
+
+	if (config_init(env) == -1)
 		fatal("failed to initialize configuration");
 
 	/* We use a custom shutdown callback */
-	/* p->p_shutdown = proxy_shutdown */
+	proxy_env = env;
+	p->p_shutdown = proxy_shutdown;
 
 	if (pledge("stdio recvfd unix inet dns", NULL) == -1)
 		fatal("pledge");
+
+	evtimer_set(&env->sc_evload, proxy_load, env);
+	proxy_load(-1, EV_TIMEOUT, env);
+
+	/* drain the clients on SIGTERM instead of dropping them */
+	evtimer_set(&env->sc_evdrain, proxy_drain_timeout, env);
+	signal_del(&ps->ps_evsigterm);
+	signal_set(&ps->ps_evsigterm, SIGTERM, proxy_sig_handler, env);
+	signal_add(&ps->ps_evsigterm, NULL);
+}
+
+/* hand the last counters and access log records to the parent */
+void
+proxy_shutdown(void)
+{
+	struct galileo	*env = proxy_env;
+
+	proxy_report(env);
+	if (proc_flush_imsg(env->sc_ps, PROC_PARENT, -1) == -1)
+		log_warn("%s: failed to flush", __func__);
+}
+
+void
+proxy_sig_handler(int sig, short event, void *arg)
+{
+	struct galileo	*env = arg;
+
+	switch (sig) {
+	case SIGTERM:
+		proxy_drain(env, 0);
+		break;
+	default:
+		fatalx("%s: unexpected signal", __func__);
+	}
 }
 
 int
 proxy_launch(struct galileo *env)
 {
-	event_add(&env->sc_evsock, NULL);
+	struct listener	*l;
+
+	if (env->sc_draining)
+		return (0);
+
+	TAILQ_FOREACH(l, &env->sc_listeners, l_entry)
+		event_add(&l->l_ev, NULL);
 	return (0);
 }
 
+/*
+ * Periodically tell the parent how many clients we're serving, so
+ * that it can decide how many proxies should accept connections.
+ */
+void
+proxy_load(int fd, short event, void *arg)
+{
+	struct galileo		*env = arg;
+	struct privsep		*ps = env->sc_ps;
+	struct proxy_load	 load;
+	struct timeval		 tv = { PREFORK_INTERVAL, 0 };
+
+	load.instance = ps->ps_instance;
+	load.clients = proxy_clients;
+	proc_compose(ps, PROC_PARENT, IMSG_CTL_LOAD, &load, sizeof(load));
+	proxy_report(env);
+
+	evtimer_add(&env->sc_evload, &tv);
+}
+
+/* send the counters and the access log to the parent and start over */
+void
+proxy_report(struct galileo *env)
+{
+	struct privsep		*ps = env->sc_ps;
+	struct proxy_metrics	*pm = &proxy_metrics;
+
+	proxy_accesslog_flush(env);
+
+	pm->instance = ps->ps_instance;
+	pm->clients = proxy_clients;
+	pm->fcgi_conns = fcgi_inflight;
+	pm->accepts = fcgi_accepts;
+	pm->fcgi_request_timeouts = fcgi_request_timeouts;
+	pm->fcgi_idle_timeouts = fcgi_idle_timeouts;
+	if (proc_compose(ps, PROC_PARENT, IMSG_CTL_METRICS, pm,
+	    sizeof(*pm)) == -1)
+		return;
+	memset(pm, 0, sizeof(*pm));
+	fcgi_accepts = fcgi_request_timeouts = fcgi_idle_timeouts = 0;
+}
+
+/*
+ * Hand the batch of access log records to the parent.  They're
+ * dropped if it can't be queued, there's no point in keeping them
+ * around.
+ */
+void
+proxy_accesslog_flush(struct galileo *env)
+{
+	struct evbuffer	*buf = proxy_accesslog;
+
+	if (buf == NULL || EVBUFFER_LENGTH(buf) == 0)
+		return;
+
+	if (proc_compose(env->sc_ps, PROC_PARENT, IMSG_CTL_ACCESSLOG,
+	    EVBUFFER_DATA(buf), EVBUFFER_LENGTH(buf)) == -1)
+		log_warn("%s: dropping %zu bytes of records", __func__,
+		    EVBUFFER_LENGTH(buf));
+	evbuffer_drain(buf, EVBUFFER_LENGTH(buf));
+}
+
+/*
+ * Stop accepting new connections and exit once the clients in flight
+ * are done and the FastCGI connections closed, or the drain timeout
+ * expires.  When recycling, the parent is asked to start a new process
+ * in our place.  Either way the counters and the access log keep going
+ * to the parent, which waits for us, and proxy_shutdown sends the last
+ * ones.
+ */
+void
+proxy_drain(struct galileo *env, int recycle)
+{
+	struct privsep	*ps = env->sc_ps;
+	struct listener	*l;
+	struct fcgi	*fcgi, *next;
+	struct timeval	 tv = { env->sc_conf.drain_timeout, 0 };
+
+	if (env->sc_draining)
+		return;
+	env->sc_draining = 1;
+
+	log_info("draining %d clients%s", proxy_clients,
+	    recycle ? " before recycling" : "");
+
+	if (recycle)
+		proc_compose(ps, PROC_PARENT, IMSG_CTL_RECYCLE, NULL, 0);
+
+	/*
+	 * The other proxies keep accepting from the shared sockets.
+	 * Nobody else accepts from our reuseport ones, so take what's
+	 * queued there first; the parent closes them once we're done,
+	 * unless a new proxy runs in our slot.
+	 */
+	TAILQ_FOREACH(l, &env->sc_listeners, l_entry) {
+		if (l->l_fd == -1)
+			continue;
+		event_del(&l->l_ev);
+		if (l->l_flags & LISTEN_REUSEPORT)
+			fcgi_accept_queue(l, -1);
+		event_del(&l->l_evpause);
+		close(l->l_fd);
+		l->l_fd = -1;
+	}
+	proc_compose(ps, PROC_PARENT, IMSG_CTL_UNLISTEN, NULL, 0);
+
+	/*
+	 * Close the idle connections, the others when they're done.
+	 * The ones waiting for their first request get to send it.
+	 */
+	for (fcgi = SPLAY_MIN(fcgi_tree, &env->sc_fcgi_socks); fcgi != NULL;
+	    fcgi = next) {
+		next = SPLAY_NEXT(fcgi_tree, &env->sc_fcgi_socks, fcgi);
+		if (fcgi->fcg_wait != FCGI_WAIT_IDLE)
+			continue;
+		fcgi->fcg_done = 1;
+		if (EVBUFFER_LENGTH(EVBUFFER_OUTPUT(fcgi->fcg_bev)) == 0)
+			fcgi_error(fcgi->fcg_bev, EVBUFFER_EOF, fcgi);
+	}
+
+	if (SPLAY_EMPTY(&env->sc_fcgi_socks))
+		event_loopexit(NULL);
+	else if (env->sc_conf.drain_timeout != 0)
+		evtimer_add(&env->sc_evdrain, &tv);
+}
+
+void
+proxy_drain_timeout(int fd, short event, void *arg)
+{
+	log_warnx("drain timeout, dropping %d clients", proxy_clients);
+	event_loopexit(NULL);
+}
+
+struct proxy *
+proxy_new(void)
+{
+	struct proxy		*pr;
+	struct proxy_config	*pc;
+
+	if ((pr = calloc(1, sizeof(*pr))) == NULL)
+		return (NULL);
+
+	pc = &pr->pr_conf;
+	pc->host = config_intern("");
+	pc->stylesheet = config_intern("");
+	pc->proxy_addr = config_intern("");
+	pc->proxy_name = config_intern("");
+	pc->proxy_port = config_intern("");
+	pc->timeout_connect = TIMEOUT_CONNECT;
+	pc->timeout_firstbyte = TIMEOUT_FIRSTBYTE;
+	pc->timeout_idle = TIMEOUT_IDLE;
+	return (pr);
+}
+
+void
+proxy_setstr(const char **dst, const char *s)
+{
+	const char	*old = *dst;
+
+	*dst = config_intern(s);
+	if (old != NULL)
+		config_unintern(old);
+}
+
 void
 proxy_purge(struct proxy *pr)
 {
+	struct proxy_config	*pc = &pr->pr_conf;
+
+	config_unintern(pc->host);
+	config_unintern(pc->stylesheet);
+	config_unintern(pc->proxy_addr);
+	config_unintern(pc->proxy_name);
+	config_unintern(pc->proxy_port);
+	free(pr->pr_stats);
 	free(pr);
 }
 
+/*
+ * Drop a client reference to the proxy and free it if it belongs to
+ * an old configuration generation that's not used anymore.
+ */
+void
+proxy_release(struct galileo *env, struct proxy *pr)
+{
+	if (--pr->pr_refs > 0 || !pr->pr_retired)
+		return;
+
+	log_debug("%s: freeing proxy %s of generation %u", __func__,
+	    pr->pr_conf.host, pr->pr_gen);
+	TAILQ_REMOVE(&env->sc_retired, pr, pr_entry);
+	proxy_purge(pr);
+}
+
 void
 proxy_inflight_dec(const char *why)
 {
 	proxy_inflight--;
-	log_debug("%s: inflight decremented, now %d, %s",
+	DPRINTF("%s: inflight decremented, now %d, %s",
 	    __func__, proxy_inflight, why);
 }
 
@@ -127,6 +389,7 @@ proxy_dispatch_parent(int fd, struct privsep_proc *p, struct imsg *imsg)
 {
 	struct privsep	*ps = p->p_ps;
 	struct galileo	*env = ps->ps_env;
+	int		 verbose;
 
 	switch (imsg->hdr.type) {
 	case IMSG_CFG_SRV:
@@ -134,15 +397,8 @@ proxy_dispatch_parent(int fd, struct privsep_proc *p, struct imsg *imsg)
 			fatal("config_getproxy");
 		break;
 	case IMSG_CFG_SOCK:
-		/* XXX: improve */
-
-		env->sc_sock_fd = config_getsock(env, imsg);
-		if (env->sc_sock_fd == -1)
+		if (config_getsock(env, imsg) == -1)
 			fatal("config_getsock");
-
-		event_set(&env->sc_evsock, env->sc_sock_fd,
-		    EV_READ | EV_PERSIST, fcgi_accept, env);
-		evtimer_set(&env->sc_evpause, fcgi_accept, env);
 		break;
 	case IMSG_CFG_DONE:
 		config_getcfg(env, imsg);
@@ -153,6 +409,17 @@ proxy_dispatch_parent(int fd, struct privsep_proc *p, struct imsg *imsg)
 	case IMSG_CTL_RESET:
 		config_getreset(env, imsg);
 		break;
+	case IMSG_CTL_DRAIN:
+		proxy_drain(env, 0);
+		break;
+	case IMSG_CTL_SHOW_CLIENTS:
+		proxy_show_clients(env, imsg->hdr.peerid);
+		break;
+	case IMSG_CTL_VERBOSE:
+		IMSG_SIZE_CHECK(imsg, &verbose);
+		memcpy(&verbose, imsg->data, sizeof(verbose));
+		log_setverbose(verbose);
+		break;
 	default:
 		return (-1);
 	}
@@ -160,294 +427,228 @@ proxy_dispatch_parent(int fd, struct privsep_proc *p, struct imsg *imsg)
 	return (0);
 }
 
-static int
-portok(const char **url, struct client *clt)
+/* tell galileoctl what the clients in flight are doing */
+void
+proxy_show_clients(struct galileo *env, uint32_t peerid)
 {
-	const char		*u = *url;
-	const char		*port = clt->clt_pc->proxy_port;
-	size_t			 len;
-
-	len = strlen(port);
+	struct privsep		*ps = env->sc_ps;
+	struct ctl_client	 cc;
+	struct fcgi		*fcgi;
+	struct client		*clt;
+	uint64_t		 now;
+	int			 ts;
+
+	now = proxy_now();
+	SPLAY_FOREACH(fcgi, fcgi_tree, &env->sc_fcgi_socks) {
+		SPLAY_FOREACH(clt, client_tree, &fcgi->fcg_clients) {
+			memset(&cc, 0, sizeof(cc));
+			cc.instance = ps->ps_instance;
+			cc.fcgi_id = fcgi->fcg_id;
+			cc.id = clt->clt_id;
+			cc.tls = clt->clt_ctx != NULL;
+			cc.status = clt->clt_status;
+
+			cc.phase = -1;
+			for (ts = 0; ts < TS_MAX; ++ts)
+				if (clt->clt_ts[ts] != 0)
+					cc.phase = ts;
+			if (clt->clt_ts[TS_START] != 0)
+				cc.age = (now - clt->clt_ts[TS_START]) / 1000;
+
+			if (clt->clt_server_name != NULL)
+				(void)strlcpy(cc.host, clt->clt_server_name,
+				    sizeof(cc.host));
+			if (clt->clt_path_info != NULL)
+				(void)strlcpy(cc.path, clt->clt_path_info,
+				    sizeof(cc.path));
+
+			proc_compose_imsg(ps, PROC_PARENT, -1,
+			    IMSG_CTL_CLIENT, peerid, -1, &cc, sizeof(cc));
+		}
+	}
 
-	if (*u == '\0' || *u == '/' || *u == '?' || *u == '#')
-		return (1);
-	if (*u != ':')
-		return (0);
-	u++;
-	if (strncmp(u, port, len) != 0)
-		return (0);
-	u += len;
-	if (*u != '\0' && *u != '/' && *u != '?' && *u != '#')
-		return (0);
-	*url = u;
-	return (1);
+	proc_compose_imsg(ps, PROC_PARENT, -1, IMSG_CTL_END, peerid, -1,
+	    NULL, 0);
 }
 
 int
-proxy_resurl(struct client *clt, const char *url, char *buf, size_t len)
+proxy_translate_gemtext(struct client *clt)
 {
-	const char		*tmp;
-	size_t			 l;
-
-	if (clt->clt_server_name == NULL)
-		return (-1);
+	uint64_t	 start;
+	int		 r;
 
-	l = strlen(clt->clt_server_name);
-
-	if (len == 0) {
-		log_warn("%s: zero-sized buffer!", __func__);
-		return (-1);
-	}
+	start = proxy_now();
+	r = gemtext_translate(clt);
+	clt->clt_translate_us += proxy_now() - start;
+	return (r);
+}
 
-	/* look if it's an absolute URI */
-	if (strncmp(url, "//", 2) == 0) {
-		tmp = url + 2;
-		if (strncmp(tmp, clt->clt_server_name, l) != 0)
-			goto done;
-
-		tmp += l;
-		if (!portok(&tmp, clt))
-			goto done;
-		url = tmp;
-	} else if (strncmp(url, "gemini://", 9) == 0) {
-		tmp = url + 9;
-		if (strncmp(tmp, clt->clt_server_name, l) != 0)
-			goto done;
-
-		tmp += l;
-		if (!portok(&tmp, clt))
-			goto done;
-		url = tmp;
-	} else {
-		tmp = url;
-		while (isalpha((unsigned char)*tmp) || *tmp == '+')
-			tmp++;
-		if (strncmp(tmp, "://", 3) == 0)
-			goto done;
-	}
+static uint32_t
+proxy_hash(const char *s, size_t len)
+{
+	uint32_t	 h = 2166136261U;	/* FNV-1a */
 
-	/* maybe it's an absolute path? */
-	if (*url == '\0' || *url == '/') {
-		if (strlcpy(buf, clt->clt_script_name, len) >= len)
-			return (-1);
-		if (strlcat(buf, url + 1, len) >= len)
-			return (-1);
-		return (0);
+	while (len-- > 0) {
+		h ^= tolower((unsigned char)*s++);
+		h *= 16777619U;
 	}
-
-	/* otherwise, leave it as it is */
- done:
-	if (strlcpy(buf, url, len) >= len)
-		return (-1);
-	return (0);
+	return (h);
 }
 
-static inline int
-match_image_heur(const char *url)
+/* the key of a proxy: the host name or the suffix of a wildcard */
+static const char *
+proxy_key(struct proxy *pr)
 {
-	return (fnmatch("*.jpg", url, 0) == 0 ||
-	    fnmatch("*.jpeg", url, 0) == 0 ||
-	    fnmatch("*.gif", url, 0) == 0 ||
-	    fnmatch("*.png", url, 0) == 0 ||
-	    fnmatch("*.svg", url, 0) == 0 ||
-	    fnmatch("*.webp", url, 0) == 0);
+	const char	*host = pr->pr_conf.host;
+
+	if (host[0] == '*' && (host[1] == '.' || host[1] == '\0'))
+		return (host + 1);
+	return (host);
 }
 
-static int
-gemtext_translate_line(struct client *clt, char *line)
+static struct proxy *
+proxy_table_get(struct proxy_table *pt, const char *key, size_t len)
 {
-	struct template	*tp = clt->clt_tp;
-	char		 buf[1025];
-	char		*url;
-
-	/* preformatted line / closing */
-	if (clt->clt_translate & TR_PRE) {
-		if (!strncmp(line, "```", 3)) {
-			clt->clt_translate &= ~TR_PRE;
-			return (tp_pre_close(clt->clt_tp));
-		}
-
-		if (tp_htmlescape(clt->clt_tp, line) == -1)
-			return (-1);
-		return (tp_write(tp, "\n", 1));
-	}
-
-	/* bullet */
-	if (!strncmp(line, "* ", 2)) {
-		if (clt->clt_translate & TR_NAV) {
-			if (tp_writes(tp, "</ul></nav>") == -1)
-				return (-1);
-			clt->clt_translate &= ~TR_NAV;
-		}
+	struct proxy_slot	*slot;
+	const char		*k;
+	uint32_t		 h;
+	size_t			 i, mask;
 
-		if (!(clt->clt_translate & TR_LIST)) {
-			if (tp_writes(tp, "<ul>") == -1)
-				return (-1);
-			clt->clt_translate |= TR_LIST;
-		}
-
-		if (tp_writes(tp, "<li>") == -1 ||
-		    tp_htmlescape(clt->clt_tp, line + 2) == -1 ||
-		    tp_writes(tp, "</li>") == -1)
-			return (-1);
-		return (0);
-	}
+	if (pt->pt_size == 0)
+		return (NULL);
 
-	if (clt->clt_translate & TR_LIST) {
-		if (tp_writes(tp, "</ul>") == -1)
-			return (-1);
-		clt->clt_translate &= ~TR_LIST;
+	h = proxy_hash(key, len);
+	mask = pt->pt_size - 1;
+	for (i = h & mask;; i = (i + 1) & mask) {
+		slot = &pt->pt_slots[i];
+		if (slot->ps_proxy == NULL)
+			return (NULL);
+		if (slot->ps_hash != h)
+			continue;
+		k = proxy_key(slot->ps_proxy);
+		if (strlen(k) == len && !strncasecmp(k, key, len))
+			return (slot->ps_proxy);
 	}
+}
 
-	/* link */
-	if (!strncmp(line, "=>", 2)) {
-		char *label;
-
-		line += 2;
-		line += strspn(line, " \t");
-
-		label = line + strcspn(line, " \t");
-		if (*label == '\0')
-			label = line;
-		else {
-			*label++ = '\0';
-			label += strspn(label, " \t");
-			if (*label == '\0')
-				label = line;
-		}
-
-		if (proxy_resurl(clt, line, buf, sizeof(buf)) == 0)
-			url = buf;
-		else
-			url = line; /* leave the URL as it is */
-
-		if (!(clt->clt_pc->flags & PROXY_NO_IMGPRV) &&
-		    match_image_heur(url)) {
-			if (clt->clt_translate & TR_NAV) {
-				if (tp_writes(tp, "</ul></nav>") == -1)
-					return (-1);
-				clt->clt_translate &= ~TR_NAV;
-			}
-
-			if (tp_figure(tp, url, label) == -1)
-				return (-1);
-
-			return (0);
-		}
-
-		if (!(clt->clt_translate & TR_NAV)) {
-			if (tp_writes(tp, "<nav><ul>") == -1)
-				return (-1);
-			clt->clt_translate |= TR_NAV;
-		}
-
-		if (tp_writes(tp, "<li><a href='") == -1)
-			return (-1);
-
-		if (tp_urlescape(clt->clt_tp, url) == -1 ||
-		    tp_writes(tp, "'>") == -1 ||
-		    tp_htmlescape(clt->clt_tp, label) == -1 ||
-		    tp_writes(tp, "</a></li>") == -1)
-			return (-1);
+static void
+proxy_table_put(struct proxy_table *pt, struct proxy *pr, uint32_t h)
+{
+	size_t		 i, mask;
+
+	mask = pt->pt_size - 1;
+	for (i = h & mask; pt->pt_slots[i].ps_proxy != NULL;
+	    i = (i + 1) & mask)
+		;	/* nothing */
+	pt->pt_slots[i].ps_hash = h;
+	pt->pt_slots[i].ps_proxy = pr;
+	pt->pt_count++;
+}
 
-		return (0);
-	}
+static int
+proxy_table_grow(struct proxy_table *pt)
+{
+	struct proxy_slot	*old = pt->pt_slots;
+	size_t			 i, oldsize = pt->pt_size;
 
-	if (clt->clt_translate & TR_NAV) {
-		if (tp_writes(tp, "</ul></nav>") == -1)
-			return (-1);
-		clt->clt_translate &= ~TR_NAV;
+	pt->pt_size = oldsize ? oldsize * 2 : PROXY_TABLE_SIZE;
+	if ((pt->pt_slots = calloc(pt->pt_size, sizeof(*old))) == NULL) {
+		pt->pt_slots = old;
+		pt->pt_size = oldsize;
+		return (-1);
 	}
 
-	/* pre opening */
-	if (!strncmp(line, "```", 3)) {
-		line += 3;
-		line += strspn(line, " \t");
+	pt->pt_count = 0;
+	for (i = 0; i < oldsize; ++i)
+		if (old[i].ps_proxy != NULL)
+			proxy_table_put(pt, old[i].ps_proxy, old[i].ps_hash);
+	free(old);
+	return (0);
+}
 
-		clt->clt_translate |= TR_PRE;
-		return (tp_pre_open(tp, line));
-	}
+/*
+ * Add the proxy to the host name index being built, which replaces
+ * the one in use at proxy_index_swap.  Fails if the table can't grow
+ * or another proxy has the same name.
+ */
+int
+proxy_index(struct galileo *env, struct proxy *pr)
+{
+	struct proxy_table	*pt;
+	const char		*key = proxy_key(pr);
+	size_t			 len = strlen(key);
 
-	/* citation block */
-	if (*line == '>') {
-		if (tp_writes(tp, "<blockquote>") == -1 ||
-		    tp_htmlescape(clt->clt_tp, line + 1) == -1 ||
-		    tp_writes(tp, "</blockquote>") == -1)
-			return (-1);
-		return (0);
-	}
+	pt = key != pr->pr_conf.host ? &env->sc_newwildcards :
+	    &env->sc_newhosts;
 
-	/* headings */
-	if (!strncmp(line, "###", 3)) {
-		if (tp_writes(tp, "<h3>") == -1 ||
-		    tp_htmlescape(clt->clt_tp, line + 3) == -1 ||
-		    tp_writes(tp, "</h3>") == -1)
-			return (-1);
-		return (0);
-	}
-	if (!strncmp(line, "##", 2)) {
-		if (tp_writes(tp, "<h2>") == -1 ||
-		    tp_htmlescape(clt->clt_tp, line + 2) == -1 ||
-		    tp_writes(tp, "</h2>") == -1)
-			return (-1);
-		return (0);
-	}
-	if (!strncmp(line, "#", 1)) {
-		if (tp_writes(tp, "<h1>") == -1 ||
-		    tp_htmlescape(clt->clt_tp, line + 1) == -1 ||
-		    tp_writes(tp, "</h1>") == -1)
-			return (-1);
-		return (0);
+	if (proxy_table_get(pt, key, len) != NULL) {
+		log_warnx("%s: duplicate proxy %s", __func__,
+		    pr->pr_conf.host);
+		return (-1);
 	}
 
-	/* Not following strictly the gemini specification... */
-	if (*line == '\0')
-		return (0);
-
-	/* paragraph */
-	if (tp_writes(tp, "<p>") == -1 ||
-	    tp_htmlescape(clt->clt_tp, line) == -1 ||
-	    tp_writes(tp, "</p>") == -1)
+	/* keep the load factor under 1/2 */
+	if ((pt->pt_count + 1) * 2 > pt->pt_size &&
+	    proxy_table_grow(pt) == -1)
 		return (-1);
 
+	proxy_table_put(pt, pr, proxy_hash(key, len));
 	return (0);
 }
 
 void
-proxy_translate_gemtext(struct client *clt)
+proxy_index_clear(struct galileo *env)
 {
-	struct bufferevent	*bev = clt->clt_bev;
-	struct evbuffer		*src = EVBUFFER_INPUT(bev);
-	char			*line;
-	size_t			 len;
-	int			 r;
-
-	for (;;) {
-		line = evbuffer_readln(src, &len, EVBUFFER_EOL_CRLF);
-		if (line == NULL)
-			return;
+	free(env->sc_hosts.pt_slots);
+	free(env->sc_wildcards.pt_slots);
+	free(env->sc_newhosts.pt_slots);
+	free(env->sc_newwildcards.pt_slots);
+	memset(&env->sc_hosts, 0, sizeof(env->sc_hosts));
+	memset(&env->sc_wildcards, 0, sizeof(env->sc_wildcards));
+	memset(&env->sc_newhosts, 0, sizeof(env->sc_newhosts));
+	memset(&env->sc_newwildcards, 0, sizeof(env->sc_newwildcards));
+}
 
-		r = gemtext_translate_line(clt, line);
-		free(line);
-		if (r == -1)
-			return;
-	}
+/* start using the index built so far */
+void
+proxy_index_swap(struct galileo *env)
+{
+	free(env->sc_hosts.pt_slots);
+	free(env->sc_wildcards.pt_slots);
+	env->sc_hosts = env->sc_newhosts;
+	env->sc_wildcards = env->sc_newwildcards;
+	memset(&env->sc_newhosts, 0, sizeof(env->sc_newhosts));
+	memset(&env->sc_newwildcards, 0, sizeof(env->sc_newwildcards));
 }
 
-struct proxy_config *
+/*
+ * Find the proxy for the given host: an exact match wins over the
+ * wildcards, and the longest wildcard suffix over the shorter ones,
+ * up to a catch-all `*'.
+ */
+struct proxy *
 proxy_match(struct galileo *env, const char *name)
 {
 	struct proxy		*pr;
+	const char		*dot;
+	size_t			 len;
 
 	if (name == NULL)
 		return (NULL);
 
-	TAILQ_FOREACH(pr, &env->sc_proxies, pr_entry) {
-		if (!strcmp(name, pr->pr_conf.host))
-			return (&pr->pr_conf);
-	}
+	len = strlen(name);
+	if ((pr = proxy_table_get(&env->sc_hosts, name, len)) != NULL)
+		return (pr);
+
+	if (env->sc_wildcards.pt_count == 0)
+		return (NULL);
 
-	return (NULL);
+	for (dot = strchr(name, '.'); dot != NULL; dot = strchr(dot + 1, '.'))
+		if ((pr = proxy_table_get(&env->sc_wildcards, dot,
+		    len - (dot - name))) != NULL)
+			return (pr);
+
+	return (proxy_table_get(&env->sc_wildcards, "", 0));
 }
 
 int
@@ -458,8 +659,14 @@ proxy_start_request(struct galileo *env, struct client *clt)
 	int			 r;
 	char			*url;
 
+	proxy_stamp(clt, TS_START);
+
+	if (env->sc_conf.max_requests != 0 &&
+	    ++proxy_requests >= env->sc_conf.max_requests)
+		proxy_drain(env, 1);
+
 	if (clt->clt_path_info == NULL) {
-		log_warnx("PATH_INFO not defined!");
+		log_warnx_limit("PATH_INFO not defined!");
 		if (proxy_start_reply(clt, 501, "text/html") == -1)
 			return (-1);
 		if (tp_error(clt->clt_tp, -1, "internal server error") == -1)
@@ -467,7 +674,7 @@ proxy_start_request(struct galileo *env, struct client *clt)
 		return (fcgi_end_request(clt, 1));
 	}
 
-	if ((clt->clt_pc = proxy_match(env, clt->clt_server_name)) == NULL) {
+	if ((clt->clt_pr = proxy_match(env, clt->clt_server_name)) == NULL) {
 		if (proxy_start_reply(clt, 501, "text/html") == -1)
 			return (-1);
 		if (tp_error(clt->clt_tp, -1, "unknown server") == -1)
@@ -475,6 +682,10 @@ proxy_start_request(struct galileo *env, struct client *clt)
 		return (fcgi_end_request(clt, 1));
 	}
 
+	/* keep this generation of the config around until we're done */
+	clt->clt_pr->pr_refs++;
+	clt->clt_pc = &clt->clt_pr->pr_conf;
+
 	if (clt->clt_bodylen != 0 && clt->clt_body == NULL) {
 		if (proxy_start_reply(clt, 400, "text/html") == -1)
 			return (-1);
@@ -526,9 +737,11 @@ proxy_resolved(struct asr_result *res, void *d)
 	struct proxy_config	*pc = clt->clt_pc;
 
 	clt->clt_evasr = NULL;
+	proxy_stamp(clt, TS_RESOLVED);
 
 	if (res->ar_gai_errno != 0) {
-		log_warnx("failed to resolve %s:%s: %s",
+		proxy_metrics.dns_errors++;
+		log_warnx_limit("failed to resolve %s:%s: %s",
 		    pc->proxy_addr, pc->proxy_port,
 		    gai_strerror(res->ar_gai_errno));
 		if (proxy_start_reply(clt, 501, "text/html") == -1)
@@ -551,10 +764,17 @@ proxy_connect(int fd, short ev, void *d)
 	struct evbuffer		*out;
 	struct addrinfo		*p;
 	struct tls_config	*conf;
-	struct timeval		 conntv = {5, 0};
-	int			 err = 0;
+	struct timeval		 conntv;
+	int			 err = 0, status = 501;
 	socklen_t		 len = sizeof(err);
 
+	if (ev == EV_TIMEOUT) {
+		clt->clt_evconn_live = 0;
+		errno = ETIMEDOUT;
+		status = 504;
+		goto err;
+	}
+
 again:
 	if (clt->clt_p == NULL)
 		goto err;
@@ -583,10 +803,13 @@ again:
 
 	clt->clt_evconn_live = 1;
 	event_set(&clt->clt_evconn, clt->clt_fd, EV_WRITE, proxy_connect, clt);
-	event_add(&clt->clt_evconn, &conntv);
+	timerclear(&conntv);
+	conntv.tv_sec = proxy_timeout(clt, clt->clt_pc->timeout_connect);
+	event_add(&clt->clt_evconn, timerisset(&conntv) ? &conntv : NULL);
 	return;
 
 done:
+	proxy_stamp(clt, TS_CONNECTED);
 	clt->clt_evconn_live = 0;
 	freeaddrinfo(clt->clt_addrinfo);
 	clt->clt_addrinfo = clt->clt_p = NULL;
@@ -608,13 +831,13 @@ done:
 		tls_config_insecure_noverifycert(conf);
 
 		if ((clt->clt_ctx = tls_client()) == NULL) {
-			log_warnx("tls_client failed");
+			log_warnx_limit("tls_client failed");
 			tls_config_free(conf);
 			goto err;
 		}
 
 		if (tls_configure(clt->clt_ctx, conf) == -1) {
-			log_warnx("tls_configure failed");
+			log_warnx_limit("tls_configure failed");
 			tls_config_free(conf);
 			goto err;
 		}
@@ -623,22 +846,29 @@ done:
 
 		if (tls_connect_socket(clt->clt_ctx, clt->clt_fd,
 			clt->clt_pc->proxy_name) == -1) {
-			log_warnx("tls_connect_socket failed");
+			log_warnx_limit("tls_connect_socket failed");
 			goto err;
 		}
 
-		event_set(&clt->clt_bev->ev_read, clt->clt_fd, EV_READ,
-		    proxy_tls_readcb, clt->clt_bev);
 		event_set(&clt->clt_bev->ev_write, clt->clt_fd, EV_WRITE,
 		    proxy_tls_writecb, clt->clt_bev);
 
 #if HAVE_LIBEVENT2
-		evbuffer_unfreeze(clt->clt_bev->input, 0);
 		evbuffer_unfreeze(clt->clt_bev->output, 1);
 #endif
 	}
 
-	/* bufferevent_settimeout(); */
+	/* read through proxy_readcb, with or without TLS */
+	event_set(&clt->clt_bev->ev_read, clt->clt_fd, EV_READ,
+	    proxy_readcb, clt->clt_bev);
+#if HAVE_LIBEVENT2
+	evbuffer_unfreeze(clt->clt_bev->input, 0);
+#endif
+
+	/* switched to the idle timeout once the reply starts */
+	bufferevent_settimeout(clt->clt_bev,
+	    proxy_timeout(clt, clt->clt_pc->timeout_firstbyte),
+	    proxy_timeout(clt, clt->clt_pc->timeout_idle));
 	bufferevent_enable(clt->clt_bev, EV_READ|EV_WRITE);
 
 	/* TODO: compute the URL */
@@ -663,9 +893,10 @@ done:
 	return;
 
 err:
-	log_warn("failed to connect to %s:%s",
+	proxy_metrics.connect_errors++;
+	log_warn_limit("failed to connect to %s:%s",
 	    clt->clt_pc->proxy_addr, clt->clt_pc->proxy_port);
-	if (proxy_start_reply(clt, 501, "text/html") == -1)
+	if (proxy_start_reply(clt, status, "text/html") == -1)
 		return;
 	if (tp_error(clt->clt_tp, -1, "Can't connect") == -1)
 		return;
@@ -694,7 +925,7 @@ parse_mime(struct client *clt, char *mime, char *lang, size_t len)
 			if (!strncasecmp(t, "utf8", 4) ||
 			    !strncasecmp(t, "utf-8", 5) ||
 			    !strncasecmp(t, "ascii", 5)) {
-				log_debug("unknown charset %s", t);
+				log_debugv("unknown charset %s", t);
 				return (-1);
 			}
 			continue;
@@ -706,7 +937,7 @@ parse_mime(struct client *clt, char *mime, char *lang, size_t len)
 				*semi = '\0';
 
 			if (strlcpy(lang, t, len) >= len) {
-				log_debug("lang too long: %s", t);
+				log_debugv("lang too long: %s", t);
 				*lang = '\0';
 			}
 
@@ -719,12 +950,150 @@ parse_mime(struct client *clt, char *mime, char *lang, size_t len)
 	return (0);
 }
 
+/*
+ * Compute a strong validator for the buffered upstream reply.  It
+ * has to change whenever the generated reply changes, so it covers
+ * the meta, the proxy settings that affect the HTML and the content
+ * encoding too.  A collision means serving a stale page with a 304,
+ * hence SHA-256, truncated to ETAG_HASHLEN bytes.  The strings are
+ * hashed with their NUL so they can't run into each other.
+ */
+static void
+proxy_etag(struct client *clt)
+{
+	static const char	 hex[] = "0123456789abcdef";
+	struct proxy_config	*pc = clt->clt_pc;
+	struct evbuffer		*src = EVBUFFER_INPUT(clt->clt_bev);
+	EVP_MD_CTX		*ctx;
+	unsigned char		 md[EVP_MAX_MD_SIZE];
+	const char		*enc = "";
+	char			*t = clt->clt_etag;
+	size_t			 len, i;
+	int			 r;
+
+	*clt->clt_etag = '\0';
+	len = EVBUFFER_LENGTH(src);
+
+	if ((ctx = EVP_MD_CTX_new()) == NULL ||
+	    !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) ||
+	    !EVP_DigestUpdate(ctx, &len, sizeof(len)) ||
+	    !EVP_DigestUpdate(ctx, EVBUFFER_DATA(src), len) ||
+	    !EVP_DigestUpdate(ctx, clt->clt_mime, strlen(clt->clt_mime) + 1) ||
+	    !EVP_DigestUpdate(ctx, clt->clt_lang, strlen(clt->clt_lang) + 1) ||
+	    !EVP_DigestUpdate(ctx, pc->stylesheet,
+	    strlen(pc->stylesheet) + 1) ||
+	    !EVP_DigestUpdate(ctx, &pc->flags, sizeof(pc->flags)) ||
+	    !EVP_DigestFinal_ex(ctx, md, NULL)) {
+		log_warnx("%s: failed to hash the reply", __func__);
+		EVP_MD_CTX_free(ctx);
+		return;
+	}
+	EVP_MD_CTX_free(ctx);
+
+	if ((pc->flags & PROXY_COMPRESS) &&
+	    (clt->clt_translate || !strncmp(clt->clt_mime, "text/", 5))) {
+		if (clt->clt_accept_enc & ENC_GZIP)
+			enc = "-gz";
+		else if (clt->clt_accept_enc & ENC_DEFLATE)
+			enc = "-df";
+	}
+
+	for (i = 0; i < ETAG_HASHLEN; ++i) {
+		*t++ = hex[md[i] >> 4];
+		*t++ = hex[md[i] & 0xf];
+	}
+
+	len = sizeof(clt->clt_etag) - (t - clt->clt_etag);
+	r = snprintf(t, len, "-%zx%s", EVBUFFER_LENGTH(src), enc);
+	if (r < 0 || (size_t)r >= len)
+		*clt->clt_etag = '\0';
+}
+
+/*
+ * Check the etag against the If-None-Match list using the weak
+ * comparison.
+ */
+static int
+proxy_etag_match(struct client *clt)
+{
+	char		*inm, *t, *s;
+	size_t		 len;
+
+	if (clt->clt_inm == NULL || *clt->clt_etag == '\0')
+		return (0);
+
+	len = strlen(clt->clt_etag);
+	inm = clt->clt_inm;
+	while ((t = strsep(&inm, ",")) != NULL) {
+		t += strspn(t, " \t");
+		if (*t == '*')
+			return (1);
+		if (!strncmp(t, "W/", 2))
+			t += 2;
+		if (*t++ != '"')
+			continue;
+		if ((s = strchr(t, '"')) == NULL)
+			continue;
+		if ((size_t)(s - t) == len && !strncmp(t, clt->clt_etag, len))
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Emit the Cache-Control and Expires headers according to the policy
+ * for translated pages or for the other media.
+ */
+static int
+proxy_cache_headers(struct client *clt)
+{
+	struct template		*tp = clt->clt_tp;
+	struct cache_policy	*cp;
+	struct tm		 tm;
+	time_t			 t;
+	char			 date[64];
+
+	if (clt->clt_translate)
+		cp = &clt->clt_pc->cache_pages;
+	else
+		cp = &clt->clt_pc->cache_media;
+
+	if (!(cp->cp_flags & CACHE_SET))
+		return (0);
+
+	if (tp_writes(tp, "Cache-Control: ") == -1)
+		return (-1);
+	if ((cp->cp_flags & CACHE_PUBLIC) && tp_writes(tp, "public, ") == -1)
+		return (-1);
+	if ((cp->cp_flags & CACHE_PRIVATE) &&
+	    tp_writes(tp, "private, ") == -1)
+		return (-1);
+	if (tp_writef(tp, "max-age=%d", cp->cp_maxage) == -1)
+		return (-1);
+	if (cp->cp_swr != 0 &&
+	    tp_writef(tp, ", stale-while-revalidate=%d", cp->cp_swr) == -1)
+		return (-1);
+	if (tp_writes(tp, "\r\n") == -1)
+		return (-1);
+
+	/* for HTTP/1.0 caches */
+	t = time(NULL) + cp->cp_maxage;
+	if (gmtime_r(&t, &tm) == NULL ||
+	    strftime(date, sizeof(date), "%a, %d %b %Y %T GMT", &tm) == 0)
+		return (0);
+	return (tp_writef(tp, "Expires: %s\r\n", date));
+}
+
 int
 proxy_start_reply(struct client *clt, int status, const char *ctype)
 {
 	struct template	*tp = clt->clt_tp;
 	const char	*csp;
 
+	proxy_stamp(clt, TS_HEADERS);
+	clt->clt_status = status;
+
 	csp = "Content-Security-Policy: default-src 'self'; "
 	    "script-src 'none'; object-src 'none';\r\n";
 
@@ -735,6 +1104,15 @@ proxy_start_reply(struct client *clt, int status, const char *ctype)
 	if (tp_writes(tp, csp) == -1)
 		return (-1);
 
+	if ((status == 200 || status == 304) && *clt->clt_etag != '\0' &&
+	    tp_writef(tp, "ETag: \"%s\"\r\n", clt->clt_etag) == -1)
+		return (-1);
+
+	/* only the replies to a 2x are cacheable */
+	if ((status == 200 || status == 304) && clt->clt_mime != NULL &&
+	    proxy_cache_headers(clt) == -1)
+		return (-1);
+
 	if (status == 302) {
 		/* use "ctype" as redirect target */
 		if (tp_writef(tp, "Location: %s\r\n", ctype) == -1)
@@ -752,29 +1130,133 @@ proxy_start_reply(struct client *clt, int status, const char *ctype)
 			return (-1);
 	}
 
+	if (status == 200 && ctype != NULL && clt->clt_pc != NULL &&
+	    (clt->clt_pc->flags & PROXY_COMPRESS) &&
+	    !strncmp(ctype, "text/", 5)) {
+		if (tp_writes(tp, "Vary: Accept-Encoding\r\n") == -1)
+			return (-1);
+
+		if (clt->clt_accept_enc != 0) {
+			/* the headers are terminated by clt_compress */
+			if (clt_flush(clt) == -1)
+				return (-1);
+			return (clt_compress(clt));
+		}
+	}
+
 	if (tp_writes(tp, "\r\n") == -1)
 		return (-1);
 
 	return (0);
 }
 
+/*
+ * The timeout, in seconds, capped by what's left of the total one.
+ * 0 means none.
+ */
+int
+proxy_timeout(struct client *clt, int timeout)
+{
+	struct proxy_config	*pc = clt->clt_pc;
+	uint64_t		 elapsed;
+	int			 left = 1;
+
+	if (pc->timeout_total == 0)
+		return (timeout);
+
+	elapsed = (proxy_now() - clt->clt_ts[TS_START]) / 1000000;
+	if (elapsed < (uint64_t)pc->timeout_total)
+		left = pc->timeout_total - elapsed;
+	if (timeout == 0 || left < timeout)
+		return (left);
+	return (timeout);
+}
+
+/*
+ * Check the size of the response and the total timeout; the others
+ * are the bufferevent timeouts.
+ */
+int
+proxy_limits(struct client *clt)
+{
+	struct proxy_config	*pc = clt->clt_pc;
+
+	if (pc->max_response != 0 && clt->clt_bytes_in > pc->max_response) {
+		log_warnx_limit("response from %s too big", pc->proxy_name);
+		proxy_fail(clt, 502, "Response too big");
+		return (-1);
+	}
+
+	if (pc->timeout_total != 0 && proxy_now() - clt->clt_ts[TS_START] >
+	    (uint64_t)pc->timeout_total * 1000000) {
+		log_warnx_limit("timeout waiting for %s", pc->proxy_name);
+		proxy_fail(clt, 504, "Gateway timeout");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Give up on the request: send an error page if the reply didn't
+ * start yet, otherwise truncate it.
+ */
+void
+proxy_fail(struct client *clt, int status, const char *msg)
+{
+	if (!clt->clt_headersdone) {
+		clt->clt_etagwait = 0;
+		if (proxy_start_reply(clt, status, "text/html") == -1)
+			return;
+		if (tp_error(clt->clt_tp, -1, msg) == -1)
+			return;
+	}
+	fcgi_end_request(clt, 1);
+}
+
 void
 proxy_read(struct bufferevent *bev, void *d)
 {
 	struct client		*clt = d;
 	struct evbuffer		*src = EVBUFFER_INPUT(bev);
-	const char		*ctype;
 	char			 buf[1025];
-	char			 lang[16];
+	struct proxy_config	*pc = clt->clt_pc;
 	char			*hdr, *mime;
 	size_t			 len;
-	int			 code;
+	int			 code, idle;
+
+	if (clt->clt_ts[TS_FIRSTBYTE] == 0 || pc->timeout_total != 0) {
+		idle = proxy_timeout(clt, pc->timeout_idle);
+		bufferevent_settimeout(bev, idle, idle);
+	}
+	proxy_stamp(clt, TS_FIRSTBYTE);
+
+	if (proxy_limits(clt) == -1)
+		return;
 
 	if (clt->clt_headersdone) {
-		if (clt->clt_translate)
-			proxy_translate_gemtext(clt);
-		else
+		if (!clt->clt_translate) {
 			clt_write_bufferevent(clt, bev);
+			return;
+		}
+
+		/* commit what was produced before going back to the loop */
+		if (proxy_translate_gemtext(clt) == 0)
+			clt_flush(clt);
+		return;
+	}
+
+	/* buffering the whole reply to compute the ETag */
+	if (clt->clt_etagwait) {
+		if (EVBUFFER_LENGTH(src) <= ETAG_MAXSIZE)
+			return;
+
+		/* too big, just stream it */
+		clt->clt_etagwait = 0;
+		clt->clt_reval = REVAL_SKIP;
+		if (proxy_start_body(clt) == -1)
+			return;
+		proxy_read(bev, d);
 		return;
 	}
 
@@ -789,12 +1271,14 @@ proxy_read(struct bufferevent *bev, void *d)
 	    !isdigit((unsigned char)hdr[0]) ||
 	    !isdigit((unsigned char)hdr[1]) ||
 	    hdr[2] != ' ') {
-		log_warnx("invalid ");
+		log_warnx_limit("invalid reply header from %s",
+		    clt->clt_pc->proxy_name);
 		proxy_error(bev, EV_READ, clt);
 		goto err;
 	}
 
 	code = (hdr[0] - '0') * 10 + (hdr[1] - '0');
+	clt->clt_code = code;
 
 	switch (hdr[0]) {
 	case '1':
@@ -825,7 +1309,8 @@ proxy_read(struct bufferevent *bev, void *d)
 	}
 
 	mime = hdr + 2 + strspn(hdr + 2, " \t");
-	if (parse_mime(clt, mime, lang, sizeof(lang)) == -1) {
+	if (parse_mime(clt, mime, clt->clt_lang, sizeof(clt->clt_lang))
+	    == -1) {
 		if (proxy_start_reply(clt, 501, "text/html") == -1)
 			goto err;
 		if (tp_error(clt->clt_tp, -1, "Bad response") == -1)
@@ -834,22 +1319,15 @@ proxy_read(struct bufferevent *bev, void *d)
 		goto err;
 	}
 
-	if (clt->clt_translate)
-		ctype = "text/html;charset=utf-8";
-	else
-		ctype = mime;
-
-	if (tp_writef(clt->clt_tp, "Content-Type: %s\r\n\r\n", ctype) == -1)
-		goto err;
-
-	clt->clt_headersdone = 1;
-
-	if (clt->clt_translate &&
-	    tp_head(clt->clt_tp, lang, NULL) == -1)
+	if ((clt->clt_mime = strdup(mime)) == NULL) {
+		log_warn("strdup");
+		fcgi_abort_request(clt);
 		goto err;
+	}
 
-	if (!clt->clt_translate &&
-	    template_flush(clt->clt_tp) == -1)
+	if (clt->clt_pc->flags & PROXY_ETAG)
+		clt->clt_etagwait = 1;
+	else if (proxy_start_body(clt) == -1)
 		goto err;
 
 	/*
@@ -864,6 +1342,26 @@ err:
 	free(hdr);
 }
 
+int
+proxy_start_body(struct client *clt)
+{
+	const char		*ctype;
+
+	if (clt->clt_translate)
+		ctype = "text/html";
+	else
+		ctype = clt->clt_mime;
+
+	if (proxy_start_reply(clt, 200, ctype) == -1)
+		return (-1);
+
+	clt->clt_headersdone = 1;
+
+	if (clt->clt_translate)
+		return (tp_head(clt->clt_tp, clt->clt_lang, NULL));
+	return (clt_flush(clt));
+}
+
 void
 proxy_write(struct bufferevent *bev, void *d)
 {
@@ -877,9 +1375,38 @@ proxy_error(struct bufferevent *bev, short err, void *d)
 	struct template		*tp = clt->clt_tp;
 	int			 status = !(err & EVBUFFER_EOF);
 
-	log_debug("proxy error, shutting down the connection (err: %x)",
+	log_debugv("proxy error, shutting down the connection (err: %x)",
 	    err);
 
+	if (err & EVBUFFER_TIMEOUT) {
+		log_warnx_limit("timeout waiting for %s",
+		    clt->clt_pc->proxy_name);
+		proxy_fail(clt, 504, "Gateway timeout");
+		return;
+	}
+
+	if (clt->clt_etagwait && status == 0) {
+		clt->clt_etagwait = 0;
+
+		proxy_etag(clt);
+		if (proxy_etag_match(clt)) {
+			clt->clt_reval = REVAL_HIT;
+			if (proxy_start_reply(clt, 304, NULL) == -1)
+				return;
+			fcgi_end_request(clt, 0);
+			return;
+		}
+		clt->clt_reval = REVAL_MISS;
+
+		if (proxy_start_body(clt) == -1)
+			return;
+		if (clt->clt_translate) {
+			if (proxy_translate_gemtext(clt) == -1)
+				return;
+		} else if (clt_write_bufferevent(clt, bev) == -1)
+			return;
+	}
+
 	if (!clt->clt_headersdone) {
 		if (proxy_start_reply(clt, 501, "text/html") == -1)
 			return;
@@ -913,7 +1440,7 @@ proxy_error(struct bufferevent *bev, short err, void *d)
 }
 
 void
-proxy_tls_readcb(int fd, short event, void *arg)
+proxy_readcb(int fd, short event, void *arg)
 {
 	struct bufferevent	*bufev = arg;
 	struct client		*clt = bufev->cbarg;
@@ -931,14 +1458,21 @@ proxy_tls_readcb(int fd, short event, void *arg)
 	if (bufev->wm_read.high != 0)
 		howmuch = MINIMUM(sizeof(rbuf), bufev->wm_read.high);
 
-	ret = tls_read(clt->clt_ctx, rbuf, howmuch);
-	if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) {
-		goto retry;
-	} else if (ret == -1) {
+	if (clt->clt_ctx == NULL) {
+		ret = read(fd, rbuf, howmuch);
+		if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+			goto retry;
+	} else {
+		ret = tls_read(clt->clt_ctx, rbuf, howmuch);
+		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT)
+			goto retry;
+	}
+	if (ret == -1) {
 		what |= EVBUFFER_ERROR;
 		goto err;
 	}
 	len = ret;
+	clt->clt_bytes_in += len;
 
 	if (len == 0) {
 		what |= EVBUFFER_EOF;
@@ -971,6 +1505,9 @@ retry:
 	return;
 
 err:
+	if (clt->clt_ctx != NULL && (what & EVBUFFER_ERROR) &&
+	    clt->clt_ts[TS_HANDSHAKE] == 0)
+		proxy_metrics.tls_errors++;
 	(*bufev->errorcb)(bufev, what, bufev->cbarg);
 }
 
@@ -1014,6 +1551,7 @@ proxy_tls_writecb(int fd, short event, void *arg)
 		}
 		len = ret;
 		evbuffer_drain(bufev->output, len);
+		proxy_stamp(clt, TS_HANDSHAKE);
 	}
 
 	if (EVBUFFER_LENGTH(bufev->output) != 0)
@@ -1030,12 +1568,235 @@ retry:
 	return;
 
 err:
+	if (clt->clt_ctx != NULL && (what & EVBUFFER_ERROR) &&
+	    clt->clt_ts[TS_HANDSHAKE] == 0)
+		proxy_metrics.tls_errors++;
 	(*bufev->errorcb)(bufev, what, bufev->cbarg);
 }
 
+uint64_t
+proxy_now(void)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return (0);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* record when a phase of the request ended, only the first time */
+void
+proxy_stamp(struct client *clt, int ts)
+{
+	if (clt->clt_ts[ts] == 0)
+		clt->clt_ts[ts] = proxy_now();
+}
+
+static uint64_t
+lat(struct client *clt, int from, int to)
+{
+	if (clt->clt_ts[from] == 0 || clt->clt_ts[to] == 0 ||
+	    clt->clt_ts[to] < clt->clt_ts[from])
+		return (UINT64_MAX);
+	return (clt->clt_ts[to] - clt->clt_ts[from]);
+}
+
+/* append s, %-encoding what would break the record apart */
+static int
+proxy_accesslog_str(struct evbuffer *buf, const char *s)
+{
+	const char	*t;
+	size_t		 len;
+
+	if (s == NULL || *s == '\0')
+		return (evbuffer_add(buf, "-", 1));
+
+	/* a Gemini URL can't be longer than this anyway */
+	len = strnlen(s, GEMINI_MAXLEN - 1);
+	while (len > 0) {
+		for (t = s; t < s + len; ++t)
+			if ((unsigned char)*t <= ' ' ||
+			    (unsigned char)*t >= 0x7f ||
+			    *t == '"' || *t == '%' || *t == '\\')
+				break;
+		if (t != s && evbuffer_add(buf, s, t - s) == -1)
+			return (-1);
+		len -= t - s;
+		s = t;
+		if (len == 0)
+			break;
+		if (evbuffer_add_printf(buf, "%%%02X",
+		    (unsigned char)*s) == -1)
+			return (-1);
+		s++;
+		len--;
+	}
+	return (0);
+}
+
+/*
+ * Add a record for the request to the batch for the access log, one
+ * line of key=value pairs.  The timings are in milliseconds, and "-"
+ * for the phases that weren't reached.
+ */
+static void
+proxy_accesslog_add(struct galileo *env, struct client *clt, uint64_t *us)
+{
+	static const char	*reval[] = { "-", "hit", "miss", "skip" };
+	static const char	*keys[LAT_MAX] = {
+		"dns", "connect", "tls", "ttfb", "headers", "body",
+		"translate", "write", "total",
+	};
+	static time_t		 last;
+	static char		 date[32];
+	struct evbuffer		*buf;
+	struct tm		 tm;
+	time_t			 now;
+	int			 i;
+
+	if (proxy_accesslog == NULL &&
+	    (proxy_accesslog = evbuffer_new()) == NULL) {
+		log_warn("%s: evbuffer_new", __func__);
+		return;
+	}
+	buf = proxy_accesslog;
+
+	if ((now = time(NULL)) != last) {
+		last = now;
+		if (gmtime_r(&now, &tm) == NULL ||
+		    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ",
+		    &tm) == 0)
+			(void)strlcpy(date, "-", sizeof(date));
+	}
+
+	if (evbuffer_add_printf(buf, "time=%s host=", date) == -1 ||
+	    proxy_accesslog_str(buf, clt->clt_server_name) == -1 ||
+	    evbuffer_add(buf, " path=", 6) == -1 ||
+	    proxy_accesslog_str(buf, clt->clt_path_info) == -1 ||
+	    evbuffer_add_printf(buf, " query=%zu status=%d",
+	    clt->clt_query ? strlen(clt->clt_query) : 0,
+	    clt->clt_status) == -1)
+		goto err;
+
+	if (clt->clt_code != 0)
+		i = evbuffer_add_printf(buf, " upstream=%d", clt->clt_code);
+	else
+		i = evbuffer_add(buf, " upstream=-", 11);
+	if (i == -1)
+		goto err;
+
+	if (evbuffer_add_printf(buf, " in=%zu out=%zu cache=%s",
+	    clt->clt_bytes_in, clt->clt_bytes_out,
+	    reval[clt->clt_reval]) == -1)
+		goto err;
+
+	for (i = 0; i < LAT_MAX; ++i) {
+		if (us[i] == UINT64_MAX) {
+			if (evbuffer_add_printf(buf, " %s=-", keys[i]) == -1)
+				goto err;
+		} else if (evbuffer_add_printf(buf, " %s=%.1f", keys[i],
+		    us[i] / 1000.0) == -1)
+			goto err;
+	}
+
+	if (evbuffer_add(buf, "\n", 1) == -1)
+		goto err;
+
+	if (EVBUFFER_LENGTH(buf) >= ACCESSLOG_BATCH)
+		proxy_accesslog_flush(env);
+	return;
+
+err:
+	log_warn("%s: dropping the batch", __func__);
+	evbuffer_drain(buf, EVBUFFER_LENGTH(buf));
+}
+
+/*
+ * Add the request to the counters of the process and its latencies
+ * to the histograms of its proxy, and log it to the access log and,
+ * if slow, with log.c.  The phases that weren't reached are left out.
+ */
+static void
+proxy_account(struct galileo *env, struct client *clt)
+{
+	struct proxy_metrics	*pm = &proxy_metrics;
+	struct proxy_stats	*st = NULL;
+	uint64_t		 us[LAT_MAX], ms;
+	int			 i, b, sent;
+
+	/* never got to the request */
+	if (clt->clt_ts[TS_START] == 0)
+		return;
+
+	if (clt->clt_pr != NULL)
+		st = clt->clt_pr->pr_stats;
+
+	proxy_stamp(clt, TS_DONE);
+
+	/* with TLS the first byte comes after the handshake */
+	sent = clt->clt_ts[TS_HANDSHAKE] ? TS_HANDSHAKE : TS_CONNECTED;
+
+	us[LAT_DNS] = lat(clt, TS_START, TS_RESOLVED);
+	us[LAT_CONNECT] = lat(clt, TS_RESOLVED, TS_CONNECTED);
+	us[LAT_TLS] = lat(clt, TS_CONNECTED, TS_HANDSHAKE);
+	us[LAT_TTFB] = lat(clt, sent, TS_FIRSTBYTE);
+	us[LAT_HEADERS] = lat(clt, TS_FIRSTBYTE, TS_HEADERS);
+	us[LAT_BODY] = lat(clt, TS_HEADERS, TS_END);
+	us[LAT_TRANSLATE] = clt->clt_translate ? clt->clt_translate_us :
+	    UINT64_MAX;
+	us[LAT_WRITE] = lat(clt, TS_END, TS_DONE);
+	us[LAT_TOTAL] = lat(clt, TS_START, TS_DONE);
+
+	pm->requests++;
+	pm->bytes_in += clt->clt_bytes_in;
+	pm->bytes_out += clt->clt_bytes_out;
+	if (clt->clt_status >= 100 && clt->clt_status < 600)
+		pm->status[clt->clt_status / 100 - 1]++;
+	if (clt->clt_status == 304)
+		pm->not_modified++;
+
+	if (st != NULL)
+		st->st_requests++;
+	for (i = 0; i < LAT_MAX; ++i) {
+		if (us[i] == UINT64_MAX)
+			continue;
+		for (b = 0, ms = us[i] / 1000; ms != 0 && b < LAT_BUCKETS - 1;
+		    ms >>= 1)
+			b++;
+		pm->lat[i][b]++;
+		pm->lat_sum[i] += us[i];
+		if (st != NULL)
+			st->st_hist[i][b]++;
+	}
+
+	if (env->sc_conf.access_log != ACCESSLOG_NONE)
+		proxy_accesslog_add(env, clt, us);
+
+	if (st == NULL || env->sc_conf.slow_threshold == 0 ||
+	    us[LAT_TOTAL] == UINT64_MAX ||
+	    us[LAT_TOTAL] < (uint64_t)env->sc_conf.slow_threshold * 1000)
+		return;
+
+	for (i = 0; i < LAT_MAX; ++i)
+		if (us[i] == UINT64_MAX)
+			us[i] = 0;
+
+	log_info("slow request: host=%s path=%s status=%d total=%.1fms "
+	    "dns=%.1fms connect=%.1fms tls=%.1fms ttfb=%.1fms "
+	    "headers=%.1fms body=%.1fms translate=%.1fms write=%.1fms",
+	    clt->clt_server_name, clt->clt_path_info, clt->clt_status,
+	    us[LAT_TOTAL] / 1000.0, us[LAT_DNS] / 1000.0,
+	    us[LAT_CONNECT] / 1000.0, us[LAT_TLS] / 1000.0,
+	    us[LAT_TTFB] / 1000.0, us[LAT_HEADERS] / 1000.0,
+	    us[LAT_BODY] / 1000.0, us[LAT_TRANSLATE] / 1000.0,
+	    us[LAT_WRITE] / 1000.0);
+}
+
 void
 proxy_client_free(struct client *clt)
 {
+	proxy_account(clt->clt_fcgi->fcg_env, clt);
+
 	if (clt->clt_evasr)
 		event_asr_abort(clt->clt_evasr);
 
@@ -1055,11 +1816,19 @@ proxy_client_free(struct client *clt)
 		bufferevent_free(clt->clt_bev);
 
 	template_free(clt->clt_tp);
+	clt_compress_free(clt);
 
 	free(clt->clt_body);
+	free(clt->clt_mime);
+	free(clt->clt_inm);
 	free(clt->clt_server_name);
 	free(clt->clt_script_name);
 	free(clt->clt_path_info);
 	free(clt->clt_query);
+
+	if (clt->clt_pr != NULL)
+		proxy_release(clt->clt_fcgi->fcg_env, clt->clt_pr);
 	free(clt);
+
+	proxy_clients--;
 }
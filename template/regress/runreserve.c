@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2025 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tmpl.h"
+
+int	 base(struct template *, const char *title);
+int	 my_reserve(void *, char **, size_t *);
+int	 my_write(void *, const void *, size_t);
+
+/* use ridiculously small regions in regress */
+#define REGION	3
+
+static char	*region;
+static int	 reserved, committed;
+
+int
+my_reserve(void *arg, char **buf, size_t *cap)
+{
+	if (region != NULL)
+		errx(1, "region reserved twice");
+
+	if ((region = malloc(REGION)) == NULL)
+		err(1, "malloc");
+	reserved++;
+
+	*buf = region;
+	*cap = REGION;
+	return (0);
+}
+
+int
+my_write(void *arg, const void *s, size_t len)
+{
+	FILE	*fp = arg;
+
+	if (region == NULL || s != region)
+		errx(1, "committing a region not reserved");
+	if (len == 0 || len > REGION)
+		errx(1, "committing %zu bytes of %d", len, REGION);
+
+	if (fwrite(s, 1, len, fp) != len)
+		return (-1);
+
+	free(region);
+	region = NULL;
+	committed++;
+	return (0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct template	*tp;
+
+	if ((tp = template_reserve(stdout, my_reserve, my_write)) == NULL)
+		err(1, "template_reserve");
+
+	if (base(tp, " *hello* ") == -1 ||
+	    template_flush(tp) == -1)
+		return (1);
+	puts("");
+
+	if (base(tp, "<hello>") == -1 ||
+	    template_flush(tp) == -1)
+		return (1);
+	puts("");
+
+	template_free(tp);
+
+	if (region != NULL || reserved != committed)
+		errx(1, "%d regions reserved, %d committed", reserved,
+		    committed);
+	return (0);
+}
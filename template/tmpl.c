@@ -32,7 +32,13 @@ tp_write(struct template *tp, const char *str, size_t len)
 		if (avail == 0) {
 			if (template_flush(tp) == -1)
 				return (-1);
+			if (tp->tp_reserve != NULL &&
+			    tp->tp_reserve(tp->tp_arg, &tp->tp_buf,
+			    &tp->tp_cap) == -1)
+				return (-1);
 			avail = tp->tp_cap;
+			if (avail == 0)
+				return (-1);
 		}
 
 		if (len < avail)
@@ -150,15 +156,39 @@ template(void *arg, tmpl_write writefn, char *buf, size_t siz)
 	return (tp);
 }
 
+/*
+ * Like template() but instead of using a fixed buffer, ask the
+ * reservefn for a region where to write when needed.  writefn is
+ * called to commit the region on flush; the region is not used
+ * anymore afterwards.
+ */
+struct template *
+template_reserve(void *arg, tmpl_reserve reservefn, tmpl_write writefn)
+{
+	struct template *tp;
+
+	if ((tp = calloc(1, sizeof(*tp))) == NULL)
+		return (NULL);
+
+	tp->tp_arg = arg;
+	tp->tp_write = writefn;
+	tp->tp_reserve = reservefn;
+
+	return (tp);
+}
+
 int
 template_flush(struct template *tp)
 {
-	if (tp->tp_len == 0)
-		return (0);
-
-	if (tp->tp_write(tp->tp_arg, tp->tp_buf, tp->tp_len) == -1)
+	if (tp->tp_len != 0 &&
+	    tp->tp_write(tp->tp_arg, tp->tp_buf, tp->tp_len) == -1)
 		return (-1);
+
 	tp->tp_len = 0;
+	if (tp->tp_reserve != NULL) {
+		tp->tp_buf = NULL;
+		tp->tp_cap = 0;
+	}
 	return (0);
 }
 
@@ -20,11 +20,13 @@
 struct template;
 
 typedef int (*tmpl_write)(void *, const void *, size_t);
+typedef int (*tmpl_reserve)(void *, char **, size_t *);
 
 struct template {
 	void		*tp_arg;
 	char		*tp_tmp;
 	tmpl_write	 tp_write;
+	tmpl_reserve	 tp_reserve;
 	char		*tp_buf;
 	size_t		 tp_len;
 	size_t		 tp_cap;
@@ -38,6 +40,7 @@ int	 tp_urlescape(struct template *, const char *);
 int	 tp_htmlescape(struct template *, const char *);
 
 struct template	*template(void *, tmpl_write, char *, size_t);
+struct template	*template_reserve(void *, tmpl_reserve, tmpl_write);
 int		 template_flush(struct template *);
 void		 template_free(struct template *);
 